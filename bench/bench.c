@@ -0,0 +1,453 @@
+#define _GNU_SOURCE         /* statx(), fmemopen() */
+
+/*
+ * bench: microbenchmarks for the hot paths of liblsdir.
+ *
+ *     make bench
+ *     bench/bench                               run everything
+ *     bench/bench -n 20000 -r 15 long columns   more entries and repetitions, two benchmarks
+ *     bench/bench --save=bench/baseline.txt     record a baseline
+ *     bench/bench --baseline=bench/baseline.txt compare against it
+ *
+ * The library's formatting and sorting helpers are static, so this is a
+ * test build: src/lsdir.c is compiled into this file with malloc(),
+ * calloc() and realloc() counted, and each benchmark calls the functions
+ * ls itself uses over generated entries (names modeled on /usr/lib and
+ * photo folders, a mix of file types, sizes, owners and times; fixed seed,
+ * so every run sees the same input). Text goes into a memory stream that
+ * is rewound per call, so no I/O is measured.
+ *
+ * Each benchmark is warmed up, then timed over -r repetitions of enough
+ * calls to last BENCH_REP_NS; the fastest repetition is reported (the
+ * others lost time to something else) per entry as ns/op, cycles/op (TSC
+ * reference cycles, x86 only) and allocations/op. With --baseline, a
+ * benchmark more than --threshold percent slower than the baseline, or
+ * allocating more, is marked and the exit status is 1. Numbers are only
+ * comparable on the same machine with the same CFLAGS; on a shared or
+ * frequency-scaled machine, raise -r and the threshold.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static unsigned long bench_allocs;
+
+static void *bench_malloc(size_t size)
+{
+    bench_allocs++;
+    return malloc(size);
+}
+
+static void *bench_calloc(size_t n, size_t size)
+{
+    bench_allocs++;
+    return calloc(n, size);
+}
+
+static void *bench_realloc(void *p, size_t size)
+{
+    bench_allocs++;
+    return realloc(p, size);
+}
+
+#define malloc bench_malloc
+#define calloc bench_calloc
+#define realloc bench_realloc
+#include "lsdir.c"
+#undef malloc
+#undef calloc
+#undef realloc
+
+#define BENCH_WARMUP_NS  50000000LL  /* per benchmark, before the timed repetitions */
+#define BENCH_REP_NS     20000000LL  /* at least this long per repetition */
+#define BENCH_MAX        32
+
+/* ────────────── Generated input ────────────── */
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned int rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state >> 32;
+}
+
+static const char *const words[] = {
+    "lib", "python3", "gtk", "x11", "perl", "ssl", "crypto", "systemd", "dbus", "glib",
+    "config", "readme", "changelog", "copyright", "index", "main", "util", "test", "data", "cache"
+};
+static const char *const exts[] = { ".so", ".so.6", ".h", ".c", ".txt", ".gz", ".tar.gz", ".conf", ".py", "" };
+
+/* One name: library-, document- or photo-style, with a few that need quoting. */
+static void gen_name(char *buf, size_t size, int i)
+{
+    unsigned int r = rng() % 100;
+    const char *w = words[rng() % (sizeof(words) / sizeof(words[0]))];
+    const char *x = exts[rng() % (sizeof(exts) / sizeof(exts[0]))];
+
+    if (r < 40)
+        snprintf(buf, size, "%s%s-%u.%u%s.%d", w, words[rng() % 20], rng() % 10, rng() % 30, x, i);
+    else if (r < 70)
+        snprintf(buf, size, "%s_%s%s%d%s", w, words[rng() % 20], rng() % 2 ? "-" : "", i, x);
+    else if (r < 90)
+        snprintf(buf, size, "IMG_%06d.JPG", i);
+    else if (r < 97)
+        snprintf(buf, size, "%s %s (%d)%s", w, words[rng() % 20], i, x);
+    else
+        snprintf(buf, size, "caf\xc3\xa9-%s-%d", w, i);
+}
+
+static void gen_stat(struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    unsigned int r = rng() % 100;
+    mode_t type = r < 15 ? S_IFDIR : r < 97 ? S_IFREG : r < 98 ? S_IFIFO : r < 99 ? S_IFCHR : S_IFSOCK;
+    mode_t perm = type == S_IFDIR ? 0755 : rng() % 10 == 0 ? 0755 : rng() % 50 == 0 ? 04755 : 0644;
+    st->st_mode = type | perm;
+    st->st_nlink = type == S_IFDIR ? 2 + rng() % 40 : 1;
+    static const unsigned int ids[] = { 0, 0, 0, 1000, 65534 };
+    st->st_uid = ids[rng() % 5];
+    st->st_gid = ids[rng() % 5];
+    st->st_size = type == S_IFREG ? (off_t)1 << (rng() % 30) : type == S_IFDIR ? 4096 : 0;
+    st->st_size += st->st_size ? rng() % st->st_size : 0;
+    st->st_blocks = (st->st_size + 4095) / 4096 * 8;
+    st->st_ino = 1000000 + rng() % 50000000;
+    st->st_mtime = time(NULL) - rng() % (365 * 24 * 3600);
+}
+
+struct bench_input
+{
+    int n;
+    struct ls_entry *sorted;    /* entries in name order */
+    struct ls_entry *shuffled;  /* the same in random order */
+    struct ls_entry *work;      /* scratch for the sort */
+    mode_t *modes;
+    struct ls_options o;
+    struct ls_sink *sink;       /* text sink writing into buf */
+    char *buf;
+    size_t buf_size;
+};
+
+static void input_build(struct bench_input *in, int n)
+{
+    in->n = n;
+    in->sorted = calloc(n, sizeof(struct ls_entry));
+    in->shuffled = calloc(n, sizeof(struct ls_entry));
+    in->work = calloc(n, sizeof(struct ls_entry));
+    in->modes = calloc(n, sizeof(mode_t));
+    if (!in->sorted || !in->shuffled || !in->work || !in->modes) { perror("calloc"); exit(EXIT_FAILURE); }
+
+    for (int i = 0; i < n; i++)
+    {
+        char name[256];
+        gen_name(name, sizeof(name), i);
+        if (!(in->shuffled[i].name = strdup(name))) { perror("strdup"); exit(EXIT_FAILURE); }
+        gen_stat(&in->shuffled[i].st);
+        in->modes[i] = in->shuffled[i].st.st_mode;
+    }
+
+    ls_options_init(&in->o);
+    in->o.quoting = LS_QUOTE_QUESTION;
+    in->o.width = 120;
+    names_prepare(&in->o, in->shuffled, n);
+    memcpy(in->sorted, in->shuffled, n * sizeof(struct ls_entry));
+    qsort(in->sorted, n, sizeof(struct ls_entry), cmpstring);
+
+    /* Long rows run about 80 bytes, plus color codes and padding. */
+    in->buf_size = (size_t)n * 256 + 65536;
+    if (!(in->buf = malloc(in->buf_size))) { perror("malloc"); exit(EXIT_FAILURE); }
+    FILE *fp = fmemopen(in->buf, in->buf_size, "w");
+    if (!fp) { perror("fmemopen"); exit(EXIT_FAILURE); }
+    in->sink = ls_sink_text(fp);
+    in->sink->opts = &in->o;
+    in->sink->term_width = in->o.width;
+}
+
+/* ────────────── Benchmarks: each returns the entries it went through ────────────── */
+static volatile int sink_int;
+
+static long bench_cmpstring(struct bench_input *in)
+{
+    int acc = 0;
+    for (int i = 0; i + 1 < in->n; i++)
+        acc += cmpstring(&in->shuffled[i], &in->shuffled[i + 1]) < 0;
+    sink_int = acc;
+    return in->n - 1;
+}
+
+static long bench_sort(struct bench_input *in)
+{
+    memcpy(in->work, in->shuffled, in->n * sizeof(struct ls_entry));
+    qsort(in->work, in->n, sizeof(struct ls_entry), cmpstring);
+    return in->n;
+}
+
+static long bench_mode_to_string(struct bench_input *in)
+{
+    char str[11];
+    int acc = 0;
+    for (int i = 0; i < in->n; i++)
+    {
+        ls_mode_to_string(in->modes[i], str);
+        acc += str[3];
+    }
+    sink_int = acc;
+    return in->n;
+}
+
+static long bench_names_prepare(struct bench_input *in)
+{
+    names_prepare(&in->o, in->work, in->n);
+    return in->n;
+}
+
+static long bench_name_cell(struct bench_input *in)
+{
+    FILE *fp = in->sink->fp;
+    rewind(fp);
+    for (int i = 0; i < in->n; i++)
+        name_cell(fp, &in->sorted[i], in->o.quoting, 1);
+    return in->n;
+}
+
+#define BENCH_PRINTER(fn)                                 \
+    static long bench_##fn(struct bench_input *in)       \
+    {                                                     \
+        rewind(in->sink->fp);                             \
+        fn(in->sink, "bench", in->sorted, in->n);         \
+        return in->n;                                     \
+    }
+BENCH_PRINTER(print_long_plain)
+BENCH_PRINTER(print_columns_plain)
+BENCH_PRINTER(print_columns_color)
+BENCH_PRINTER(print_across_plain)
+
+struct bench
+{
+    const char *name;
+    const char *what;
+    long (*run)(struct bench_input *in);
+};
+
+static const struct bench benches[] = {
+    { "cmpstring",      "sort comparator on neighbouring names",       bench_cmpstring },
+    { "sort",           "qsort() of a directory with cmpstring()",     bench_sort },
+    { "mode_to_string", "ls_mode_to_string() over mixed modes",        bench_mode_to_string },
+    { "names_prepare",  "classify and measure names (-q)",             bench_names_prepare },
+    { "name_cell",      "colored name cell",                           bench_name_cell },
+    { "long",           "long rows: widths pass and row assembly",     bench_print_long_plain },
+    { "columns",        "column layout math and padding",              bench_print_columns_plain },
+    { "columns_color",  "columns with colored names",                  bench_print_columns_color },
+    { "across",         "-x layout",                                   bench_print_across_plain },
+};
+#define NBENCH (int)(sizeof(benches) / sizeof(benches[0]))
+
+/* ────────────── Timing ────────────── */
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* TSC reference cycles; 0 where there is no cheap counter. */
+static unsigned long long cycles_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+struct result
+{
+    char name[64];
+    double ns, cycles, allocs;  /* per entry */
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_run(const struct bench *b, struct bench_input *in, int reps, struct result *r)
+{
+    /* The sort and names_prepare() work on a copy in shuffled order. */
+    memcpy(in->work, in->shuffled, in->n * sizeof(struct ls_entry));
+
+    /* Warm-up, which also finds how many calls fill a repetition. */
+    long calls = 0;
+    long long t0 = now_ns(), t;
+    do
+    {
+        b->run(in);
+        calls++;
+    } while ((t = now_ns()) - t0 < BENCH_WARMUP_NS);
+    long per_rep = (long)(calls * (double)BENCH_REP_NS / (t - t0)) + 1;
+
+    double ns[reps], cyc[reps];
+    unsigned long allocs = 0;
+    long entries = 0;
+    for (int k = 0; k < reps; k++)
+    {
+        long items = 0;
+        unsigned long a0 = bench_allocs;
+        unsigned long long c0 = cycles_now();
+        t0 = now_ns();
+        for (long i = 0; i < per_rep; i++)
+            items += b->run(in);
+        t = now_ns();
+        unsigned long long c1 = cycles_now();
+        allocs += bench_allocs - a0;
+        entries += items;
+        ns[k] = (double)(t - t0) / items;
+        cyc[k] = (double)(c1 - c0) / items;
+    }
+    qsort(ns, reps, sizeof(double), cmp_double);
+    qsort(cyc, reps, sizeof(double), cmp_double);
+
+    snprintf(r->name, sizeof(r->name), "%s", b->name);
+    r->ns = ns[0];
+    r->cycles = cyc[0];
+    r->allocs = (double)allocs / entries;
+}
+
+/* ────────────── Baseline file: "name ns/op cycles/op allocs/op" per line ────────────── */
+static int baseline_load(const char *path, struct result *base, int max)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) { perror(path); return -1; }
+
+    char line[256];
+    int n = 0;
+    while (n < max && fgets(line, sizeof(line), fp))
+    {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%63s %lf %lf %lf", base[n].name, &base[n].ns, &base[n].cycles, &base[n].allocs) == 4)
+            n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+static int baseline_save(const char *path, const struct result *res, int n, int entries)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) { perror(path); return -1; }
+    fprintf(fp, "# lsdir bench baseline, %d entries: name ns/op cycles/op allocs/op\n", entries);
+    for (int i = 0; i < n; i++)
+        fprintf(fp, "%s %.2f %.2f %.4f\n", res[i].name, res[i].ns, res[i].cycles, res[i].allocs);
+    if (fclose(fp) != 0) { perror(path); return -1; }
+    return 0;
+}
+
+static const struct result *baseline_find(const struct result *base, int n, const char *name)
+{
+    for (int i = 0; i < n; i++)
+        if (strcmp(base[i].name, name) == 0)
+            return &base[i];
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n ENTRIES] [-r REPS] [--baseline=FILE [--threshold=PCT]] [--save=FILE]\n"
+                    "       [--list] [benchmark...]\n", prog);
+}
+
+enum { OPT_BASELINE = 256, OPT_SAVE, OPT_THRESHOLD, OPT_LIST };
+
+int main(int argc, char **argv)
+{
+    int entries = 10000, reps = 9;
+    double threshold = 10;
+    const char *baseline = NULL, *save = NULL;
+    int list = 0, opt;
+
+    static const struct option long_opts[] = {
+        { "baseline",  required_argument, NULL, OPT_BASELINE },
+        { "save",      required_argument, NULL, OPT_SAVE },
+        { "threshold", required_argument, NULL, OPT_THRESHOLD },
+        { "list",      no_argument, NULL, OPT_LIST },
+        { NULL, 0, NULL, 0 }
+    };
+    while ((opt = getopt_long(argc, argv, "n:r:", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': entries = atoi(optarg); break;
+            case 'r': reps = atoi(optarg); break;
+            case OPT_BASELINE: baseline = optarg; break;
+            case OPT_SAVE: save = optarg; break;
+            case OPT_THRESHOLD: threshold = atof(optarg); break;
+            case OPT_LIST: list = 1; break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (entries < 2 || reps < 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (list)
+    {
+        for (int i = 0; i < NBENCH; i++)
+            printf("%-16s %s\n", benches[i].name, benches[i].what);
+        return EXIT_SUCCESS;
+    }
+
+    struct result base[BENCH_MAX];
+    int nbase = 0;
+    if (baseline && (nbase = baseline_load(baseline, base, BENCH_MAX)) == -1)
+        return EXIT_FAILURE;
+
+    struct bench_input in;
+    input_build(&in, entries);
+
+    printf("%d entries, best of %d repetitions\n", entries, reps);
+    printf("%-16s %10s %10s %10s", "benchmark", "ns/op", "cycles/op", "allocs/op");
+    if (baseline) printf(" %10s %8s", "base ns", "change");
+    putchar('\n');
+
+    struct result res[BENCH_MAX];
+    int nres = 0, worse = 0;
+    for (int i = 0; i < NBENCH; i++)
+    {
+        int wanted = optind == argc;
+        for (int a = optind; a < argc && !wanted; a++)
+            wanted = strcmp(argv[a], benches[i].name) == 0;
+        if (!wanted)
+            continue;
+
+        struct result *r = &res[nres++];
+        bench_run(&benches[i], &in, reps, r);
+        printf("%-16s %10.2f ", r->name, r->ns);
+        if (r->cycles > 0) printf("%10.2f ", r->cycles);
+        else printf("%10s ", "-");
+        printf("%10.4f", r->allocs);
+
+        const struct result *b = baseline_find(base, nbase, r->name);
+        if (b)
+        {
+            double change = (r->ns - b->ns) / b->ns * 100;
+            int slower = change > threshold, more = r->allocs > b->allocs + 1e-4;
+            printf(" %10.2f %+7.1f%%%s%s", b->ns, change, slower ? "  SLOWER" : "", more ? "  MORE ALLOCS" : "");
+            worse |= slower || more;
+        }
+        else if (baseline)
+            printf(" %10s", "-");
+        putchar('\n');
+    }
+
+    if (save && baseline_save(save, res, nres, entries) == -1)
+        return EXIT_FAILURE;
+    return worse ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1375 @@
+/*
+ * Programming Assignment 02: lsv1.7.0
+ * Builds on lsv1.6.0 (recursive listing, colored output, column display,
+ * long listing, horizontal display and alphabetical sort) and adds:
+ *   -L               follow symbolic links (stat() instead of lstat())
+ *   --same-dir-once  list every directory at most once during -R
+ *   --du             subtree size/count totals gathered during the same walk
+ *   --include=PAT, --exclude=PAT, --prune=PAT, --regex
+ *                    name filters checked on d_name before strdup()/lstat()
+ *   --size, --newer, --type, --perm, --and, --or, --not
+ *                    find(1)-style metadata predicates
+ *   --stat-order=inode|readdir
+ *                    order in which a directory's entries are stat'ed
+ *   --ndjson         one JSON object per entry instead of the text layouts
+ *   --serve=SOCKET   stay resident and answer listing requests on a Unix socket
+ *   --client=SOCKET  send this command line to a --serve daemon instead
+ *   --from-file=FILE|-, -0, --jobs=N
+ *                    read operands from FILE (newline- or NUL-separated) and
+ *                    optionally list up to N of them at once
+ *   -1, -C           one name per line, or columns (the default when
+ *                    stdout is a terminal; otherwise -1 is)
+ *   --color[=auto|always|never], -w COLS, --width=COLS
+ *                    color names by type (auto: only on a terminal) and
+ *                    set the line width; the terminal's width is read once
+ *   -i, -s, -Z, --acl, --debug-columns
+ *                    inode number, allocated KiB, SELinux context and a
+ *                    '+' after the permissions of files with an ACL; the
+ *                    last two cost getxattr() calls, reported on stderr
+ *                    by --debug-columns
+ *   -U               do not sort; list entries in readdir order
+ *   -q, -b, -N, --quoting-style=literal|question|escape|shell
+ *                    how names with unprintable characters are written
+ *                    (default: -q on a terminal, -N otherwise); columns
+ *                    are laid out by display width, not bytes
+ *   --count          print entry counts per directory (and a total)
+ *   --snapshot=FILE  write a manifest of the tree (implies -R)
+ *   --diff=OLD, --diff-prune
+ *                    print what changed since the manifest OLD
+ *   --checkpoint=FILE, --checkpoint-interval=SECS, --resume
+ *                    save the -R frontier every SECS seconds and pick an
+ *                    interrupted walk up again (output must go to a file)
+ *   --nice-io        run in the idle I/O scheduling class
+ *   --max-ops=N, --max-latency=MS
+ *                    cap stats and directory opens per second, and back
+ *                    off while stat latency is above MS
+ *   --parallel-sort=N, --sort-threads=N
+ *                    sort directories of N or more entries on several threads
+ *   --prefetch=N     under -R with two or more CPUs, read the next N
+ *                    directories ahead on a pipeline of reader, walker
+ *                    and printer threads (default 8; 0: one at a time)
+ *   --max-memory=SIZE
+ *                    sort directories larger than SIZE through temporary
+ *                    files; columns are then laid out across (-x)
+ *   --one-file-system
+ *                    do not descend into other mounts under -R
+ *   --skip-pseudo    do not descend into proc, sysfs, cgroup and other
+ *                    pseudo filesystems under -R (noted on stderr)
+ *   --debug-fs       print the scan profile picked for each filesystem
+ *   --timeout-dir=MS, --timeout-stat=MS
+ *                    give up on a directory, or a single stat, that does
+ *                    not answer in time; list "?" placeholders and report
+ *                    the incomplete directories at the end
+ *   --offset=N, --limit=N, --cursor=TOKEN
+ *                    list one page of each directory operand; the token
+ *                    for the next page is printed on stderr (or as a
+ *                    final {"next_cursor":...} object with --ndjson)
+ *
+ * Notes:
+ * - The listing itself lives in liblsdir (src/lsdir.c, src/lsdir.h); this
+ *   file only turns the command line into an ls_options struct and picks
+ *   a sink.
+ * - A request to the daemon is the client's working directory followed by
+ *   its arguments, each NUL-terminated, and ends with an empty string. The
+ *   daemon answers in frames (see FRAME_OUT): the listing, the request's
+ *   diagnostics as they happen, and last its exit status, which the client
+ *   replays on its stdout, stderr and exit code. Each request runs in its
+ *   own thread against the client's directory; the uid/gid name cache and
+ *   the directory cache stay warm between requests.
+ * - The daemon lists with its own credentials, so only its own user may
+ *   ask: the socket is created mode 0600, and a connection whose peer
+ *   (SO_PEERCRED) runs under another uid is closed unanswered.
+ * - --from-file reads one path at a time, so the input can be arbitrarily
+ *   long. Sequentially all paths share one session (visited set, --du
+ *   totals); with --jobs each path gets its own session rendered into a
+ *   memory buffer, and the buffers are written out in input order.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "lsdir.h"
+
+/* Long-only options have no short letter; give them values above 255. */
+enum { OPT_SAME_DIR_ONCE = 256, OPT_DU, OPT_INCLUDE, OPT_EXCLUDE, OPT_PRUNE, OPT_REGEX,
+       OPT_SIZE, OPT_NEWER, OPT_TYPE, OPT_PERM, OPT_AND, OPT_OR, OPT_NOT, OPT_STAT_ORDER,
+       OPT_NDJSON, OPT_SERVE, OPT_CLIENT, OPT_FROM_FILE, OPT_JOBS,
+       OPT_OFFSET, OPT_LIMIT, OPT_CURSOR, OPT_COUNT,
+       OPT_SNAPSHOT, OPT_DIFF, OPT_DIFF_PRUNE, OPT_CHECKPOINT, OPT_CHECKPOINT_INTERVAL, OPT_RESUME,
+       OPT_NICE_IO, OPT_MAX_OPS, OPT_MAX_LATENCY, OPT_TIMEOUT_DIR, OPT_TIMEOUT_STAT,
+       OPT_ONE_FILE_SYSTEM, OPT_SKIP_PSEUDO, OPT_DEBUG_FS, OPT_PARALLEL_SORT, OPT_SORT_THREADS,
+       OPT_QUOTING_STYLE, OPT_COLOR, OPT_MAX_MEMORY, OPT_ACL, OPT_DEBUG_COLUMNS,
+       OPT_PREFETCH };
+
+/* Seconds between checkpoints unless --checkpoint-interval says otherwise. */
+#define CHECKPOINT_INTERVAL 10.0
+
+/* Directory snapshots the daemon may keep in memory. */
+#define SERVE_DIR_CACHE_BYTES (64UL << 20)
+
+struct cli
+{
+    struct ls_options o;
+    int ndjson;
+    const char *serve;
+    const char *client;
+    const char *from_file;      /* "-" is stdin */
+    int nul_sep;                /* -0 */
+    int jobs;
+    const char *snapshot;
+    const char *diff;
+    int diff_prune;
+    const char *checkpoint;
+    double checkpoint_interval;
+    int resume;
+    int nice_io;
+    int nargs;                  /* operands start at args */
+    char **args;
+    FILE *err;                  /* diagnostics: stderr, or the request's error stream under --serve */
+};
+
+/* getopt keeps its state in globals, so concurrent requests parse one at a time. */
+static pthread_mutex_t getopt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage(FILE *err, const char *prog)
+{
+    fprintf(err, "Usage: %s [-l | -x | -1 | -C] [-w COLS] [--color[=WHEN]] [-R] [-L] [-U]\n"
+                 "       [-q | -b | -N | --quoting-style=STYLE] [-i] [-s] [-Z] [--acl] [--debug-columns]\n"
+                 "       [--same-dir-once] [--du]\n"
+                 "       [--include=PAT] [--exclude=PAT] [--prune=PAT] [--regex]\n"
+                 "       [--size=[+-]N[kMGT]] [--newer=FILE] [--type=fdlbcps] [--perm=[-/]MODE]\n"
+                 "       [--and] [--or] [--not] [--stat-order=inode|readdir] [--ndjson]\n"
+                 "       [--serve=SOCKET | --client=SOCKET] [--from-file=FILE|- [-0] [--jobs=N]]\n"
+                 "       [--offset=N] [--limit=N] [--cursor=TOKEN] [--count]\n"
+                 "       [--snapshot=FILE | --diff=OLD [--diff-prune]]\n"
+                 "       [--checkpoint=FILE [--checkpoint-interval=SECS] [--resume]]\n"
+                 "       [--nice-io] [--max-ops=N] [--max-latency=MS]\n"
+                 "       [--timeout-dir=MS] [--timeout-stat=MS] [--one-file-system] [--skip-pseudo]\n"
+                 "       [--debug-fs] [--parallel-sort=N] [--sort-threads=N] [--max-memory=SIZE] [--prefetch=N]\n"
+                 "       [file...]\n", prog);
+}
+
+/* Columns of the terminal on stdout (80 if it does not say), or 0 if that is not a terminal. */
+static int terminal_width(void)
+{
+    struct winsize ws;
+    if (!isatty(STDOUT_FILENO))
+        return 0;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        return ws.ws_col;
+    return 80;
+}
+
+/*
+ * Fills cli from argv; returns -1 (after a message on err) on a bad command
+ * line. tty is the width of the terminal the listing goes to, 0 for a pipe,
+ * file or socket.
+ */
+static int parse_args(struct cli *cli, int argc, char **argv, FILE *err, int tty)
+{
+    int opt, rc = 0;
+
+    memset(cli, 0, sizeof(*cli));
+    ls_options_init(&cli->o);
+    cli->err = err;
+    cli->o.errors = err;
+    /*
+     * A terminal gets colored columns with control characters hidden; a
+     * pipe gets one bare name per line, which is what the reader wants.
+     */
+    if (tty > 0)
+    {
+        cli->o.quoting = LS_QUOTE_QUESTION;
+        cli->o.color = 1;
+        cli->o.width = tty;
+    }
+    else
+        cli->o.display = LS_DISPLAY_ONE;
+
+    static const struct option long_opts[] = {
+        { "dereference",   no_argument, NULL, 'L' },
+        { "same-dir-once", no_argument, NULL, OPT_SAME_DIR_ONCE },
+        { "du",            no_argument, NULL, OPT_DU },
+        { "include",       required_argument, NULL, OPT_INCLUDE },
+        { "exclude",       required_argument, NULL, OPT_EXCLUDE },
+        { "prune",         required_argument, NULL, OPT_PRUNE },
+        { "regex",         no_argument, NULL, OPT_REGEX },
+        { "size",          required_argument, NULL, OPT_SIZE },
+        { "newer",         required_argument, NULL, OPT_NEWER },
+        { "type",          required_argument, NULL, OPT_TYPE },
+        { "perm",          required_argument, NULL, OPT_PERM },
+        { "and",           no_argument, NULL, OPT_AND },
+        { "or",            no_argument, NULL, OPT_OR },
+        { "not",           no_argument, NULL, OPT_NOT },
+        { "stat-order",    required_argument, NULL, OPT_STAT_ORDER },
+        { "ndjson",        no_argument, NULL, OPT_NDJSON },
+        { "serve",         required_argument, NULL, OPT_SERVE },
+        { "client",        required_argument, NULL, OPT_CLIENT },
+        { "from-file",     required_argument, NULL, OPT_FROM_FILE },
+        { "null",          no_argument, NULL, '0' },
+        { "hide-control-chars", no_argument, NULL, 'q' },
+        { "escape",        no_argument, NULL, 'b' },
+        { "literal",       no_argument, NULL, 'N' },
+        { "quoting-style", required_argument, NULL, OPT_QUOTING_STYLE },
+        { "color",         optional_argument, NULL, OPT_COLOR },
+        { "width",         required_argument, NULL, 'w' },
+        { "jobs",          required_argument, NULL, OPT_JOBS },
+        { "offset",        required_argument, NULL, OPT_OFFSET },
+        { "limit",         required_argument, NULL, OPT_LIMIT },
+        { "cursor",        required_argument, NULL, OPT_CURSOR },
+        { "count",         no_argument, NULL, OPT_COUNT },
+        { "snapshot",      required_argument, NULL, OPT_SNAPSHOT },
+        { "diff",          required_argument, NULL, OPT_DIFF },
+        { "diff-prune",    no_argument, NULL, OPT_DIFF_PRUNE },
+        { "checkpoint",    required_argument, NULL, OPT_CHECKPOINT },
+        { "checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL },
+        { "resume",        no_argument, NULL, OPT_RESUME },
+        { "nice-io",       no_argument, NULL, OPT_NICE_IO },
+        { "max-ops",       required_argument, NULL, OPT_MAX_OPS },
+        { "max-latency",   required_argument, NULL, OPT_MAX_LATENCY },
+        { "timeout-dir",   required_argument, NULL, OPT_TIMEOUT_DIR },
+        { "timeout-stat",  required_argument, NULL, OPT_TIMEOUT_STAT },
+        { "one-file-system", no_argument, NULL, OPT_ONE_FILE_SYSTEM },
+        { "skip-pseudo",   no_argument, NULL, OPT_SKIP_PSEUDO },
+        { "debug-fs",      no_argument, NULL, OPT_DEBUG_FS },
+        { "parallel-sort", required_argument, NULL, OPT_PARALLEL_SORT },
+        { "sort-threads",  required_argument, NULL, OPT_SORT_THREADS },
+        { "prefetch",      required_argument, NULL, OPT_PREFETCH },
+        { "max-memory",    required_argument, NULL, OPT_MAX_MEMORY },
+        { "inode",         no_argument, NULL, 'i' },
+        { "context",       no_argument, NULL, 'Z' },
+        { "acl",           no_argument, NULL, OPT_ACL },
+        { "debug-columns", no_argument, NULL, OPT_DEBUG_COLUMNS },
+        { NULL, 0, NULL, 0 }
+    };
+
+    cli->checkpoint_interval = CHECKPOINT_INTERVAL;
+
+    pthread_mutex_lock(&getopt_lock);
+    optind = 0;
+    /* getopt's own messages can only go to stderr; for a request, say it on err. */
+    opterr = err == stderr;
+    while (rc == 0 && (opt = getopt_long(argc, argv, "lxRLU0qbN1Cw:isZ", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'l':
+                cli->o.display = LS_DISPLAY_LONG;
+                break;
+            case 'x':
+                cli->o.display = LS_DISPLAY_ACROSS;
+                break;
+            case '1':
+                cli->o.display = LS_DISPLAY_ONE;
+                break;
+            case 'C':
+                cli->o.display = LS_DISPLAY_COLUMNS;
+                break;
+            case 'w':
+            {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*end != '\0' || n < 1 || n > 65535)
+                {
+                    fprintf(err, "invalid line width '%s'\n", optarg);
+                    rc = -1;
+                }
+                else
+                    cli->o.width = n;
+                break;
+            }
+            case OPT_COLOR:
+                if (!optarg || strcmp(optarg, "always") == 0) cli->o.color = 1;
+                else if (strcmp(optarg, "never") == 0) cli->o.color = 0;
+                else if (strcmp(optarg, "auto") == 0) cli->o.color = tty > 0;
+                else
+                {
+                    fprintf(err, "invalid --color argument '%s' (auto, always or never)\n", optarg);
+                    rc = -1;
+                }
+                break;
+            case 'R':
+                cli->o.recursive = 1;
+                break;
+            case 'L':
+                cli->o.follow_links = 1;
+                break;
+            case 'U':
+                cli->o.unsorted = 1;
+                break;
+            case 'q':
+                cli->o.quoting = LS_QUOTE_QUESTION;
+                break;
+            case 'b':
+                cli->o.quoting = LS_QUOTE_ESCAPE;
+                break;
+            case 'N':
+                cli->o.quoting = LS_QUOTE_LITERAL;
+                break;
+            case OPT_QUOTING_STYLE:
+                if (strcmp(optarg, "literal") == 0) cli->o.quoting = LS_QUOTE_LITERAL;
+                else if (strcmp(optarg, "question") == 0) cli->o.quoting = LS_QUOTE_QUESTION;
+                else if (strcmp(optarg, "escape") == 0) cli->o.quoting = LS_QUOTE_ESCAPE;
+                else if (strcmp(optarg, "shell") == 0) cli->o.quoting = LS_QUOTE_SHELL;
+                else
+                {
+                    fprintf(err, "invalid quoting style '%s' (literal, question, escape or shell)\n", optarg);
+                    rc = -1;
+                }
+                break;
+            case OPT_SAME_DIR_ONCE:
+                cli->o.same_dir_once = 1;
+                break;
+            case OPT_DU:
+                cli->o.du = 1;
+                break;
+            case OPT_INCLUDE: rc = ls_options_add_pattern(&cli->o, LS_INCLUDE, optarg); break;
+            case OPT_EXCLUDE: rc = ls_options_add_pattern(&cli->o, LS_EXCLUDE, optarg); break;
+            case OPT_PRUNE:   rc = ls_options_add_pattern(&cli->o, LS_PRUNE, optarg);   break;
+            case OPT_REGEX:
+                cli->o.regex = 1;
+                break;
+            case OPT_SIZE:  rc = ls_options_add_predicate(&cli->o, LS_PRED_SIZE, optarg);  break;
+            case OPT_NEWER: rc = ls_options_add_predicate(&cli->o, LS_PRED_NEWER, optarg); break;
+            case OPT_TYPE:  rc = ls_options_add_predicate(&cli->o, LS_PRED_TYPE, optarg);  break;
+            case OPT_PERM:  rc = ls_options_add_predicate(&cli->o, LS_PRED_PERM, optarg);  break;
+            case OPT_AND:   rc = ls_options_add_predicate(&cli->o, LS_PRED_AND, NULL);     break;
+            case OPT_OR:    rc = ls_options_add_predicate(&cli->o, LS_PRED_OR, NULL);      break;
+            case OPT_NOT:   rc = ls_options_add_predicate(&cli->o, LS_PRED_NOT, NULL);     break;
+            case OPT_STAT_ORDER:
+                if (strcmp(optarg, "inode") == 0) cli->o.stat_inode_order = 1;
+                else if (strcmp(optarg, "readdir") == 0) cli->o.stat_inode_order = 0;
+                else { fprintf(err, "invalid stat order '%s'\n", optarg); rc = -1; }
+                break;
+            case OPT_NDJSON:
+                cli->ndjson = 1;
+                cli->o.full_stat = 1;
+                break;
+            case OPT_SERVE:
+                cli->serve = optarg;
+                break;
+            case OPT_CLIENT:
+                cli->client = optarg;
+                break;
+            case OPT_FROM_FILE:
+                cli->from_file = optarg;
+                break;
+            case '0':
+                cli->nul_sep = 1;
+                break;
+            case OPT_OFFSET:
+            case OPT_LIMIT:
+            {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*end != '\0' || n < 0)
+                {
+                    fprintf(err, "invalid %s '%s'\n", opt == OPT_OFFSET ? "offset" : "limit", optarg);
+                    rc = -1;
+                }
+                else if (opt == OPT_OFFSET)
+                    cli->o.offset = n;
+                else
+                    cli->o.limit = n;
+                break;
+            }
+            case OPT_CURSOR:
+                cli->o.cursor = optarg;
+                break;
+            case OPT_COUNT:
+                cli->o.count = 1;
+                break;
+            case OPT_SNAPSHOT:
+                cli->snapshot = optarg;
+                break;
+            case OPT_DIFF:
+                cli->diff = optarg;
+                break;
+            case OPT_DIFF_PRUNE:
+                cli->diff_prune = 1;
+                break;
+            case OPT_CHECKPOINT:
+                cli->checkpoint = optarg;
+                break;
+            case OPT_CHECKPOINT_INTERVAL:
+            {
+                char *end;
+                cli->checkpoint_interval = strtod(optarg, &end);
+                if (*end != '\0' || cli->checkpoint_interval <= 0)
+                {
+                    fprintf(err, "invalid checkpoint interval '%s'\n", optarg);
+                    rc = -1;
+                }
+                break;
+            }
+            case OPT_RESUME:
+                cli->resume = 1;
+                break;
+            case OPT_NICE_IO:
+                cli->nice_io = 1;
+                break;
+            case OPT_ONE_FILE_SYSTEM:
+                cli->o.one_file_system = 1;
+                break;
+            case OPT_SKIP_PSEUDO:
+                cli->o.skip_pseudo = 1;
+                break;
+            case OPT_DEBUG_FS:
+                cli->o.debug_fs = 1;
+                break;
+            case 'i':
+                cli->o.show_inode = 1;
+                break;
+            case 's':
+                cli->o.show_blocks = 1;
+                break;
+            case 'Z':
+                cli->o.show_context = 1;
+                break;
+            case OPT_ACL:
+                cli->o.show_acl = 1;
+                break;
+            case OPT_DEBUG_COLUMNS:
+                cli->o.debug_columns = 1;
+                break;
+            case OPT_MAX_OPS:
+            case OPT_MAX_LATENCY:
+            {
+                char *end;
+                double v = strtod(optarg, &end);
+                if (*end != '\0' || v <= 0)
+                {
+                    fprintf(err, "invalid %s '%s'\n", opt == OPT_MAX_OPS ? "operation rate" : "latency", optarg);
+                    rc = -1;
+                }
+                else if (opt == OPT_MAX_OPS)
+                    cli->o.max_ops = v;
+                else
+                    cli->o.max_latency_ms = v;
+                break;
+            }
+            case OPT_TIMEOUT_DIR:
+            case OPT_TIMEOUT_STAT:
+            {
+                char *end;
+                double v = strtod(optarg, &end);
+                if (*end != '\0' || v <= 0)
+                {
+                    fprintf(err, "invalid timeout '%s'\n", optarg);
+                    rc = -1;
+                }
+                else if (opt == OPT_TIMEOUT_DIR)
+                    cli->o.timeout_dir_ms = v;
+                else
+                    cli->o.timeout_stat_ms = v;
+                break;
+            }
+            case OPT_PARALLEL_SORT:
+            {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*end != '\0' || n < 0)
+                {
+                    fprintf(err, "invalid entry count '%s'\n", optarg);
+                    rc = -1;
+                }
+                else
+                    cli->o.parallel_sort_min = n;
+                break;
+            }
+            case OPT_SORT_THREADS:
+            {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*end != '\0' || n < 1 || n > 256)
+                {
+                    fprintf(err, "invalid thread count '%s'\n", optarg);
+                    rc = -1;
+                }
+                else
+                    cli->o.sort_threads = n;
+                break;
+            }
+            case OPT_PREFETCH:
+            {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*end != '\0' || n < 0 || n > 1024)
+                {
+                    fprintf(err, "invalid prefetch depth '%s'\n", optarg);
+                    rc = -1;
+                }
+                else
+                    cli->o.prefetch = n;
+                break;
+            }
+            case OPT_MAX_MEMORY:
+            {
+                char *end;
+                unsigned long long n = strtoull(optarg, &end, 10);
+                int shift = *end == 'k' || *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+                if (shift) end++;
+                if (end == optarg || *end != '\0' || optarg[0] == '-' || n == 0 || n > (SIZE_MAX >> shift))
+                {
+                    fprintf(err, "invalid memory size '%s' (bytes, or with a k, M or G suffix)\n", optarg);
+                    rc = -1;
+                }
+                else
+                    cli->o.max_memory = (size_t)n << shift;
+                break;
+            }
+            case OPT_JOBS:
+            {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*end != '\0' || n < 1 || n > 1024)
+                {
+                    fprintf(err, "invalid job count '%s'\n", optarg);
+                    rc = -1;
+                }
+                else
+                    cli->jobs = n;
+                break;
+            }
+            default:
+                if (!opterr)
+                    fprintf(err, "%s: unrecognized option or missing argument: '%s'\n", argv[0], argv[optind - 1]);
+                usage(err, argv[0]);
+                rc = -1;
+        }
+    }
+    cli->nargs = argc - optind;
+    cli->args = argv + optind;
+    pthread_mutex_unlock(&getopt_lock);
+
+    if (rc == 0 && cli->serve && cli->client)
+    {
+        fprintf(err, "--serve and --client are mutually exclusive\n");
+        rc = -1;
+    }
+    if (rc == 0 && (cli->o.offset > 0 || cli->o.limit > 0 || cli->o.cursor) &&
+        (cli->o.recursive || cli->o.du))
+    {
+        fprintf(err, "--offset, --limit and --cursor page one directory; they cannot be used with -R or --du\n");
+        rc = -1;
+    }
+    if (rc == 0 && cli->o.cursor && cli->o.offset > 0)
+    {
+        fprintf(err, "--cursor and --offset are mutually exclusive\n");
+        rc = -1;
+    }
+    if (rc == 0 && cli->o.count && (cli->o.display == LS_DISPLAY_LONG || cli->o.du || cli->o.follow_links))
+    {
+        fprintf(err, "--count reads no metadata; it cannot be used with -l, -L or --du\n");
+        rc = -1;
+    }
+    if (rc == 0 && (cli->snapshot || cli->diff))
+    {
+        if ((cli->snapshot && cli->diff) || cli->ndjson || cli->o.count || cli->from_file ||
+            cli->o.offset > 0 || cli->o.limit > 0 || cli->o.cursor)
+        {
+            fprintf(err, "--snapshot and --diff take a whole tree; they cannot be combined with each other,\n"
+                         "--ndjson, --count, --from-file or paging\n");
+            rc = -1;
+        }
+        cli->o.recursive = 1;
+        cli->o.full_stat = 1;
+    }
+    if (rc == 0 && (cli->o.timeout_dir_ms > 0 || cli->o.timeout_stat_ms > 0) &&
+        (cli->o.count || cli->o.offset > 0 || cli->o.limit > 0 || cli->o.cursor || cli->snapshot || cli->diff))
+    {
+        fprintf(err, "--timeout-dir and --timeout-stat cannot be used with --count, paging, --snapshot or --diff\n");
+        rc = -1;
+    }
+    if (rc == 0 && cli->o.max_memory > 0 &&
+        (cli->snapshot || cli->diff || cli->o.timeout_dir_ms > 0 || cli->o.timeout_stat_ms > 0))
+    {
+        fprintf(err, "--max-memory cannot be used with --snapshot, --diff, --timeout-dir or --timeout-stat\n");
+        rc = -1;
+    }
+    if (rc == 0 && (cli->o.show_acl || cli->o.show_context) &&
+        (cli->o.timeout_dir_ms > 0 || cli->o.timeout_stat_ms > 0))
+    {
+        fprintf(err, "-Z and --acl need getxattr(), which has no deadline: not with --timeout-dir or --timeout-stat\n");
+        rc = -1;
+    }
+    if (rc == 0 && cli->diff_prune && !cli->diff)
+    {
+        fprintf(err, "--diff-prune needs --diff\n");
+        rc = -1;
+    }
+    if (rc == 0 && cli->resume && !cli->checkpoint)
+    {
+        fprintf(err, "--resume needs --checkpoint=FILE\n");
+        rc = -1;
+    }
+    if (rc == 0 && cli->checkpoint &&
+        (!cli->o.recursive || cli->nargs > 1 || cli->o.du || cli->o.count || cli->from_file ||
+         cli->snapshot || cli->diff || cli->o.offset > 0 || cli->o.limit > 0 || cli->o.cursor))
+    {
+        fprintf(err, "--checkpoint takes one -R walk of at most one directory, without --du, --count,\n"
+                     "--from-file, --snapshot, --diff or paging\n");
+        rc = -1;
+    }
+    if (rc == 0 && cli->o.count)
+    {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        cli->o.threads = cli->jobs > 0 ? cli->jobs : ncpu > 16 ? 16 : ncpu > 0 ? ncpu : 1;
+    }
+    if (rc == 0 && cli->from_file && cli->nargs > 0)
+    {
+        fprintf(err, "file operands cannot be combined with --from-file\n");
+        rc = -1;
+    }
+    if (rc == 0 && ls_options_prepare(&cli->o) == -1)
+        rc = -1;
+    if (rc == -1)
+        ls_options_free(&cli->o);
+    return rc;
+}
+
+static struct ls_session *open_session(const struct cli *cli, FILE *out, int base_fd, struct ls_sink **sinkp)
+{
+    struct ls_sink *sink = cli->ndjson ? ls_sink_ndjson(out) : ls_sink_text(out);
+    struct ls_session *ss = sink ? ls_session_new(&cli->o, sink) : NULL;
+    if (!ss)
+    {
+        ls_sink_free(sink);
+        return NULL;
+    }
+    ls_session_set_base(ss, base_fd);
+    *sinkp = sink;
+    return ss;
+}
+
+/* Writes the manifest next to FILE first, so an interrupted run leaves the old one intact. */
+static int run_snapshot(struct cli *cli)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cli->snapshot);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) { perror(tmp); return -1; }
+
+    struct ls_sink *sink = ls_sink_snapshot(fp);
+    struct ls_session *ss = sink ? ls_session_new(&cli->o, sink) : NULL;
+    int rc = -1;
+    if (ss)
+    {
+        rc = cli->nargs == 0 ? ls_session_list(ss, ".") : ls_session_list_operands(ss, cli->args, cli->nargs);
+        ls_session_finish(ss);
+    }
+    ls_sink_free(sink);
+
+    if (fclose(fp) == EOF) { perror(tmp); rc = -1; }
+    if (rc == 0 && rename(tmp, cli->snapshot) == -1) { perror(cli->snapshot); rc = -1; }
+    if (rc == -1) unlink(tmp);
+    return rc;
+}
+
+static int run_diff(struct cli *cli, FILE *out)
+{
+    FILE *old = fopen(cli->diff, "r");
+    if (!old) { perror(cli->diff); return -1; }
+
+    struct ls_sink *sink = ls_sink_diff(old, out, cli->diff_prune);
+    struct ls_session *ss = sink ? ls_session_new(&cli->o, sink) : NULL;
+    int rc = -1;
+    if (ss)
+    {
+        rc = cli->nargs == 0 ? ls_session_list(ss, ".") : ls_session_list_operands(ss, cli->args, cli->nargs);
+        ls_session_finish(ss);
+    }
+    /* Freeing the sink reports what is left of the old manifest as removed. */
+    ls_sink_free(sink);
+    fclose(old);
+    return rc;
+}
+
+/* Lists the operands of cli to out; relative paths resolve against base_fd. */
+static int run_listing(struct cli *cli, FILE *out, int base_fd)
+{
+    if (cli->snapshot)
+        return run_snapshot(cli);
+    if (cli->diff)
+        return run_diff(cli, out);
+
+    struct ls_sink *sink;
+    struct ls_session *ss = open_session(cli, out, base_fd, &sink);
+    if (!ss)
+        return -1;
+
+    int rc = 0;
+    if (cli->checkpoint)
+    {
+        /* The output offset in the checkpoint only means something in a regular file. */
+        struct stat st;
+        if (fstat(fileno(out), &st) == -1 || !S_ISREG(st.st_mode))
+        {
+            fprintf(cli->err, "--checkpoint needs the output redirected to a regular file\n");
+            rc = -1;
+        }
+        else
+            ls_session_set_checkpoint(ss, cli->checkpoint, cli->checkpoint_interval);
+    }
+
+    if (rc == -1)
+        ;
+    else if (cli->resume)
+        rc = ls_session_resume(ss, cli->checkpoint);
+    else if (cli->nargs == 0)
+        rc = ls_session_list(ss, ".");
+    else if (cli->o.count)
+    {
+        for (int i = 0; i < cli->nargs; i++)
+            if (ls_session_list(ss, cli->args[i]) == -1)
+                rc = -1;
+    }
+    else
+        rc = ls_session_list_operands(ss, cli->args, cli->nargs);
+
+    const char *next = ls_session_next_cursor(ss);
+    if (next && cli->ndjson)
+        fprintf(out, "{\"next_cursor\":\"%s\"}\n", next);
+    else if (next)
+        fprintf(cli->err, "next cursor: %s\n", next);
+
+    ls_session_finish(ss);
+    ls_sink_free(sink);
+    return rc;
+}
+
+/* ────────────── Batch input (--from-file) ────────────── */
+/* Next path from in, without its separator; NULL at end of input. */
+static char *next_path(FILE *in, int sep, char **line, size_t *cap)
+{
+    ssize_t n;
+    while ((n = getdelim(line, cap, sep, in)) != -1)
+    {
+        if (n > 0 && (*line)[n - 1] == sep)
+            (*line)[--n] = '\0';
+        if (n > 0)
+            return *line;
+    }
+    return NULL;
+}
+
+/*
+ * --jobs: the main thread reads paths into a window of slots and writes
+ * finished slots out in input order; workers take ready slots in order.
+ */
+enum slot_state { SLOT_FREE, SLOT_READY, SLOT_RUNNING, SLOT_DONE };
+
+struct batch_slot
+{
+    enum slot_state state;
+    char *path;
+    char *out;
+    size_t out_len;
+    int rc;
+};
+
+struct batch
+{
+    const struct cli *cli;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    struct batch_slot *slots;
+    long window;
+    long next_take;             /* next sequence number a worker picks up */
+    long next_read;             /* next sequence number the reader fills */
+    int eof;
+};
+
+static void *batch_worker(void *arg)
+{
+    struct batch *b = arg;
+
+    pthread_mutex_lock(&b->lock);
+    for (;;)
+    {
+        while (b->next_take == b->next_read && !b->eof)
+            pthread_cond_wait(&b->work, &b->lock);
+        if (b->next_take == b->next_read)
+            break;
+        struct batch_slot *slot = &b->slots[b->next_take++ % b->window];
+        slot->state = SLOT_RUNNING;
+        pthread_mutex_unlock(&b->lock);
+
+        /* The session and its buffer are private to this path. */
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *mem = open_memstream(&buf, &len);
+        struct ls_sink *sink;
+        struct ls_session *ss = mem ? open_session(b->cli, mem, AT_FDCWD, &sink) : NULL;
+        if (ss)
+        {
+            ls_session_set_headers(ss, 1);
+            slot->rc = ls_session_list_operands(ss, &slot->path, 1);
+            ls_session_finish(ss);
+            ls_sink_free(sink);
+        }
+        if (mem)
+            fclose(mem);
+
+        pthread_mutex_lock(&b->lock);
+        slot->out = buf;
+        slot->out_len = len;
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&b->done);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+static int run_batch_parallel(struct cli *cli, FILE *in, int sep)
+{
+    struct batch b = { .cli = cli };
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.work, NULL);
+    pthread_cond_init(&b.done, NULL);
+    b.window = 4L * cli->jobs;
+    b.slots = calloc(b.window, sizeof(struct batch_slot));
+    pthread_t *tids = malloc(cli->jobs * sizeof(pthread_t));
+    if (!b.slots || !tids) { perror("malloc"); exit(EXIT_FAILURE); }
+
+    int nthreads = 0;
+    for (int i = 0; i < cli->jobs; i++)
+        if (pthread_create(&tids[nthreads], NULL, batch_worker, &b) == 0)
+            nthreads++;
+    if (nthreads == 0)
+    {
+        fprintf(stderr, "pthread_create failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    long next_emit = 0;
+    int rc = 0;
+
+    pthread_mutex_lock(&b.lock);
+    for (;;)
+    {
+        /* Keep the window full while there is input. */
+        while (!b.eof && b.next_read - next_emit < b.window)
+        {
+            pthread_mutex_unlock(&b.lock);
+            char *path = next_path(in, sep, &line, &cap);
+            char *copy = path ? strdup(path) : NULL;
+            if (path && !copy) { perror("strdup"); exit(EXIT_FAILURE); }
+            pthread_mutex_lock(&b.lock);
+            if (!copy)
+                b.eof = 1;
+            else
+            {
+                struct batch_slot *slot = &b.slots[b.next_read % b.window];
+                slot->path = copy;
+                slot->state = SLOT_READY;
+                b.next_read++;
+            }
+            pthread_cond_broadcast(&b.work);
+        }
+
+        if (next_emit == b.next_read)
+            break;
+
+        struct batch_slot *slot = &b.slots[next_emit % b.window];
+        while (slot->state != SLOT_DONE)
+            pthread_cond_wait(&b.done, &b.lock);
+        pthread_mutex_unlock(&b.lock);
+
+        fwrite(slot->out, 1, slot->out_len, stdout);
+        if (slot->rc == -1)
+            rc = -1;
+        free(slot->out);
+        free(slot->path);
+
+        pthread_mutex_lock(&b.lock);
+        slot->state = SLOT_FREE;
+        next_emit++;
+    }
+    pthread_mutex_unlock(&b.lock);
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+    free(line);
+    free(tids);
+    free(b.slots);
+    pthread_cond_destroy(&b.work);
+    pthread_cond_destroy(&b.done);
+    pthread_mutex_destroy(&b.lock);
+    return rc;
+}
+
+static int run_batch(struct cli *cli)
+{
+    FILE *in = strcmp(cli->from_file, "-") == 0 ? stdin : fopen(cli->from_file, "r");
+    if (!in)
+    {
+        perror(cli->from_file);
+        return -1;
+    }
+    int sep = cli->nul_sep ? '\0' : '\n';
+    int rc = 0;
+
+    if (cli->jobs > 1)
+        rc = run_batch_parallel(cli, in, sep);
+    else
+    {
+        struct ls_sink *sink;
+        struct ls_session *ss = open_session(cli, stdout, AT_FDCWD, &sink);
+        if (!ss)
+            rc = -1;
+        else
+        {
+            char *line = NULL;
+            size_t cap = 0;
+            char *path;
+            ls_session_set_headers(ss, 1);
+            while ((path = next_path(in, sep, &line, &cap)) != NULL)
+                if (ls_session_list_operands(ss, &path, 1) == -1)
+                    rc = -1;
+            free(line);
+            ls_session_finish(ss);
+            ls_sink_free(sink);
+        }
+    }
+
+    if (in != stdin)
+        fclose(in);
+    return rc;
+}
+
+/* ────────────── I/O priority ────────────── */
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+/* Idle class: the disk serves us only when nobody else wants it. Threads started later inherit it. */
+static void set_idle_io(void)
+{
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1)
+        perror("ioprio_set");
+}
+
+/* ────────────── Daemon ────────────── */
+static struct ls_dir_cache *serve_cache;
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t w = write(fd, buf, len);
+        if (w == -1) return -1;
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/* write_all() to the daemon: one that hung up (a refused request) is an error, not SIGPIPE. */
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t w = send(fd, buf, len, MSG_NOSIGNAL);
+        if (w == -1) return -1;
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/*
+ * The daemon's answer is a sequence of frames, each a type byte and a
+ * 4-byte big-endian payload length followed by the payload. Output and
+ * diagnostics come as they are written, from whichever thread writes them;
+ * the exit frame (one byte, 0 or 1) ends the answer.
+ */
+#define FRAME_OUT  'O'          /* the listing: the client's stdout */
+#define FRAME_ERR  'E'          /* diagnostics: the client's stderr */
+#define FRAME_EXIT 'X'          /* the request's exit status */
+#define FRAME_HEAD 5
+
+struct answer
+{
+    int fd;
+    pthread_mutex_t lock;       /* frames from several threads do not interleave */
+};
+
+static int frame_send(struct answer *a, char type, const char *buf, size_t len)
+{
+    unsigned char head[FRAME_HEAD] = { (unsigned char)type, len >> 24, len >> 16, len >> 8, len };
+    pthread_mutex_lock(&a->lock);
+    int rc = send_all(a->fd, (const char *)head, FRAME_HEAD);
+    if (rc == 0)
+        rc = send_all(a->fd, buf, len);
+    pthread_mutex_unlock(&a->lock);
+    return rc;
+}
+
+/* A stdio stream whose writes become frames of one type. */
+struct frame_stream
+{
+    struct answer *a;
+    char type;
+};
+
+static ssize_t frame_stream_write(void *cookie, const char *buf, size_t len)
+{
+    struct frame_stream *fs = cookie;
+    return frame_send(fs->a, fs->type, buf, len) == 0 ? (ssize_t)len : -1;
+}
+
+static FILE *frame_stream_open(struct frame_stream *fs, struct answer *a, char type)
+{
+    fs->a = a;
+    fs->type = type;
+    cookie_io_functions_t io = { .write = frame_stream_write };
+    FILE *fp = fopencookie(fs, "w", io);
+    /* Diagnostics as they happen, output in large frames. */
+    if (fp)
+        setvbuf(fp, NULL, type == FRAME_ERR ? _IOLBF : _IOFBF, 65536);
+    return fp;
+}
+
+/* An answer that is only a message and a failure status. */
+static void answer_error(struct answer *a, const char *msg)
+{
+    const char status = 1;
+    frame_send(a, FRAME_ERR, msg, strlen(msg));
+    frame_send(a, FRAME_EXIT, &status, 1);
+}
+
+/* Reads one request; returns the number of strings (cwd + args) or -1. */
+static int read_request(int fd, char **bufp, char ***strs)
+{
+    size_t len = 0, cap = 4096;
+    char *buf = malloc(cap);
+    if (!buf) return -1;
+
+    /* The request is complete once an empty string starts at a string boundary. */
+    size_t start = 0;
+    int n = 0;
+    for (;;)
+    {
+        while (start < len)
+        {
+            char *nul = memchr(buf + start, '\0', len - start);
+            if (!nul) break;
+            if (nul == buf + start) goto done;
+            start = nul - buf + 1;
+            n++;
+        }
+        if (len == cap)
+        {
+            char *tmp = cap >= (1 << 20) ? NULL : realloc(buf, cap *= 2);
+            if (!tmp) { free(buf); return -1; }
+            buf = tmp;
+        }
+        ssize_t r = read(fd, buf + len, cap - len);
+        if (r <= 0) { free(buf); return -1; }
+        len += r;
+    }
+
+done:
+    if (n == 0) { free(buf); return -1; }
+    *strs = malloc((n + 1) * sizeof(char *));
+    if (!*strs) { free(buf); return -1; }
+    char *p = buf;
+    for (int i = 0; i < n; i++)
+    {
+        (*strs)[i] = p;
+        p += strlen(p) + 1;
+    }
+    (*strs)[n] = NULL;
+    *bufp = buf;
+    return n;
+}
+
+static void *serve_one(void *arg)
+{
+    struct answer a = { (int)(long)arg, PTHREAD_MUTEX_INITIALIZER };
+    char *buf = NULL, **strs = NULL;
+    int n = read_request(a.fd, &buf, &strs);
+    if (n == -1)
+    {
+        close(a.fd);
+        return NULL;
+    }
+
+    struct frame_stream out_fs, err_fs;
+    FILE *out = frame_stream_open(&out_fs, &a, FRAME_OUT);
+    FILE *err = frame_stream_open(&err_fs, &a, FRAME_ERR);
+    if (!out || !err)
+    {
+        answer_error(&a, "ls: the daemon is out of memory\n");
+        goto out;
+    }
+
+    /* strs[0] is the client's cwd; in its place goes the program name for getopt. */
+    char status = 1;
+    int base_fd = open(strs[0], O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd == -1)
+    {
+        fprintf(err, "ls: %s: %s\n", strs[0], strerror(errno));
+        goto done;
+    }
+    strs[0] = "ls";
+
+    struct cli cli;
+    if (parse_args(&cli, n, strs, err, 0) == -1)
+    {
+        close(base_fd);
+        goto done;
+    }
+    cli.o.dir_cache = serve_cache;
+    if (cli.from_file || cli.snapshot || cli.diff)
+        fprintf(err, "ls: --from-file, --snapshot and --diff are not available through --client\n");
+    else if (run_listing(&cli, out, base_fd) == 0)
+        status = 0;
+    ls_options_free(&cli.o);
+    close(base_fd);
+
+done:
+    /* Everything written so far goes out before the status that ends the answer. */
+    if (fflush(out) == EOF || fflush(err) == EOF)
+        status = 1;
+    frame_send(&a, FRAME_EXIT, &status, 1);
+
+out:
+    if (out) fclose(out);
+    if (err) fclose(err);
+    free(strs);
+    free(buf);
+    close(a.fd);
+    pthread_mutex_destroy(&a.lock);
+    return NULL;
+}
+
+static int serve(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) { perror("socket"); return -1; }
+    unlink(path);
+    /* Owner only from the start: nobody else can connect between bind() and chmod(). */
+    mode_t old_mask = umask(077);
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (rc == -1 || chmod(path, 0600) == -1 || listen(fd, 128) == -1)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    /* A client that goes away mid-listing must not take the daemon with it. */
+    signal(SIGPIPE, SIG_IGN);
+    serve_cache = ls_dir_cache_new(SERVE_DIR_CACHE_BYTES);
+
+    for (;;)
+    {
+        int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1)
+        {
+            perror("accept");
+            continue;
+        }
+
+        /* Requests run with the daemon's credentials: refuse other users. */
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1)
+        {
+            perror("SO_PEERCRED");
+            close(conn);
+            continue;
+        }
+        if (cred.uid != geteuid())
+        {
+            fprintf(stderr, "%s: refused a request from uid %u (pid %d)\n", path, (unsigned)cred.uid, (int)cred.pid);
+            struct answer a = { conn, PTHREAD_MUTEX_INITIALIZER };
+            answer_error(&a, "ls: the daemon only serves its own user\n");
+            close(conn);
+            continue;
+        }
+
+        pthread_t tid;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&tid, &attr, serve_one, (void *)(long)conn) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            close(conn);
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+/* ────────────── Client ────────────── */
+static int read_full(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0)
+    {
+        ssize_t r = read(fd, p, len);
+        if (r <= 0) return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* Replays the daemon's frames on stdout and stderr; the exit status, or -1 if there was none. */
+static int read_answer(int fd)
+{
+    char buf[65536];
+    unsigned char head[FRAME_HEAD];
+    while (read_full(fd, head, FRAME_HEAD) == 0)
+    {
+        size_t len = (size_t)head[1] << 24 | (size_t)head[2] << 16 | (size_t)head[3] << 8 | head[4];
+        if (head[0] == FRAME_EXIT)
+        {
+            unsigned char status;
+            return len == 1 && read_full(fd, &status, 1) == 0 ? status : -1;
+        }
+        if (head[0] != FRAME_OUT && head[0] != FRAME_ERR)
+            return -1;
+        int to = head[0] == FRAME_OUT ? STDOUT_FILENO : STDERR_FILENO;
+        while (len > 0)
+        {
+            size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+            if (read_full(fd, buf, chunk) == -1 || write_all(to, buf, chunk) == -1)
+                return -1;
+            len -= chunk;
+        }
+    }
+    return -1;
+}
+
+/* Sends argv (less the --client option itself) and copies the answer to stdout. */
+static int client(const char *path, int argc, char **argv)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) { perror("socket"); return -1; }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) { perror("getcwd"); close(fd); return -1; }
+
+    /*
+     * The daemon writes to a socket, so it would pick the pipe defaults.
+     * Ask for the terminal ones first; the user's own options come after
+     * and still override them. (isatty() would clobber a send error's errno.)
+     */
+    int width = terminal_width();
+    int rc = send_all(fd, cwd, strlen(cwd) + 1);
+    if (width > 0)
+    {
+        char wopt[32];
+        snprintf(wopt, sizeof(wopt), "--width=%d", width);
+        const char *tty_opts[] = { "-C", "-q", "--color=always", wopt };
+        for (size_t i = 0; i < sizeof(tty_opts) / sizeof(tty_opts[0]) && rc == 0; i++)
+            rc = send_all(fd, tty_opts[i], strlen(tty_opts[i]) + 1);
+    }
+    for (int i = 1; i < argc && rc == 0; i++)
+    {
+        if (strcmp(argv[i], "--") == 0)
+        {
+            for (; i < argc && rc == 0; i++)
+                rc = send_all(fd, argv[i], strlen(argv[i]) + 1);
+            break;
+        }
+        if (strncmp(argv[i], "--client=", 9) == 0)
+            continue;
+        if (strcmp(argv[i], "--client") == 0)
+        {
+            i++;
+            continue;
+        }
+        rc = send_all(fd, argv[i], strlen(argv[i]) + 1);
+    }
+    if (rc == 0)
+        rc = send_all(fd, "", 1);
+    int send_errno = rc == -1 ? errno : 0;
+
+    /* A refused request is still answered, even if the daemon stopped reading it. */
+    int status = read_answer(fd);
+    close(fd);
+    if (status == -1)
+    {
+        fprintf(stderr, "%s: %s\n", path, send_errno ? strerror(send_errno) : "answer cut short by the daemon");
+        return -1;
+    }
+    return status == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    /* Only the character classes: display widths of UTF-8 names. */
+    setlocale(LC_CTYPE, "");
+
+    struct cli cli;
+    if (parse_args(&cli, argc, argv, stderr, terminal_width()) == -1)
+        exit(EXIT_FAILURE);
+
+    if (cli.nice_io)
+        set_idle_io();
+
+    int rc;
+    if (cli.serve)
+        rc = serve(cli.serve);
+    else if (cli.client)
+        rc = client(cli.client, argc, argv);
+    else if (cli.from_file)
+    {
+        rc = run_batch(&cli);
+        fflush(stdout);
+    }
+    else
+    {
+        rc = run_listing(&cli, stdout, AT_FDCWD);
+        fflush(stdout);
+    }
+
+    ls_options_free(&cli.o);
+    return rc == -1 ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,6143 @@
+#define _GNU_SOURCE         /* statx(), fmemopen() */
+
+/*
+ * liblsdir: the directory walker, filters and printers of lsv1.7.0.
+ *
+ * Notes:
+ * - Entries are kept as {name, struct stat} records so that sorting keeps
+ *   each name together with its own metadata.
+ * - Visited directories are remembered by (st_dev, st_ino) in a small
+ *   open-addressing hash set; this breaks symlink cycles under -L and skips
+ *   subtrees that are reachable more than once (bind mounts).
+ * - With --du every directory gets a du_node; once a directory's own entries
+ *   are stat'ed their sums are added to that node and to all its ancestors,
+ *   so no second traversal is needed. Totals are reported largest first.
+ * - Name filters are compiled once. "*suffix", "prefix*" and wildcard-free
+ *   patterns are matched with memcmp(); anything else goes to fnmatch(), or
+ *   regexec() when regex patterns are requested.
+ * - Metadata predicates are compiled once into a postfix program. Each one
+ *   names the statx fields it reads; the union of those and what the chosen
+ *   display needs becomes the statx() mask. Entries that fail the program
+ *   are dropped right after the stat, before they are copied or sorted.
+ *   Under -R, directories that fail a filter are still walked, not listed.
+ * - A directory is read in two phases: readdir() collects the surviving
+ *   names into one arena together with d_ino, then the stats are issued in
+ *   ascending inode order (like GNU ls and fts) so inode-table reads sweep
+ *   the disk instead of following the hash order of the directory.
+ * - All walk state lives in an ls_session, so independent sessions may run
+ *   in parallel threads. The shared caches below are mutex-protected.
+ * - uid/gid names are resolved once per id with getpwuid_r()/getgrgid_r()
+ *   and kept in a process-wide table, so a long-lived process (the --serve
+ *   daemon) pays for NSS only on the first listing.
+ * - An optional ls_dir_cache keeps the raw readdir() result of recently
+ *   listed directories keyed by (st_dev, st_ino). A snapshot is reused only
+ *   while the directory's mtime and ctime are unchanged; directories touched
+ *   within the last second are not cached, since a change in the same clock
+ *   tick would go unnoticed. Entries are always stat'ed afresh.
+ * - --count reads directories with getdents64() into a stack buffer and
+ *   never allocates per entry, stats nothing (d_type tells directories
+ *   apart; only DT_UNKNOWN costs an fstatat()) and sorts nothing but the
+ *   per-directory results. Under -R subtrees are counted by a pool of
+ *   threads sharing one queue of directories.
+ * - --max-ops and --max-latency share one token bucket per session. Every
+ *   statx() and every directory open takes a token; the measured statx()
+ *   latency drives the bucket's rate up additively while it stays under
+ *   the limit and halves it when it does not (AIMD, as in TCP).
+ * - Snapshot manifests are written in walk order (pre-order, siblings by
+ *   name), which is also the order a later walk visits the live tree in, so
+ *   --diff is a streaming merge of the two and needs no index of the old
+ *   manifest in memory.
+ * - Directories with at least parallel_sort_min entries are sorted by a
+ *   chunked qsort() on several threads followed by a parallel k-way merge
+ *   of the chunks, over (name, index) keys rather than whole records.
+ * - Every filesystem (st_dev) the walk enters gets a profile from one
+ *   fstatfs(): how far d_type can be trusted, whether entries are stat'ed
+ *   in readdir order, in inode order or by several threads at once, and
+ *   whether it is a pseudo filesystem, which -R leaves out if asked to
+ *   (skip_pseudo). --one-file-system applies the st_dev test to every
+ *   mount.
+ * - Under --timeout-dir/--timeout-stat a directory's open and readdir() run
+ *   on one helper thread and its stats on another, while the walker waits
+ *   with a deadline. An entry whose stat is given up on is still listed,
+ *   flagged LS_ENTRY_TIMEOUT, and the directory is reported as incomplete
+ *   when the session finishes.
+ * - With max_memory set, a directory whose entries outgrow it is read in
+ *   batches that are sorted and spilled to temporary files as runs, then
+ *   merged with a heap straight into the sink, a batch at a time.
+ * - -i and -s only widen the statx() mask. The ACL marker and -Z need
+ *   getxattr() on every listed entry (not on filtered-out ones), which
+ *   runs after the stats on the same engine (threads on network
+ *   filesystems) and stops for good on a filesystem that answers ENOTSUP.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pwd.h>
+#include <grp.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <fcntl.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <sys/xattr.h>
+#include <wchar.h>
+
+#include "lsdir.h"
+
+/* ────────────── ANSI COLOR CODES ────────────── */
+#define COLOR_RESET   "\033[0m"
+#define COLOR_BLUE    "\033[0;34m"
+#define COLOR_GREEN   "\033[0;32m"
+#define COLOR_RED     "\033[0;31m"
+#define COLOR_PINK    "\033[0;35m"
+#define COLOR_REVERSE "\033[7m"
+
+/* ────────────── Name filters ────────────── */
+enum pattern_kind { PAT_EXACT, PAT_PREFIX, PAT_SUFFIX, PAT_GLOB, PAT_REGEX };
+#define NLISTS 3
+
+struct name_pattern
+{
+    enum pattern_kind kind;
+    const char *text;           /* whole pattern, for fnmatch() */
+    const char *lit;            /* literal part for the memcmp() fast paths */
+    size_t litlen;
+    regex_t re;
+};
+
+struct pattern_list
+{
+    struct name_pattern *pats;
+    int count;
+};
+
+/* ────────────── Metadata predicates ────────────── */
+struct pred_insn
+{
+    unsigned char op;           /* enum ls_pred_op */
+    signed char cmp;            /* SIZE: -1 less, 0 equal, +1 more; PERM: 0 exact, '-' all, '/' any */
+    mode_t mode;                /* TYPE: S_IFMT value; PERM: permission bits */
+    long long num;              /* SIZE: count of units */
+    long long unit;             /* SIZE: bytes per unit */
+    struct timespec ts;         /* NEWER: reference mtime */
+};
+
+/* statx fields each predicate reads; indexed by enum ls_pred_op. */
+static const unsigned int pred_needs[] = {
+    [LS_PRED_SIZE]  = STATX_SIZE,
+    [LS_PRED_NEWER] = STATX_MTIME,
+    [LS_PRED_TYPE]  = STATX_TYPE,
+    [LS_PRED_PERM]  = STATX_MODE,
+};
+
+struct ls_compiled
+{
+    struct pattern_list filters[NLISTS];
+    struct pred_insn *pred_tokens;  /* as given on the command line */
+    int pred_ntokens;
+    struct pred_insn *pred_prog;    /* postfix program */
+    int pred_len;
+    unsigned int stat_mask;
+    int prepared;
+
+    /* Decoded --cursor. */
+    int cursor_kind;                /* 0, 'U' (readdir position) or 'S' (last name) */
+    unsigned long long cursor_dev, cursor_ino;  /* the directory it was handed out for */
+    long cursor_pos;
+    char *cursor_name;
+};
+
+/* ────────────── Sinks ────────────── */
+struct ls_sink
+{
+    const struct ls_sink_ops *ops;
+    void *arg;
+    const struct ls_options *opts;  /* set while a session is using the sink */
+    FILE *fp;
+    int own_fp;                     /* buffer sink: fp is an fmemopen() stream */
+    ls_entry_cb cb;
+    int stop;                       /* set by a sink to end the walk early */
+    int base_fd;                    /* relative paths resolve against this (AT_FDCWD) */
+    int headers;                    /* print "path:" before each operand directory */
+    int framing;                    /* blank line after each operand's listing */
+
+    /* Text sinks: the printer specialized for opts, and the line width. */
+    void (*print)(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count);
+    const struct ls_options *print_opts;
+    int term_width;
+
+    /*
+     * A directory spilled under max_memory arrives in several dir_entries
+     * calls (chunked). Sinks whose layout depends on the whole directory
+     * see every batch through measure() before the first call.
+     */
+    int chunked;
+    void (*measure)(struct ls_sink *s, const struct ls_entry *ents, int count);
+    struct text_totals
+    {
+        int started;            /* the first chunk has been printed */
+        long long blocks;
+        int name_width, links, size, user, group;
+        int x;                  /* -x: column the last chunk ended in */
+        struct text_prefix
+        {
+            int ino, blocks, context;   /* -i, -s and -Z widths; 0 when not shown */
+            int acl;                    /* some entry has an ACL: long rows get a marker column */
+        } prefix;
+    } totals;
+};
+
+/* ────────────── Walk state ────────────── */
+struct dev_ino
+{
+    dev_t dev;
+    ino_t ino;
+    int used;
+};
+
+struct du_node
+{
+    char *path;
+    long long blocks;
+    long long bytes;
+    long files;
+    long dirs;
+    struct du_node *parent;
+};
+
+/* ────────────── Directory snapshot cache ────────────── */
+struct dir_rec
+{
+    size_t name_off;
+    ino_t ino;
+    unsigned char type;         /* d_type */
+};
+
+struct dir_snapshot
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime, ctime;
+    char *names;
+    size_t names_len, names_cap;
+    struct dir_rec *recs;
+    int nrecs, recs_cap;
+    int refs;                   /* the cache holds one; each reader holds one */
+    struct dir_snapshot *hnext; /* hash chain */
+    struct dir_snapshot *prev, *next;   /* LRU list, most recent first */
+};
+
+#define DIR_CACHE_BUCKETS 1024
+
+struct ls_dir_cache
+{
+    pthread_mutex_t lock;
+    struct dir_snapshot *buckets[DIR_CACHE_BUCKETS];
+    struct dir_snapshot *head, *tail;
+    size_t bytes, max_bytes;
+    unsigned long hits, misses;
+};
+
+struct walk_frame
+{
+    char *path;
+    const char *name;           /* last component of path */
+    struct stat st;
+    int have_st;                /* 0 after a resume: stat when popped */
+    int depth;
+    struct du_node *du_parent;
+    int prefetched;             /* requested from the -R pipeline's reader */
+};
+
+struct walk_pipe;
+struct prefetch;
+
+struct ls_session
+{
+    const struct ls_options *o;
+    const struct ls_compiled *c;
+    struct ls_sink *sink;
+    int base_fd;
+    int always_headers;             /* "path:" even before a lone operand directory */
+
+    struct dev_ino *visited;
+    size_t visited_cap, visited_count;
+
+    struct du_node **du_nodes;
+    int du_count, du_capacity;
+    struct du_node *du_current;     /* node of the directory being listed */
+
+    char *next_cursor;              /* set when a page was cut short */
+
+    struct walk_frame *frames;      /* -R directories still to list, next on top */
+    int nframes, frames_capacity;
+
+    /* --checkpoint */
+    const char *checkpoint_path;
+    double checkpoint_interval;     /* seconds */
+    struct timespec checkpoint_last;
+    char *operand;                  /* the walk being checkpointed */
+    long long dirs_done;
+    int walk_finished;              /* the checkpoint is obsolete */
+
+    struct throttle *throttle;      /* NULL unless --max-ops or --max-latency */
+
+    pthread_mutex_t count_lock;     /* --count workers append to counts */
+    struct ls_count *counts;
+    int ncounts, counts_capacity;
+
+    /* --timeout-dir, --timeout-stat */
+    long stat_timeouts;
+    int dir_timeouts;
+    char **partial;                 /* directories that hit a deadline, in walk order */
+    int npartial, partial_capacity;
+
+    pthread_mutex_t fs_lock;        /* profiles, one per st_dev seen */
+    struct fs_profile *profiles;
+    int nprofiles, profiles_capacity;
+    const struct fs_type *fs;       /* profile of the directory being listed */
+    dev_t root_dev;                 /* filesystem of the operand being walked */
+    struct walk_pipe *pipe;         /* the -R pipeline, while one runs (see pipe_run()) */
+    struct prefetch *prefetched;    /* read ahead for the directory list_dir() is given next */
+    dev_t *no_xattr;                /* filesystems that answered ENOTSUP (under fs_lock) */
+    int nno_xattr, no_xattr_capacity;
+
+    /* debug_columns: getxattr() calls and time for the ACL marker [0] and -Z [1] */
+    long meta_calls[2];
+    long long meta_ns[2];
+    long meta_entries;              /* entries the extra columns were fetched for */
+    long meta_skipped;              /* entries on filesystems without xattrs */
+};
+
+/* ────────────── Function Prototypes ────────────── */
+static int do_ls(struct ls_session *ss, const char *dir, int depth);
+static int do_ls_page(struct ls_session *ss, const char *dir);
+static void do_count(struct ls_session *ss, const char *dir);
+static void checkpoint_maybe(struct ls_session *ss);
+static void queue_subdirs(struct ls_session *ss, const char *dir, int depth, const struct ls_entry *ents, int count,
+                          const struct ls_entry *walk, int walk_count, int sort);
+static void snap_escape(FILE *fp, const char *s);
+static void snap_unescape(char *s);
+static int cmp_walk_path(const char *a, const char *b);
+static void text_printer_pick(struct ls_sink *s);
+static void text_measure(struct ls_sink *s, const struct ls_entry *ents, int count);
+static int stat_entry(const struct ls_session *ss, int dfd, const char *name, struct stat *st);
+static int visited_insert(struct ls_session *ss, dev_t dev, ino_t ino);
+static size_t hash_dev_ino(dev_t dev, ino_t ino);
+static void du_add(struct ls_session *ss, const struct ls_entry *ents, int count);
+static int name_excluded(const struct ls_compiled *c, const char *name, size_t len);
+static int name_pruned(const struct ls_compiled *c, const char *name);
+static int pred_eval(const struct ls_compiled *c, const struct stat *st);
+
+/* ────────────── Comparison function for qsort ────────────── */
+static int cmpstring(const void *a, const void *b)
+{
+    const struct ls_entry *ea = a;
+    const struct ls_entry *eb = b;
+    return strcmp(ea->name, eb->name);
+}
+
+static int cmp_entry_ptr(const void *a, const void *b)
+{
+    const struct ls_entry *ea = *(const struct ls_entry **)a;
+    const struct ls_entry *eb = *(const struct ls_entry **)b;
+    return strcmp(ea->name, eb->name);
+}
+
+/* ────────────── Options ────────────── */
+/* Diagnostics go to o->errors, stderr by default. */
+static FILE *err_out(const struct ls_options *o)
+{
+    return o->errors ? o->errors : stderr;
+}
+
+/* perror() onto o->errors. */
+static void report_errno(const struct ls_options *o, const char *what)
+{
+    int e = errno;
+    fprintf(err_out(o), "%s: %s\n", what, strerror(e));
+    errno = e;
+}
+
+void ls_options_init(struct ls_options *o)
+{
+    memset(o, 0, sizeof(*o));
+    o->display = LS_DISPLAY_COLUMNS;
+    o->stat_inode_order = 1;
+    o->parallel_sort_min = 500000;
+    o->prefetch = 8;
+}
+
+static struct ls_compiled *compiled(struct ls_options *o)
+{
+    if (!o->compiled)
+    {
+        o->compiled = calloc(1, sizeof(struct ls_compiled));
+        if (!o->compiled) { perror("calloc"); exit(EXIT_FAILURE); }
+    }
+    return o->compiled;
+}
+
+int ls_options_add_pattern(struct ls_options *o, enum ls_pattern_list list, const char *pat)
+{
+    if ((int)list < 0 || list >= NLISTS) { errno = EINVAL; return -1; }
+
+    struct pattern_list *pl = &compiled(o)->filters[list];
+    struct name_pattern *tmp = realloc(pl->pats, (pl->count + 1) * sizeof(struct name_pattern));
+    if (!tmp) { perror("realloc"); return -1; }
+    pl->pats = tmp;
+    memset(&pl->pats[pl->count], 0, sizeof(struct name_pattern));
+    pl->pats[pl->count].text = pat;
+    pl->count++;
+    return 0;
+}
+
+static int pred_usage(const struct ls_options *o, const char *what, const char *arg)
+{
+    fprintf(err_out(o), "invalid %s '%s'\n", what, arg);
+    errno = EINVAL;
+    return -1;
+}
+
+/* Parse one predicate into a token; operators carry no argument. */
+int ls_options_add_predicate(struct ls_options *o, enum ls_pred_op op, const char *arg)
+{
+    struct pred_insn in;
+    memset(&in, 0, sizeof(in));
+    in.op = op;
+
+    switch (op)
+    {
+        case LS_PRED_SIZE:
+        {
+            const char *p = arg;
+            if (*p == '+') { in.cmp = 1; p++; }
+            else if (*p == '-') { in.cmp = -1; p++; }
+            char *end;
+            errno = 0;
+            in.num = strtoll(p, &end, 10);
+            if (errno || end == p || in.num < 0) return pred_usage(o, "size", arg);
+            in.unit = 1;
+            switch (*end)
+            {
+                case '\0': case 'c': break;
+                case 'k': case 'K': in.unit = 1LL << 10; break;
+                case 'M': in.unit = 1LL << 20; break;
+                case 'G': in.unit = 1LL << 30; break;
+                case 'T': in.unit = 1LL << 40; break;
+                default: return pred_usage(o, "size", arg);
+            }
+            if (*end && end[1]) return pred_usage(o, "size", arg);
+            break;
+        }
+        case LS_PRED_NEWER:
+        {
+            struct stat ref;
+            if (stat(arg, &ref) == -1) { report_errno(o, arg); return -1; }
+            in.ts = ref.st_mtim;
+            break;
+        }
+        case LS_PRED_TYPE:
+            if (strlen(arg) != 1) return pred_usage(o, "type", arg);
+            switch (arg[0])
+            {
+                case 'f': in.mode = S_IFREG; break;
+                case 'd': in.mode = S_IFDIR; break;
+                case 'l': in.mode = S_IFLNK; break;
+                case 'b': in.mode = S_IFBLK; break;
+                case 'c': in.mode = S_IFCHR; break;
+                case 'p': in.mode = S_IFIFO; break;
+                case 's': in.mode = S_IFSOCK; break;
+                default: return pred_usage(o, "type", arg);
+            }
+            break;
+        case LS_PRED_PERM:
+        {
+            const char *p = arg;
+            if (*p == '-' || *p == '/') in.cmp = *p++;
+            char *end;
+            long bits = strtol(p, &end, 8);
+            if (end == p || *end || bits < 0 || bits > 07777) return pred_usage(o, "perm", arg);
+            in.mode = (mode_t)bits;
+            break;
+        }
+        case LS_PRED_AND:
+        case LS_PRED_OR:
+        case LS_PRED_NOT:
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    struct ls_compiled *c = compiled(o);
+    struct pred_insn *tmp = realloc(c->pred_tokens, (c->pred_ntokens + 1) * sizeof(struct pred_insn));
+    if (!tmp) { perror("realloc"); return -1; }
+    c->pred_tokens = tmp;
+    c->pred_tokens[c->pred_ntokens++] = in;
+    return 0;
+}
+
+/* Pick the cheapest matcher that gives the same answer as fnmatch(). */
+static int compile_one(FILE *err, struct name_pattern *np, int regex)
+{
+    const char *pat = np->text;
+    size_t len = strlen(pat);
+
+    if (regex)
+    {
+        int rc = regcomp(&np->re, pat, REG_EXTENDED | REG_NOSUB);
+        if (rc != 0)
+        {
+            char msg[256];
+            regerror(rc, &np->re, msg, sizeof(msg));
+            fprintf(err, "invalid regex '%s': %s\n", pat, msg);
+            errno = EINVAL;
+            return -1;
+        }
+        np->kind = PAT_REGEX;
+        return 0;
+    }
+
+    const char *special = "*?[\\";
+    size_t first = strcspn(pat, special);
+
+    if (first == len)
+    {
+        np->kind = PAT_EXACT;
+        np->lit = pat;
+        np->litlen = len;
+    }
+    else if (pat[0] == '*' && strcspn(pat + 1, special) == len - 1)
+    {
+        np->kind = PAT_SUFFIX;
+        np->lit = pat + 1;
+        np->litlen = len - 1;
+    }
+    else if (first == len - 1 && pat[first] == '*')
+    {
+        np->kind = PAT_PREFIX;
+        np->lit = pat;
+        np->litlen = len - 1;
+    }
+    else
+        np->kind = PAT_GLOB;
+    return 0;
+}
+
+static int pred_prec(int op)
+{
+    return op == LS_PRED_NOT ? 3 : op == LS_PRED_AND ? 2 : 1;
+}
+
+/*
+ * Shunting-yard from infix tokens to a postfix program. Adjacent tests are
+ * joined with an implicit --and, as in find(1); --not binds tightest and
+ * --or loosest.
+ */
+static int pred_compile(FILE *err, struct ls_compiled *c)
+{
+    if (c->pred_ntokens == 0)
+        return 0;
+
+    c->pred_prog = malloc(2 * c->pred_ntokens * sizeof(struct pred_insn));
+    unsigned char *ops = malloc(2 * c->pred_ntokens);
+    if (!c->pred_prog || !ops) { perror("malloc"); free(ops); return -1; }
+
+    int nops = 0, want_operand = 1;
+
+    for (int i = 0; i < c->pred_ntokens; i++)
+    {
+        struct pred_insn *t = &c->pred_tokens[i];
+        int is_test = t->op < LS_PRED_AND;
+
+        if ((is_test || t->op == LS_PRED_NOT) && !want_operand)
+        {
+            /* implicit --and */
+            while (nops > 0 && pred_prec(ops[nops - 1]) >= pred_prec(LS_PRED_AND))
+                c->pred_prog[c->pred_len++] = (struct pred_insn){ .op = ops[--nops] };
+            ops[nops++] = LS_PRED_AND;
+            want_operand = 1;
+        }
+
+        if (is_test)
+        {
+            c->pred_prog[c->pred_len++] = *t;
+            c->stat_mask |= pred_needs[t->op];
+            want_operand = 0;
+        }
+        else if (t->op == LS_PRED_NOT)
+            ops[nops++] = LS_PRED_NOT;
+        else
+        {
+            if (want_operand)
+            {
+                fprintf(err, "predicate operator without a left operand\n");
+                free(ops);
+                errno = EINVAL;
+                return -1;
+            }
+            while (nops > 0 && pred_prec(ops[nops - 1]) >= pred_prec(t->op))
+                c->pred_prog[c->pred_len++] = (struct pred_insn){ .op = ops[--nops] };
+            ops[nops++] = t->op;
+            want_operand = 1;
+        }
+    }
+
+    if (want_operand)
+    {
+        fprintf(err, "predicate expression ends with an operator\n");
+        free(ops);
+        errno = EINVAL;
+        return -1;
+    }
+    while (nops > 0)
+        c->pred_prog[c->pred_len++] = (struct pred_insn){ .op = ops[--nops] };
+
+    free(ops);
+    free(c->pred_tokens);
+    c->pred_tokens = NULL;
+    c->pred_ntokens = 0;
+    return 0;
+}
+
+/*
+ * Cursors are hex-encoded text, opaque to callers: "U:<dir dev>:<dir
+ * ino>:<telldir position>" for -U paging and "S:<dir dev>:<dir ino>:<last
+ * name>" for sorted paging. The directory's identity makes a cursor
+ * useless for any other directory.
+ */
+static char *cursor_encode(const char *text)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t len = strlen(text);
+    char *tok = malloc(len * 2 + 1);
+    if (!tok) { perror("malloc"); exit(EXIT_FAILURE); }
+    for (size_t i = 0; i < len; i++)
+    {
+        tok[2 * i] = hex[(unsigned char)text[i] >> 4];
+        tok[2 * i + 1] = hex[(unsigned char)text[i] & 15];
+    }
+    tok[len * 2] = '\0';
+    return tok;
+}
+
+static int hex_value(int ch)
+{
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+static int cursor_decode(FILE *err, struct ls_compiled *c, const char *tok, int unsorted)
+{
+    size_t len = strlen(tok);
+    char *text = malloc(len / 2 + 1);
+    if (!text) { perror("malloc"); return -1; }
+
+    size_t n = 0;
+    for (size_t i = 0; i + 1 < len; i += 2)
+    {
+        int hi = hex_value(tok[i]), lo = hex_value(tok[i + 1]);
+        if (hi < 0 || lo < 0) break;
+        text[n++] = (char)(hi << 4 | lo);
+    }
+    text[n] = '\0';
+
+    int ok = 0;
+    if (n * 2 == len && n > 2 && text[1] == ':' && strlen(text) == n)
+    {
+        int name_at = 0;
+        if (text[0] == 'U' && unsorted)
+            ok = sscanf(text + 2, "%llu:%llu:%ld", &c->cursor_dev, &c->cursor_ino, &c->cursor_pos) == 3;
+        else if (text[0] == 'S' && !unsorted &&
+                 sscanf(text + 2, "%llu:%llu:%n", &c->cursor_dev, &c->cursor_ino, &name_at) == 2 &&
+                 name_at > 0 && text[2 + name_at] != '\0')
+            ok = (c->cursor_name = strdup(text + 2 + name_at)) != NULL;
+    }
+    if (!ok)
+    {
+        fprintf(err, "invalid cursor '%s'%s\n", tok,
+                n > 0 && (text[0] == 'U') != !!unsorted ? " (-U and sorted cursors are not interchangeable)" : "");
+        free(text);
+        return -1;
+    }
+    c->cursor_kind = text[0];
+    free(text);
+    return 0;
+}
+
+int ls_options_prepare(struct ls_options *o)
+{
+    struct ls_compiled *c = compiled(o);
+    if (c->prepared)
+        return 0;
+
+    for (int l = 0; l < NLISTS; l++)
+        for (int i = 0; i < c->filters[l].count; i++)
+            if (compile_one(err_out(o), &c->filters[l].pats[i], o->regex) == -1)
+                return -1;
+
+    /* Ask statx() only for what this listing will look at. */
+    c->stat_mask |= STATX_TYPE | STATX_MODE;
+    if (pred_compile(err_out(o), c) == -1)
+        return -1;
+    if (o->count && c->pred_len > 0)
+    {
+        fprintf(err_out(o), "--count stats nothing, so predicates cannot be used with it\n");
+        return -1;
+    }
+    if (o->display == LS_DISPLAY_LONG || o->full_stat) c->stat_mask |= STATX_BASIC_STATS;
+    if (o->du) c->stat_mask |= STATX_SIZE | STATX_BLOCKS;
+    if (o->follow_links || o->same_dir_once) c->stat_mask |= STATX_INO;
+    if (o->show_inode) c->stat_mask |= STATX_INO;
+    if (o->show_blocks) c->stat_mask |= STATX_BLOCKS;
+
+    if (o->cursor && cursor_decode(err_out(o), c, o->cursor, o->unsorted) == -1)
+        return -1;
+
+    c->prepared = 1;
+    return 0;
+}
+
+void ls_options_free(struct ls_options *o)
+{
+    struct ls_compiled *c = o->compiled;
+    if (!c) return;
+
+    for (int l = 0; l < NLISTS; l++)
+    {
+        for (int i = 0; i < c->filters[l].count; i++)
+            if (c->filters[l].pats[i].kind == PAT_REGEX)
+                regfree(&c->filters[l].pats[i].re);
+        free(c->filters[l].pats);
+    }
+    free(c->pred_tokens);
+    free(c->pred_prog);
+    free(c->cursor_name);
+    free(c);
+    o->compiled = NULL;
+}
+
+/* ────────────── stat_entry: statx() relative to the open directory ────────────── */
+static void statx_to_stat(const struct statx *sx, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+    st->st_ino = sx->stx_ino;
+    st->st_mode = sx->stx_mode;
+    st->st_nlink = sx->stx_nlink;
+    st->st_uid = sx->stx_uid;
+    st->st_gid = sx->stx_gid;
+    st->st_rdev = makedev(sx->stx_rdev_major, sx->stx_rdev_minor);
+    st->st_size = sx->stx_size;
+    st->st_blksize = sx->stx_blksize;
+    st->st_blocks = sx->stx_blocks;
+    st->st_atim.tv_sec = sx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = sx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = sx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = sx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = sx->stx_ctime.tv_nsec;
+}
+
+/* ────────────── Metadata-op throttle: token bucket with AIMD rate ────────────── */
+#define THROTTLE_UNBOUNDED  100000.0    /* ops/s standing in for "no --max-ops" */
+#define THROTTLE_MIN_RATE   10.0
+#define THROTTLE_ADJUST     0.1         /* seconds between rate adjustments */
+
+struct throttle
+{
+    pthread_mutex_t lock;       /* --count -R workers share the session */
+    double ceiling;             /* --max-ops */
+    double rate;                /* current ops/s */
+    double tokens;
+    double latency_limit;       /* seconds; 0 disables the back-off */
+    double latency_ewma;
+    struct timespec refilled, adjusted;
+};
+
+static double ts_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static struct throttle *throttle_new(const struct ls_options *o)
+{
+    struct throttle *t = calloc(1, sizeof(struct throttle));
+    if (!t) { perror("calloc"); exit(EXIT_FAILURE); }
+    pthread_mutex_init(&t->lock, NULL);
+    t->ceiling = o->max_ops > 0 ? o->max_ops : THROTTLE_UNBOUNDED;
+    t->rate = t->ceiling;
+    t->tokens = 1;
+    t->latency_limit = o->max_latency_ms / 1000.0;
+    clock_gettime(CLOCK_MONOTONIC, &t->refilled);
+    t->adjusted = t->refilled;
+    return t;
+}
+
+static void throttle_free(struct throttle *t)
+{
+    if (!t) return;
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+/* Waits for a token. The bucket holds at most a tenth of a second's worth. */
+static void throttle_take(struct throttle *t)
+{
+    pthread_mutex_lock(&t->lock);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double burst = t->rate / 10 > 1 ? t->rate / 10 : 1;
+    t->tokens += ts_diff(&now, &t->refilled) * t->rate;
+    if (t->tokens > burst) t->tokens = burst;
+    t->refilled = now;
+
+    t->tokens -= 1;
+    double wait = t->tokens < 0 ? -t->tokens / t->rate : 0;
+    pthread_mutex_unlock(&t->lock);
+
+    if (wait > 0)
+    {
+        struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Feeds one statx() latency into the average and adjusts the rate now and then. */
+static void throttle_observe(struct throttle *t, double latency)
+{
+    if (t->latency_limit <= 0)
+        return;
+
+    pthread_mutex_lock(&t->lock);
+    t->latency_ewma = t->latency_ewma == 0 ? latency : 0.9 * t->latency_ewma + 0.1 * latency;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (ts_diff(&now, &t->adjusted) >= THROTTLE_ADJUST)
+    {
+        if (t->latency_ewma > t->latency_limit)
+            t->rate = t->rate / 2 > THROTTLE_MIN_RATE ? t->rate / 2 : THROTTLE_MIN_RATE;
+        else
+        {
+            double step = t->ceiling / 20 > THROTTLE_MIN_RATE ? t->ceiling / 20 : THROTTLE_MIN_RATE;
+            t->rate = t->rate + step < t->ceiling ? t->rate + step : t->ceiling;
+        }
+        t->adjusted = now;
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+static int open_dir(const struct ls_session *ss, const char *dir)
+{
+    if (ss->throttle)
+        throttle_take(ss->throttle);
+    return openat(ss->base_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+static int stat_entry_raw(const struct ls_session *ss, int dfd, const char *name, struct stat *st);
+static int stat_at(int dfd, const char *name, int follow, unsigned int mask, struct stat *st);
+
+static int stat_entry(const struct ls_session *ss, int dfd, const char *name, struct stat *st)
+{
+    if (!ss->throttle)
+        return stat_entry_raw(ss, dfd, name, st);
+
+    throttle_take(ss->throttle);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = stat_entry_raw(ss, dfd, name, st);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    throttle_observe(ss->throttle, ts_diff(&t1, &t0));
+    return rc;
+}
+
+static int stat_entry_raw(const struct ls_session *ss, int dfd, const char *name, struct stat *st)
+{
+    return stat_at(dfd, name, ss->o->follow_links, ss->c->stat_mask, st);
+}
+
+static int stat_at(int dfd, const char *name, int follow, unsigned int mask, struct stat *st)
+{
+    struct statx sx;
+    int flags = AT_NO_AUTOMOUNT | (follow ? 0 : AT_SYMLINK_NOFOLLOW);
+
+    if (statx(dfd, name, flags, mask, &sx) == 0 ||
+        (follow && statx(dfd, name, flags | AT_SYMLINK_NOFOLLOW, mask, &sx) == 0))
+    {
+        statx_to_stat(&sx, st);
+        return 0;
+    }
+    if (errno != ENOSYS)
+        return -1;
+
+    /* Kernels older than 4.11 have no statx(). */
+    if (fstatat(dfd, name, st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0)
+        return 0;
+    return follow ? fstatat(dfd, name, st, AT_SYMLINK_NOFOLLOW) : -1;
+}
+
+/* ────────────── uid/gid name cache ────────────── */
+#define ID_MISS_TTL   60              /* seconds before an id with no name is looked up again */
+#define ID_BUF_MAX    (1 << 20)       /* largest getpwuid_r/getgrgid_r buffer tried */
+
+struct id_name
+{
+    unsigned int id;
+    int used;
+    int found;                  /* 0: no passwd/group entry for this id */
+    time_t checked;             /* when it was looked up (CLOCK_MONOTONIC seconds) */
+    char name[64];
+};
+
+struct id_cache
+{
+    struct id_name *tab;
+    size_t cap, count;
+};
+
+static struct id_cache user_cache, group_cache;
+static pthread_mutex_t id_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct id_name *id_slot(struct id_cache *ic, unsigned int id)
+{
+    size_t mask = ic->cap - 1;
+    size_t j = ((size_t)id * 0x9e3779b97f4a7c15ULL >> 32) & mask;
+    while (ic->tab[j].used && ic->tab[j].id != id)
+        j = (j + 1) & mask;
+    return &ic->tab[j];
+}
+
+static void id_grow(struct id_cache *ic)
+{
+    struct id_cache bigger = { NULL, ic->cap == 0 ? 64 : ic->cap * 2, 0 };
+    bigger.tab = calloc(bigger.cap, sizeof(struct id_name));
+    if (!bigger.tab) { perror("calloc"); exit(EXIT_FAILURE); }
+    for (size_t i = 0; i < ic->cap; i++)
+        if (ic->tab[i].used)
+            *id_slot(&bigger, ic->tab[i].id) = ic->tab[i];
+    bigger.count = ic->count;
+    free(ic->tab);
+    *ic = bigger;
+}
+
+/*
+ * Asks NSS for the name of id, doubling the scratch buffer while the entry
+ * does not fit (a group with many members outgrows 4 KiB). Runs without
+ * id_cache_lock held: the lookup may go over the network.
+ */
+static int id_resolve(int is_group, unsigned int id, char *name, size_t size)
+{
+    char stack[4096], *scratch = stack;
+    size_t len = sizeof(stack);
+    int rc, found = 0;
+
+    for (;;)
+    {
+        if (is_group)
+        {
+            struct group gr, *res = NULL;
+            rc = getgrgid_r(id, &gr, scratch, len, &res);
+            if (rc == 0 && res)
+            {
+                snprintf(name, size, "%s", res->gr_name);
+                found = 1;
+            }
+        }
+        else
+        {
+            struct passwd pw, *res = NULL;
+            rc = getpwuid_r(id, &pw, scratch, len, &res);
+            if (rc == 0 && res)
+            {
+                snprintf(name, size, "%s", res->pw_name);
+                found = 1;
+            }
+        }
+        if (rc != ERANGE || len >= ID_BUF_MAX)
+            break;
+        len *= 2;
+        char *bigger = realloc(scratch == stack ? NULL : scratch, len);
+        if (!bigger) { perror("realloc"); exit(EXIT_FAILURE); }
+        scratch = bigger;
+    }
+    if (scratch != stack)
+        free(scratch);
+    return found;
+}
+
+/*
+ * Copies the user or group name for id into buf (64 bytes); returns 0 if
+ * there is none. Names are kept for good; an id without one is asked about
+ * again after ID_MISS_TTL, since a long-running --serve daemon outlives
+ * account changes.
+ */
+static int id_lookup(int is_group, unsigned int id, char *buf)
+{
+    struct id_cache *ic = is_group ? &group_cache : &user_cache;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&id_cache_lock);
+    if (ic->cap)
+    {
+        struct id_name *slot = id_slot(ic, id);
+        if (slot->used && (slot->found || now.tv_sec - slot->checked < ID_MISS_TTL))
+        {
+            int found = slot->found;
+            memcpy(buf, slot->name, sizeof(slot->name));
+            pthread_mutex_unlock(&id_cache_lock);
+            return found;
+        }
+    }
+    pthread_mutex_unlock(&id_cache_lock);
+
+    struct id_name fresh = { .id = id, .used = 1, .checked = now.tv_sec };
+    fresh.found = id_resolve(is_group, id, fresh.name, sizeof(fresh.name));
+
+    /* Two threads may resolve the same id at once; the later answer wins. */
+    pthread_mutex_lock(&id_cache_lock);
+    if ((ic->count + 1) * 2 > ic->cap)
+        id_grow(ic);
+    struct id_name *slot = id_slot(ic, id);
+    if (!slot->used)
+        ic->count++;
+    *slot = fresh;
+    pthread_mutex_unlock(&id_cache_lock);
+
+    memcpy(buf, fresh.name, sizeof(fresh.name));
+    return fresh.found;
+}
+
+/* ────────────── Directory snapshot cache ────────────── */
+struct ls_dir_cache *ls_dir_cache_new(size_t max_bytes)
+{
+    struct ls_dir_cache *dc = calloc(1, sizeof(struct ls_dir_cache));
+    if (!dc) { perror("calloc"); return NULL; }
+    pthread_mutex_init(&dc->lock, NULL);
+    dc->max_bytes = max_bytes;
+    return dc;
+}
+
+static size_t snapshot_bytes(const struct dir_snapshot *sn)
+{
+    return sizeof(*sn) + sn->names_cap + sn->recs_cap * sizeof(struct dir_rec);
+}
+
+static void snapshot_free(struct dir_snapshot *sn)
+{
+    free(sn->names);
+    free(sn->recs);
+    free(sn);
+}
+
+static void snapshot_release(struct ls_dir_cache *dc, struct dir_snapshot *sn)
+{
+    pthread_mutex_lock(&dc->lock);
+    int last = --sn->refs == 0;
+    pthread_mutex_unlock(&dc->lock);
+    if (last)
+        snapshot_free(sn);
+}
+
+static size_t dir_bucket(dev_t dev, ino_t ino)
+{
+    return hash_dev_ino(dev, ino) & (DIR_CACHE_BUCKETS - 1);
+}
+
+/* Caller holds dc->lock. */
+static void dir_cache_unlink(struct ls_dir_cache *dc, struct dir_snapshot *sn)
+{
+    struct dir_snapshot **pp = &dc->buckets[dir_bucket(sn->dev, sn->ino)];
+    while (*pp != sn) pp = &(*pp)->hnext;
+    *pp = sn->hnext;
+
+    if (sn->prev) sn->prev->next = sn->next; else dc->head = sn->next;
+    if (sn->next) sn->next->prev = sn->prev; else dc->tail = sn->prev;
+    dc->bytes -= snapshot_bytes(sn);
+    if (--sn->refs == 0)
+        snapshot_free(sn);
+}
+
+static int same_time(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* Returns a referenced snapshot if one matches the directory as it is now. */
+static struct dir_snapshot *dir_cache_get(struct ls_dir_cache *dc, const struct stat *dst)
+{
+    pthread_mutex_lock(&dc->lock);
+    struct dir_snapshot *sn = dc->buckets[dir_bucket(dst->st_dev, dst->st_ino)];
+    while (sn && !(sn->dev == dst->st_dev && sn->ino == dst->st_ino))
+        sn = sn->hnext;
+
+    if (sn && !(same_time(&sn->mtime, &dst->st_mtim) && same_time(&sn->ctime, &dst->st_ctim)))
+    {
+        dir_cache_unlink(dc, sn);
+        sn = NULL;
+    }
+
+    if (sn)
+    {
+        /* Move to the front of the LRU list. */
+        if (sn != dc->head)
+        {
+            sn->prev->next = sn->next;
+            if (sn->next) sn->next->prev = sn->prev; else dc->tail = sn->prev;
+            sn->prev = NULL;
+            sn->next = dc->head;
+            dc->head->prev = sn;
+            dc->head = sn;
+        }
+        sn->refs++;
+        dc->hits++;
+    }
+    else
+        dc->misses++;
+    pthread_mutex_unlock(&dc->lock);
+    return sn;
+}
+
+/* Hands a freshly read snapshot to the cache, evicting the oldest ones past the budget. */
+static void dir_cache_put(struct ls_dir_cache *dc, struct dir_snapshot *sn)
+{
+    size_t bytes = snapshot_bytes(sn);
+    if (bytes > dc->max_bytes)
+    {
+        snapshot_free(sn);
+        return;
+    }
+
+    pthread_mutex_lock(&dc->lock);
+    struct dir_snapshot *old = dc->buckets[dir_bucket(sn->dev, sn->ino)];
+    while (old && !(old->dev == sn->dev && old->ino == sn->ino))
+        old = old->hnext;
+    if (old)
+        dir_cache_unlink(dc, old);
+
+    while (dc->tail && dc->bytes + bytes > dc->max_bytes)
+        dir_cache_unlink(dc, dc->tail);
+
+    size_t b = dir_bucket(sn->dev, sn->ino);
+    sn->hnext = dc->buckets[b];
+    dc->buckets[b] = sn;
+    sn->prev = NULL;
+    sn->next = dc->head;
+    if (dc->head) dc->head->prev = sn; else dc->tail = sn;
+    dc->head = sn;
+    sn->refs = 1;
+    dc->bytes += bytes;
+    pthread_mutex_unlock(&dc->lock);
+}
+
+void ls_dir_cache_stats(struct ls_dir_cache *dc, unsigned long *hits, unsigned long *misses)
+{
+    pthread_mutex_lock(&dc->lock);
+    *hits = dc->hits;
+    *misses = dc->misses;
+    pthread_mutex_unlock(&dc->lock);
+}
+
+void ls_dir_cache_free(struct ls_dir_cache *dc)
+{
+    if (!dc) return;
+    while (dc->tail)
+        dir_cache_unlink(dc, dc->tail);
+    pthread_mutex_destroy(&dc->lock);
+    free(dc);
+}
+
+/* Only directories that have been quiet for a second are safe to cache. */
+static struct dir_snapshot *snapshot_new(const struct stat *dst)
+{
+    time_t now = time(NULL);
+    if (dst->st_mtim.tv_sec >= now - 1 || dst->st_ctim.tv_sec >= now - 1)
+        return NULL;
+
+    struct dir_snapshot *sn = calloc(1, sizeof(struct dir_snapshot));
+    if (!sn) { perror("calloc"); exit(EXIT_FAILURE); }
+    sn->dev = dst->st_dev;
+    sn->ino = dst->st_ino;
+    sn->mtime = dst->st_mtim;
+    sn->ctime = dst->st_ctim;
+    return sn;
+}
+
+static void snapshot_add(struct dir_snapshot *sn, const char *name, size_t len, ino_t ino, unsigned char type)
+{
+    if (sn->names_len + len + 1 > sn->names_cap)
+    {
+        size_t cap = sn->names_cap == 0 ? 1024 : sn->names_cap;
+        while (sn->names_len + len + 1 > cap) cap *= 2;
+        char *tmp = realloc(sn->names, cap);
+        if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+        sn->names = tmp;
+        sn->names_cap = cap;
+    }
+    if (sn->nrecs == sn->recs_cap)
+    {
+        sn->recs_cap = sn->recs_cap == 0 ? 32 : sn->recs_cap * 2;
+        struct dir_rec *tmp = realloc(sn->recs, sn->recs_cap * sizeof(struct dir_rec));
+        if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+        sn->recs = tmp;
+    }
+    sn->recs[sn->nrecs++] = (struct dir_rec){ sn->names_len, ino, type };
+    memcpy(sn->names + sn->names_len, name, len + 1);
+    sn->names_len += len + 1;
+}
+
+/* ────────────── Visited-directory set ──────────────
+ * Open addressing with linear probing over (st_dev, st_ino) keys.
+ * The table is kept at most half full and doubles when it grows past that.
+ */
+static size_t hash_dev_ino(dev_t dev, ino_t ino)
+{
+    uint64_t h = (uint64_t)ino ^ ((uint64_t)dev * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+static void visited_grow(struct ls_session *ss)
+{
+    size_t new_cap = ss->visited_cap == 0 ? 64 : ss->visited_cap * 2;
+    struct dev_ino *new_tab = calloc(new_cap, sizeof(*new_tab));
+    if (!new_tab) { perror("calloc"); exit(EXIT_FAILURE); }
+
+    for (size_t i = 0; i < ss->visited_cap; i++)
+    {
+        if (!ss->visited[i].used) continue;
+        size_t j = hash_dev_ino(ss->visited[i].dev, ss->visited[i].ino) & (new_cap - 1);
+        while (new_tab[j].used) j = (j + 1) & (new_cap - 1);
+        new_tab[j] = ss->visited[i];
+    }
+
+    free(ss->visited);
+    ss->visited = new_tab;
+    ss->visited_cap = new_cap;
+}
+
+/* Returns 1 if (dev, ino) was newly added, 0 if it had been seen before. */
+static int visited_insert(struct ls_session *ss, dev_t dev, ino_t ino)
+{
+    if ((ss->visited_count + 1) * 2 > ss->visited_cap)
+        visited_grow(ss);
+
+    size_t mask = ss->visited_cap - 1;
+    size_t j = hash_dev_ino(dev, ino) & mask;
+    while (ss->visited[j].used)
+    {
+        if (ss->visited[j].dev == dev && ss->visited[j].ino == ino)
+            return 0;
+        j = (j + 1) & mask;
+    }
+
+    ss->visited[j].dev = dev;
+    ss->visited[j].ino = ino;
+    ss->visited[j].used = 1;
+    ss->visited_count++;
+    return 1;
+}
+
+static int visited_contains(const struct ls_session *ss, dev_t dev, ino_t ino)
+{
+    if (ss->visited_cap == 0)
+        return 0;
+    size_t mask = ss->visited_cap - 1;
+    for (size_t j = hash_dev_ino(dev, ino) & mask; ss->visited[j].used; j = (j + 1) & mask)
+        if (ss->visited[j].dev == dev && ss->visited[j].ino == ino)
+            return 1;
+    return 0;
+}
+
+/* ────────────── Names: display width and quoting ────────────── */
+/*
+ * Every listed name is classified once, before the sink sees it: one pass
+ * finds its length and whether it has bytes >= 0x80 or control bytes,
+ * 16 (SSE2) or 32 (AVX2) bytes at a time. Printable ASCII needs nothing
+ * more; anything else is quoted per o->quoting and measured with
+ * mbrtowc()/wcwidth(). The width and LS_ENTRY_NAME_PLAIN end up in the
+ * entry, so layouts never run strlen() or decode UTF-8 again.
+ */
+struct name_class
+{
+    size_t len;
+    int high;                   /* a byte >= 0x80 */
+    int ctrl;                   /* a byte < 0x20, or DEL */
+};
+
+static void name_classify_scalar(const char *s, struct name_class *nc)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    int high = 0, ctrl = 0;
+    for (; *p; p++)
+    {
+        high |= *p >= 0x80;
+        ctrl |= *p < 0x20 || *p == 0x7f;
+    }
+    nc->len = (const char *)p - s;
+    nc->high = high;
+    nc->ctrl = ctrl;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+ * Aligned loads never cross a page, so reading the whole block that holds
+ * the terminating NUL (or the start of the name) is safe; the bits of
+ * bytes outside the name are shifted or masked away. AddressSanitizer
+ * cannot know that and would stop at the redzone after a short name, so
+ * the loads are left uninstrumented.
+ */
+#if defined(__has_attribute)
+#if __has_attribute(no_sanitize)
+#define OVERREAD_OK __attribute__((no_sanitize_address, no_sanitize("hwaddress")))
+#endif
+#endif
+#ifndef OVERREAD_OK
+#define OVERREAD_OK __attribute__((no_sanitize_address))
+#endif
+
+__attribute__((target("sse2"))) OVERREAD_OK
+static void name_classify_sse2(const char *s, struct name_class *nc)
+{
+    const __m128i zero = _mm_setzero_si128(), space = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7f);
+    const char *block = (const char *)((uintptr_t)s & ~(uintptr_t)15);
+    unsigned shift = s - block;
+    unsigned high = 0, ctrl = 0;
+    size_t len = 0;
+    for (;; block += 16, shift = 0)
+    {
+        __m128i v = _mm_load_si128((const __m128i *)block);
+        unsigned z = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) >> shift;
+        unsigned h = (unsigned)_mm_movemask_epi8(v) >> shift;
+        /* Signed compare: bytes below 0x20 and bytes >= 0x80 are "less than" a space. */
+        unsigned c = ((unsigned)(_mm_movemask_epi8(_mm_cmplt_epi8(v, space)) & ~_mm_movemask_epi8(v)) |
+                      (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, del))) >> shift;
+        if (z)
+        {
+            unsigned keep = (z & -z) - 1;
+            high |= h & keep;
+            ctrl |= c & keep;
+            len += __builtin_ctz(z);
+            break;
+        }
+        high |= h;
+        ctrl |= c;
+        len += 16 - shift;
+    }
+    nc->len = len;
+    nc->high = high != 0;
+    nc->ctrl = ctrl != 0;
+}
+
+__attribute__((target("avx2"))) OVERREAD_OK
+static void name_classify_avx2(const char *s, struct name_class *nc)
+{
+    const __m256i zero = _mm256_setzero_si256(), space = _mm256_set1_epi8(0x20), del = _mm256_set1_epi8(0x7f);
+    const char *block = (const char *)((uintptr_t)s & ~(uintptr_t)31);
+    unsigned shift = s - block;
+    unsigned high = 0, ctrl = 0;
+    size_t len = 0;
+    for (;; block += 32, shift = 0)
+    {
+        __m256i v = _mm256_load_si256((const __m256i *)block);
+        unsigned sign = (unsigned)_mm256_movemask_epi8(v);
+        unsigned z = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) >> shift;
+        unsigned h = sign >> shift;
+        unsigned c = (((unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi8(space, v)) & ~sign) |
+                      (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, del))) >> shift;
+        if (z)
+        {
+            unsigned keep = (z & -z) - 1;
+            high |= h & keep;
+            ctrl |= c & keep;
+            len += __builtin_ctz(z);
+            break;
+        }
+        high |= h;
+        ctrl |= c;
+        len += 32 - shift;
+    }
+    nc->len = len;
+    nc->high = high != 0;
+    nc->ctrl = ctrl != 0;
+}
+#endif
+
+static void (*name_classify)(const char *s, struct name_class *nc) = name_classify_scalar;
+static pthread_once_t name_classify_once = PTHREAD_ONCE_INIT;
+
+static void name_classify_pick(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        name_classify = name_classify_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        name_classify = name_classify_sse2;
+#endif
+}
+
+/* Characters that make a name need quotes for the shell; '#' and '~' only at the start. */
+static int shell_special(const char *s, size_t len)
+{
+    if (s[0] == '#' || s[0] == '~')
+        return 1;
+    return strcspn(s, " !\"$&'()*;<=>?[\\]^`{|}") < len;
+}
+
+/* Worst case is a run of $'\ooo' escapes between quotes. */
+static size_t name_quote_bound(size_t len)
+{
+    return 10 * len + 8;
+}
+
+static char *put_c_escape(char *o, unsigned char b)
+{
+    static const char letters[] = "\a\b\t\n\v\f\r";
+    static const char names[] = "abtnvfr";
+    const char *l = b ? strchr(letters, b) : NULL;
+    *o++ = '\\';
+    if (l)
+        *o++ = names[l - letters];
+    else
+    {
+        *o++ = '0' + (b >> 6);
+        *o++ = '0' + ((b >> 3) & 7);
+        *o++ = '0' + (b & 7);
+    }
+    return o;
+}
+
+/*
+ * Writes name as the text sink shows it into out (name_quote_bound()
+ * bytes, NUL-terminated) and returns its display width.
+ *   literal   as is
+ *   question  every unprintable character (or invalid byte) becomes '?'
+ *   escape    C escapes (\n, \ooo), and backslash and space escaped
+ *   shell     in '...' when needed, unprintable runs as $'...'
+ */
+static int name_quote(const char *name, size_t len, enum ls_quoting q, char *out)
+{
+    char *o = out;
+    int width = 0, in_dollar = 0;
+    mbstate_t mb;
+    memset(&mb, 0, sizeof(mb));
+
+    if (q == LS_QUOTE_SHELL)
+    {
+        *o++ = '\'';
+        width++;
+    }
+    for (size_t i = 0; i < len; )
+    {
+        wchar_t wc;
+        size_t n = mbrtowc(&wc, name + i, len - i, &mb);
+        int w;
+        if (n == (size_t)-1 || n == (size_t)-2)
+        {
+            memset(&mb, 0, sizeof(mb));
+            n = 1;
+            w = -1;
+        }
+        else
+            w = wcwidth(wc);
+
+        if (w >= 0 && !(n == 1 && (unsigned char)name[i] < 0x20))
+        {
+            if (in_dollar)
+            {
+                *o++ = '\'';
+                *o++ = '\'';
+                width += 2;
+                in_dollar = 0;
+            }
+            char ch = name[i];
+            if (q == LS_QUOTE_SHELL && ch == '\'')
+            {
+                memcpy(o, "'\\''", 4);
+                o += 4;
+                width += 4;
+            }
+            else if (q == LS_QUOTE_ESCAPE && (ch == '\\' || ch == ' '))
+            {
+                *o++ = '\\';
+                *o++ = ch;
+                width += 2;
+            }
+            else
+            {
+                memcpy(o, name + i, n);
+                o += n;
+                width += w;
+            }
+        }
+        else if (q == LS_QUOTE_LITERAL)
+        {
+            memcpy(o, name + i, n);
+            o += n;
+            width += w > 0 ? w : n == 1 && (unsigned char)name[i] >= 0x80;
+        }
+        else if (q == LS_QUOTE_QUESTION)
+        {
+            *o++ = '?';
+            width++;
+        }
+        else
+        {
+            if (q == LS_QUOTE_SHELL && !in_dollar)
+            {
+                memcpy(o, "'$'", 3);
+                o += 3;
+                width += 3;
+                in_dollar = 1;
+            }
+            for (size_t k = 0; k < n; k++)
+            {
+                char *start = o;
+                o = put_c_escape(o, (unsigned char)name[i + k]);
+                width += o - start;
+            }
+        }
+        i += n;
+    }
+    if (q == LS_QUOTE_SHELL)
+    {
+        *o++ = '\'';
+        width++;
+    }
+    *o = '\0';
+    return width;
+}
+
+/* name_quote(), except that shell quotes only go on names that need them. */
+static int name_render(const char *name, size_t len, enum ls_quoting q, char *out)
+{
+    int width = name_quote(name, len, q, out);
+    if (q == LS_QUOTE_SHELL && !shell_special(name, len) &&
+        strncmp(out + 1, name, len) == 0 && out[len + 1] == '\'' && out[len + 2] == '\0')
+    {
+        memmove(out, out + 1, len);
+        out[len] = '\0';
+        width -= 2;
+    }
+    return width;
+}
+
+/* Classifies and measures the names of entries about to go to the sink. */
+static void names_prepare(const struct ls_options *o, struct ls_entry *ents, int count)
+{
+    pthread_once(&name_classify_once, name_classify_pick);
+    char stackbuf[1024];
+
+    for (int i = 0; i < count; i++)
+    {
+        struct ls_entry *e = &ents[i];
+        struct name_class nc;
+        name_classify(e->name, &nc);
+
+        if (!nc.high && !nc.ctrl && (o->quoting != LS_QUOTE_SHELL || !shell_special(e->name, nc.len)) &&
+            (o->quoting != LS_QUOTE_ESCAPE || strcspn(e->name, "\\ ") == nc.len))
+        {
+            e->width = nc.len;
+            e->flags |= LS_ENTRY_NAME_PLAIN;
+            continue;
+        }
+
+        size_t bound = name_quote_bound(nc.len);
+        char *buf = bound <= sizeof(stackbuf) ? stackbuf : malloc(bound);
+        if (!buf) { perror("malloc"); exit(EXIT_FAILURE); }
+        e->width = name_render(e->name, nc.len, o->quoting, buf);
+        if (strcmp(buf, e->name) == 0)
+            e->flags |= LS_ENTRY_NAME_PLAIN;
+        else
+            e->flags &= ~LS_ENTRY_NAME_PLAIN;
+        if (buf != stackbuf)
+            free(buf);
+    }
+}
+
+/* Writes a name the way names_prepare() measured it. */
+static void name_print(FILE *fp, const char *name, unsigned int flags, enum ls_quoting q)
+{
+    if (flags & LS_ENTRY_NAME_PLAIN)
+    {
+        fputs(name, fp);
+        return;
+    }
+    size_t len = strlen(name);
+    char stackbuf[1024];
+    size_t bound = name_quote_bound(len);
+    char *buf = bound <= sizeof(stackbuf) ? stackbuf : malloc(bound);
+    if (!buf) { perror("malloc"); exit(EXIT_FAILURE); }
+    name_render(name, len, q, buf);
+    fputs(buf, fp);
+    if (buf != stackbuf)
+        free(buf);
+}
+
+/* ────────────── Filesystem profiles: one statfs() per mount ────────────── */
+/*
+ * How a directory's entries are stat'ed, chosen per filesystem type:
+ *   sync      one at a time in readdir order (in-memory filesystems, where
+ *             the order costs nothing and sorting would)
+ *   batched   one at a time, sorted into inode order first (block devices:
+ *             the reads sweep the inode table)
+ *   threaded  several threads at once (network and FUSE filesystems, where
+ *             each stat is a round trip and the latency is what to hide)
+ * With skip_pseudo, pseudo filesystems (procfs, sysfs, ...) are not entered
+ * by -R from another filesystem. d_type is not trusted from FUSE daemons, nor from filesystems
+ * that are not in the table.
+ */
+enum stat_engine { STAT_SYNC, STAT_BATCHED, STAT_THREADED };
+
+static const char *const stat_engine_names[] = { "sync", "batched", "threaded" };
+
+struct fs_type
+{
+    unsigned long magic;        /* statfs f_type */
+    const char *name;
+    int trust_dtype;
+    enum stat_engine engine;
+    int parallelism;
+    int pseudo;
+};
+
+static const struct fs_type fs_types[] = {
+    { 0xEF53,     "ext2/3/4",   1, STAT_BATCHED,  1, 0 },
+    { 0x58465342, "xfs",        1, STAT_BATCHED,  1, 0 },
+    { 0x9123683E, "btrfs",      1, STAT_BATCHED,  1, 0 },
+    { 0xF2F52010, "f2fs",       1, STAT_BATCHED,  1, 0 },
+    { 0x2FC12FC1, "zfs",        1, STAT_BATCHED,  1, 0 },
+    { 0x73717368, "squashfs",   1, STAT_BATCHED,  1, 0 },
+    { 0x4D44,     "vfat",       1, STAT_BATCHED,  1, 0 },
+    { 0x794C7630, "overlay",    1, STAT_BATCHED,  1, 0 },
+    { 0x01021994, "tmpfs",      1, STAT_SYNC,     1, 0 },
+    { 0x858458F6, "ramfs",      1, STAT_SYNC,     1, 0 },
+    { 0x6969,     "nfs",        1, STAT_THREADED, 8, 0 },
+    { 0xFF534D42, "cifs",       1, STAT_THREADED, 8, 0 },
+    { 0xFE534D42, "smb2",       1, STAT_THREADED, 8, 0 },
+    { 0x01021997, "9p",         1, STAT_THREADED, 8, 0 },
+    { 0x00C36400, "ceph",       1, STAT_THREADED, 8, 0 },
+    { 0x65735546, "fuse",       0, STAT_THREADED, 4, 0 },
+    { 0x9FA0,     "proc",       1, STAT_SYNC,     1, 1 },
+    { 0x62656572, "sysfs",      1, STAT_SYNC,     1, 1 },
+    { 0x27E0EB,   "cgroup",     1, STAT_SYNC,     1, 1 },
+    { 0x63677270, "cgroup2",    1, STAT_SYNC,     1, 1 },
+    { 0x1CD1,     "devpts",     1, STAT_SYNC,     1, 1 },
+    { 0x64626720, "debugfs",    1, STAT_SYNC,     1, 1 },
+    { 0x74726163, "tracefs",    1, STAT_SYNC,     1, 1 },
+    { 0x73636673, "securityfs", 1, STAT_SYNC,     1, 1 },
+    { 0xCAFE4A11, "bpf",        1, STAT_SYNC,     1, 1 },
+    { 0x6165676C, "pstore",     1, STAT_SYNC,     1, 1 },
+    { 0x62656570, "configfs",   1, STAT_SYNC,     1, 1 },
+    { 0x19800202, "mqueue",     1, STAT_SYNC,     1, 1 },
+    { 0xDE5E81E4, "efivarfs",   1, STAT_SYNC,     1, 1 },
+    { 0x42494E4D, "binfmt_misc", 1, STAT_SYNC,    1, 1 },
+    { 0x65735543, "fusectl",    1, STAT_SYNC,     1, 1 },
+};
+
+static const struct fs_type fs_type_default = { 0, "unknown", 0, STAT_BATCHED, 1, 0 };
+
+struct fs_profile
+{
+    dev_t dev;
+    unsigned long magic;
+    const struct fs_type *type;
+};
+
+/* Threaded stats only pay for the thread start-up above this many entries. */
+#define STAT_THREADED_MIN 32
+
+/* The profile of dev if a directory on it has been opened before, else NULL. */
+static const struct fs_type *fs_profile_find(struct ls_session *ss, dev_t dev)
+{
+    const struct fs_type *t = NULL;
+    pthread_mutex_lock(&ss->fs_lock);
+    for (int i = 0; i < ss->nprofiles && !t; i++)
+        if (ss->profiles[i].dev == dev)
+            t = ss->profiles[i].type;
+    pthread_mutex_unlock(&ss->fs_lock);
+    return t;
+}
+
+/*
+ * The profile of the filesystem fd lives on (dev is fd's st_dev). The
+ * first directory of every mount costs one fstatfs(); --count workers
+ * look profiles up concurrently, hence the lock.
+ */
+static const struct fs_type *fs_profile_get(struct ls_session *ss, int fd, dev_t dev)
+{
+    pthread_mutex_lock(&ss->fs_lock);
+    for (int i = 0; i < ss->nprofiles; i++)
+        if (ss->profiles[i].dev == dev)
+        {
+            const struct fs_type *t = ss->profiles[i].type;
+            pthread_mutex_unlock(&ss->fs_lock);
+            return t;
+        }
+
+    struct statfs sfs;
+    unsigned long magic = fstatfs(fd, &sfs) == 0 ? (unsigned long)sfs.f_type : 0;
+    const struct fs_type *t = &fs_type_default;
+    for (size_t i = 0; i < sizeof(fs_types) / sizeof(fs_types[0]); i++)
+        if (fs_types[i].magic == magic)
+            t = &fs_types[i];
+
+    if (ss->nprofiles == ss->profiles_capacity)
+    {
+        ss->profiles_capacity = ss->profiles_capacity == 0 ? 8 : ss->profiles_capacity * 2;
+        struct fs_profile *tmp = realloc(ss->profiles, ss->profiles_capacity * sizeof(struct fs_profile));
+        if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+        ss->profiles = tmp;
+    }
+    ss->profiles[ss->nprofiles++] = (struct fs_profile){ dev, magic, t };
+
+    if (ss->o->debug_fs)
+        fprintf(err_out(ss->o), "fs-profile: dev %u:%u type %s (0x%lx): d_type %s, stat %s, parallelism %d%s\n",
+                major(dev), minor(dev), t->name, magic, t->trust_dtype ? "trusted" : "ignored",
+                stat_engine_names[t->engine], t->parallelism,
+                t->pseudo ? ", pseudo" : "");
+    pthread_mutex_unlock(&ss->fs_lock);
+    return t;
+}
+
+/* ────────────── Scan phase: names first, stats in inode order ────────────── */
+struct pending
+{
+    size_t name_off;            /* offset of the name in the directory's arena */
+    ino_t ino;                  /* d_ino, used only to order the stats */
+    int walk_only;              /* rejected by --include; kept for -R if it is a directory */
+};
+
+struct name_arena
+{
+    char *buf;
+    size_t len, cap;
+};
+
+static size_t arena_add(struct name_arena *a, const char *name, size_t len)
+{
+    if (a->len + len + 1 > a->cap)
+    {
+        size_t new_cap = a->cap == 0 ? 4096 : a->cap;
+        while (a->len + len + 1 > new_cap) new_cap *= 2;
+        char *tmp = realloc(a->buf, new_cap);
+        if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+        a->buf = tmp;
+        a->cap = new_cap;
+    }
+    size_t off = a->len;
+    memcpy(a->buf + off, name, len + 1);
+    a->len += len + 1;
+    return off;
+}
+
+struct stat_order
+{
+    ino_t ino;
+    int idx;
+};
+
+static int cmp_stat_order(const void *a, const void *b)
+{
+    ino_t ia = ((const struct stat_order *)a)->ino;
+    ino_t ib = ((const struct stat_order *)b)->ino;
+    return ia < ib ? -1 : ia > ib;
+}
+
+static struct stat_order *stat_order_new(const struct ls_session *ss, const struct pending *pend, int n)
+{
+    int inode_order = ss->o->stat_inode_order && (!ss->fs || ss->fs->engine != STAT_SYNC);
+    struct stat_order *order = malloc((n > 0 ? n : 1) * sizeof(struct stat_order));
+    if (!order) { perror("malloc"); exit(EXIT_FAILURE); }
+    for (int i = 0; i < n; i++)
+    {
+        order[i].ino = pend[i].ino;
+        order[i].idx = i;
+    }
+
+    if (inode_order && n > 1)
+        qsort(order, n, sizeof(struct stat_order), cmp_stat_order);
+    return order;
+}
+
+/*
+ * Stat every pending entry. The results land in sts[] at the entry's own
+ * index, so the caller sees readdir order whatever order was used here.
+ */
+static void stat_pending(const struct ls_session *ss, int dfd, const char *dir,
+                         const struct pending *pend, int n, const char *names, struct stat *sts)
+{
+    struct stat_order *order = stat_order_new(ss, pend, n);
+    for (int k = 0; k < n; k++)
+    {
+        int i = order[k].idx;
+        const char *name = names + pend[i].name_off;
+        if (stat_entry(ss, dfd, name, &sts[i]) == -1)
+        {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", dir, name);
+            report_errno(ss->o, path);
+            memset(&sts[i], 0, sizeof(struct stat));
+        }
+    }
+    free(order);
+}
+
+struct stat_pool
+{
+    const struct ls_session *ss;
+    int dfd;
+    const char *dir;
+    const struct pending *pend;
+    const struct stat_order *order;
+    const char *names;
+    struct stat *sts;
+    int n;
+    int next;                   /* next index into order[], taken atomically */
+};
+
+static void *stat_pool_worker(void *arg)
+{
+    struct stat_pool *p = arg;
+    int k;
+    while ((k = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->n)
+    {
+        int i = p->order[k].idx;
+        const char *name = p->names + p->pend[i].name_off;
+        if (stat_entry(p->ss, p->dfd, name, &p->sts[i]) == -1)
+        {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", p->dir, name);
+            report_errno(p->ss->o, path);
+            memset(&p->sts[i], 0, sizeof(struct stat));
+        }
+    }
+    return NULL;
+}
+
+/* stat_pending() with the stats spread over nthreads threads (the caller is one). */
+static void stat_pending_threaded(const struct ls_session *ss, int dfd, const char *dir,
+                                  const struct pending *pend, int n, const char *names,
+                                  struct stat *sts, int nthreads)
+{
+    struct stat_order *order = stat_order_new(ss, pend, n);
+    struct stat_pool pool = { ss, dfd, dir, pend, order, names, sts, n, 0 };
+
+    pthread_t tids[nthreads];
+    int started = 0;
+    for (int t = 1; t < nthreads; t++)
+        if (pthread_create(&tids[started], NULL, stat_pool_worker, &pool) == 0)
+            started++;
+    stat_pool_worker(&pool);
+    for (int t = 0; t < started; t++)
+        pthread_join(tids[t], NULL);
+    free(order);
+}
+
+/* ────────────── Deadlines: directory reads and stats on helper threads ────────────── */
+/*
+ * Nothing interrupts a call stuck on a dead mount, so under --timeout-dir or
+ * --timeout-stat the calls that may block run on a helper thread while the
+ * walker waits on a condition variable with a deadline. A helper the walker
+ * gives up on is left behind holding its own reference to the job and frees
+ * it if the call ever returns. Abandoned helpers are counted process-wide;
+ * past DEADLINE_MAX_STUCK of them no new ones are started and whatever they
+ * would have done is reported as timed out at once.
+ */
+#define DEADLINE_MAX_STUCK 64
+
+static pthread_mutex_t stuck_lock = PTHREAD_MUTEX_INITIALIZER;
+static int stuck_helpers;
+
+static void stuck_add(int delta)
+{
+    pthread_mutex_lock(&stuck_lock);
+    stuck_helpers += delta;
+    pthread_mutex_unlock(&stuck_lock);
+}
+
+static int stuck_full(void)
+{
+    pthread_mutex_lock(&stuck_lock);
+    int full = stuck_helpers >= DEADLINE_MAX_STUCK;
+    pthread_mutex_unlock(&stuck_lock);
+    return full;
+}
+
+/* CLOCK_MONOTONIC time ms from now; ms <= 0 is a deadline that never comes. */
+static struct timespec deadline_after(double ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (ms <= 0)
+    {
+        ts.tv_sec = INT_MAX;
+        return ts;
+    }
+    long long ns = ts.tv_nsec + (long long)(ms * 1e6);
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    return ts;
+}
+
+static int deadline_passed(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ts_diff(&now, deadline) >= 0;
+}
+
+static void job_sync_init(pthread_mutex_t *lock, pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(lock, NULL);
+}
+
+static int spawn_detached(void *(*fn)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&tid, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    if (rc != 0)
+    {
+        errno = rc;
+        perror("pthread_create");
+        return -1;
+    }
+    return 0;
+}
+
+/* Open and readdir() of one directory. */
+struct read_job
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs;                   /* the walker's and the helper's */
+    int done, abandoned;
+    int base_fd;
+    char *path;
+    int fd, err;
+    struct dir_snapshot *names;
+};
+
+static void read_job_put(struct read_job *j)
+{
+    pthread_mutex_lock(&j->lock);
+    int last = --j->refs == 0;
+    pthread_mutex_unlock(&j->lock);
+    if (!last) return;
+    if (j->fd != -1) close(j->fd);
+    if (j->names) snapshot_free(j->names);
+    pthread_cond_destroy(&j->cond);
+    pthread_mutex_destroy(&j->lock);
+    free(j->path);
+    free(j);
+}
+
+/*
+ * Opens path and reads its names (dot files left out, as list_dir()
+ * does). Returns them with the directory still open in *fd, or NULL with
+ * errno set. Used by the deadline helpers and the -R pipeline's reader.
+ */
+static struct dir_snapshot *read_names(int base_fd, const char *path, int *fd)
+{
+    *fd = openat(base_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (*fd == -1)
+        return NULL;
+
+    /* readdir() gets its own descriptor; fd stays open for the stats. */
+    int rfd = fcntl(*fd, F_DUPFD_CLOEXEC, 0);
+    DIR *dp = rfd == -1 ? NULL : fdopendir(rfd);
+    if (!dp)
+    {
+        int err = errno;
+        if (rfd != -1) close(rfd);
+        close(*fd);
+        *fd = -1;
+        errno = err;
+        return NULL;
+    }
+
+    struct dir_snapshot *names = calloc(1, sizeof(struct dir_snapshot));
+    if (!names) { perror("calloc"); exit(EXIT_FAILURE); }
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL)
+        if (entry->d_name[0] != '.')
+            snapshot_add(names, entry->d_name, strlen(entry->d_name), entry->d_ino, entry->d_type);
+    closedir(dp);
+    return names;
+}
+
+static void *read_job_run(void *arg)
+{
+    struct read_job *j = arg;
+    int fd;
+    struct dir_snapshot *names = read_names(j->base_fd, j->path, &fd);
+    int err = names ? 0 : errno;
+
+    pthread_mutex_lock(&j->lock);
+    j->fd = fd;
+    j->err = err;
+    j->names = names;
+    j->done = 1;
+    if (j->abandoned)
+        stuck_add(-1);
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+    read_job_put(j);
+    return NULL;
+}
+
+/*
+ * Opens dir and reads its names on a helper thread. Returns the open
+ * directory with its names in *names, or -1 with errno set (ETIMEDOUT if
+ * the deadline passed first).
+ */
+static int read_dir_timed(const struct ls_session *ss, const char *dir, const struct timespec *deadline,
+                          struct dir_snapshot **names)
+{
+    if (stuck_full())
+    {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (ss->throttle)
+        throttle_take(ss->throttle);
+
+    struct read_job *j = calloc(1, sizeof(struct read_job));
+    if (!j || !(j->path = strdup(dir))) { perror("calloc"); exit(EXIT_FAILURE); }
+    job_sync_init(&j->lock, &j->cond);
+    j->refs = 2;
+    j->fd = -1;
+    j->base_fd = ss->base_fd;
+    if (spawn_detached(read_job_run, j) == -1)
+    {
+        j->refs = 1;
+        read_job_put(j);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    pthread_mutex_lock(&j->lock);
+    while (!j->done && pthread_cond_timedwait(&j->cond, &j->lock, deadline) != ETIMEDOUT)
+        ;
+    int fd = -1, err = ETIMEDOUT;
+    if (j->done)
+    {
+        fd = j->fd;
+        err = j->err;
+        *names = j->names;
+        j->fd = -1;
+        j->names = NULL;
+    }
+    else
+    {
+        j->abandoned = 1;
+        stuck_add(1);
+    }
+    pthread_mutex_unlock(&j->lock);
+    read_job_put(j);
+    errno = err;
+    return fd;
+}
+
+/*
+ * The stats of one directory. One helper at a time works through the
+ * names in stat order and publishes each answer; the walker bumps gen
+ * when it gives up on a helper, which tells that helper (should it ever
+ * come back) that its results are no longer wanted.
+ */
+struct stat_job
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs;
+    int dfd;                    /* a dup, so the walker may close its own */
+    int follow;
+    unsigned int mask;
+    char *names;                /* copy of the directory's arena */
+    size_t *name_off;           /* in stat order, as are sts and err */
+    struct stat *sts;
+    int *err;                   /* 0, or the errno of the stat */
+    int n;
+    int next;                   /* first entry without an answer */
+    int gen;
+};
+
+struct stat_helper
+{
+    struct stat_job *job;
+    int gen, start;
+};
+
+static void stat_job_put(struct stat_job *j)
+{
+    pthread_mutex_lock(&j->lock);
+    int last = --j->refs == 0;
+    pthread_mutex_unlock(&j->lock);
+    if (!last) return;
+    close(j->dfd);
+    pthread_cond_destroy(&j->cond);
+    pthread_mutex_destroy(&j->lock);
+    free(j->names);
+    free(j->name_off);
+    free(j->sts);
+    free(j->err);
+    free(j);
+}
+
+static void *stat_job_run(void *arg)
+{
+    struct stat_helper h = *(struct stat_helper *)arg;
+    struct stat_job *j = h.job;
+    free(arg);
+
+    for (int k = h.start; k < j->n; k++)
+    {
+        struct stat st;
+        int err = stat_at(j->dfd, j->names + j->name_off[k], j->follow, j->mask, &st) == 0 ? 0 : errno;
+
+        pthread_mutex_lock(&j->lock);
+        int wanted = j->gen == h.gen;
+        if (wanted)
+        {
+            j->sts[k] = st;
+            j->err[k] = err;
+            j->next = k + 1;
+            pthread_cond_signal(&j->cond);
+        }
+        else
+            stuck_add(-1);
+        pthread_mutex_unlock(&j->lock);
+        if (!wanted)
+            break;
+    }
+    stat_job_put(j);
+    return NULL;
+}
+
+/* Caller holds j->lock. */
+static int stat_job_spawn(struct stat_job *j)
+{
+    if (stuck_full())
+        return -1;
+    struct stat_helper *h = malloc(sizeof(struct stat_helper));
+    if (!h) { perror("malloc"); exit(EXIT_FAILURE); }
+    *h = (struct stat_helper){ j, j->gen, j->next };
+    j->refs++;
+    if (spawn_detached(stat_job_run, h) == -1)
+    {
+        j->refs--;
+        free(h);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * stat_pending() under deadlines. An entry whose stat takes longer than
+ * --timeout-stat is given up on and a fresh helper carries on with the
+ * next one; whatever is left when the directory's deadline passes is
+ * given up on as a whole. Those entries get LS_ENTRY_TIMEOUT in flags[]
+ * and a zeroed stat. Returns how many there were.
+ */
+static int stat_pending_timed(const struct ls_session *ss, int dfd, const char *dir,
+                              const struct pending *pend, int n, const struct name_arena *arena,
+                              struct stat *sts, unsigned int *flags, const struct timespec *dir_deadline)
+{
+    if (n == 0)
+        return 0;
+
+    struct stat_order *order = stat_order_new(ss, pend, n);
+    struct stat_job *j = calloc(1, sizeof(struct stat_job));
+    if (!j) { perror("calloc"); exit(EXIT_FAILURE); }
+    job_sync_init(&j->lock, &j->cond);
+    j->refs = 1;
+    j->dfd = fcntl(dfd, F_DUPFD_CLOEXEC, 0);
+    j->follow = ss->o->follow_links;
+    j->mask = ss->c->stat_mask;
+    j->n = n;
+    j->names = malloc(arena->len);
+    j->name_off = malloc(n * sizeof(size_t));
+    j->sts = malloc(n * sizeof(struct stat));
+    j->err = malloc(n * sizeof(int));
+    if (j->dfd == -1 || !j->names || !j->name_off || !j->sts || !j->err) { perror("malloc"); exit(EXIT_FAILURE); }
+    memcpy(j->names, arena->buf, arena->len);
+    for (int k = 0; k < n; k++)
+        j->name_off[k] = pend[order[k].idx].name_off;
+
+    pthread_mutex_lock(&j->lock);
+    int live = 0, seen = -1;
+    struct timespec op_deadline;
+    while (j->next < n)
+    {
+        if (!live)
+        {
+            if (stat_job_spawn(j) == -1)
+                break;
+            live = 1;
+        }
+        if (j->next != seen)
+        {
+            /* The helper moved on to entry j->next: its own clock starts now. */
+            seen = j->next;
+            op_deadline = deadline_after(ss->o->timeout_stat_ms);
+            if (ts_diff(&op_deadline, dir_deadline) > 0)
+                op_deadline = *dir_deadline;
+        }
+        if (pthread_cond_timedwait(&j->cond, &j->lock, &op_deadline) != ETIMEDOUT || j->next != seen)
+            continue;
+
+        j->gen++;
+        stuck_add(1);
+        live = 0;
+        if (deadline_passed(dir_deadline))
+            break;
+        j->err[j->next++] = ETIMEDOUT;
+    }
+    for (int k = j->next; k < n; k++)
+        j->err[k] = ETIMEDOUT;
+
+    int timeouts = 0;
+    for (int k = 0; k < n; k++)
+    {
+        int i = order[k].idx;
+        flags[i] = 0;
+        if (j->err[k] == 0)
+        {
+            sts[i] = j->sts[k];
+            continue;
+        }
+        memset(&sts[i], 0, sizeof(struct stat));
+        if (j->err[k] == ETIMEDOUT)
+        {
+            flags[i] = LS_ENTRY_TIMEOUT;
+            timeouts++;
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, arena->buf + pend[i].name_off);
+        errno = j->err[k];
+        report_errno(ss->o, path);
+    }
+    pthread_mutex_unlock(&j->lock);
+    stat_job_put(j);
+    free(order);
+    return timeouts;
+}
+
+struct scan
+{
+    struct pending *pend;
+    int npend, capacity;
+    struct name_arena arena;
+};
+
+/* Filters look at the name in place; rejected names cost no allocation or stat. */
+static void scan_name(const struct ls_session *ss, struct scan *sc, const char *name, size_t name_len,
+                      ino_t ino, unsigned char type)
+{
+    const struct ls_options *o = ss->o;
+    int walk_only = 0;
+    int verdict = name_excluded(ss->c, name, name_len);
+    if (ss->fs && !ss->fs->trust_dtype)
+        type = DT_UNKNOWN;
+    if (verdict > 0)
+        return;
+    if (verdict < 0)
+    {
+        /* Only --include rejected it; a directory is still walked under -R. */
+        if (!o->recursive)
+            return;
+        if (type != DT_DIR && type != DT_UNKNOWN && !(type == DT_LNK && o->follow_links))
+            return;
+        walk_only = 1;
+    }
+
+    if (sc->npend == sc->capacity)
+    {
+        sc->capacity = sc->capacity == 0 ? 32 : sc->capacity * 2;
+        struct pending *tmp = realloc(sc->pend, sc->capacity * sizeof(struct pending));
+        if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+        sc->pend = tmp;
+    }
+    sc->pend[sc->npend].name_off = arena_add(&sc->arena, name, name_len);
+    sc->pend[sc->npend].ino = ino;
+    sc->pend[sc->npend].walk_only = walk_only;
+    sc->npend++;
+}
+
+/* Adds an entry whose name lives in the directory's arena; the arena owns the string. */
+static void append_entry(struct ls_entry **arr, int *count, int *capacity, const char *name, const struct stat *st,
+                         unsigned int flags)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity == 0 ? 32 : *capacity * 2;
+        struct ls_entry *tmp = realloc(*arr, *capacity * sizeof(struct ls_entry));
+        if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+        *arr = tmp;
+    }
+
+    (*arr)[*count].name = name;
+    (*arr)[*count].st = *st;
+    (*arr)[*count].flags = flags;
+    (*arr)[*count].context = NULL;
+    (*count)++;
+}
+
+/* ────────────── Extended metadata: ACL marker and security context ────────────── */
+#define CONTEXT_MAX 255
+
+static int xattr_off(struct ls_session *ss, dev_t dev)
+{
+    pthread_mutex_lock(&ss->fs_lock);
+    int off = 0;
+    for (int i = 0; i < ss->nno_xattr && !off; i++)
+        off = ss->no_xattr[i] == dev;
+    pthread_mutex_unlock(&ss->fs_lock);
+    return off;
+}
+
+static void xattr_mark_off(struct ls_session *ss, dev_t dev)
+{
+    pthread_mutex_lock(&ss->fs_lock);
+    int known = 0;
+    for (int i = 0; i < ss->nno_xattr && !known; i++)
+        known = ss->no_xattr[i] == dev;
+    if (!known)
+    {
+        if (ss->nno_xattr == ss->no_xattr_capacity)
+        {
+            ss->no_xattr_capacity = ss->no_xattr_capacity == 0 ? 4 : ss->no_xattr_capacity * 2;
+            dev_t *tmp = realloc(ss->no_xattr, ss->no_xattr_capacity * sizeof(dev_t));
+            if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+            ss->no_xattr = tmp;
+        }
+        ss->no_xattr[ss->nno_xattr++] = dev;
+    }
+    pthread_mutex_unlock(&ss->fs_lock);
+}
+
+struct meta_job
+{
+    struct ls_session *ss;
+    int dfd;                    /* names are relative to it */
+    struct ls_entry *ents;
+    int count;
+    size_t *ctx_off;            /* per entry: offset in ctx, or SIZE_MAX */
+    struct name_arena *ctx;
+    pthread_mutex_t ctx_lock;
+    int next;                   /* next entry, taken atomically */
+};
+
+/* lgetxattr() of one attribute, timed into column col when debug_columns is on. */
+static ssize_t meta_get(struct ls_session *ss, int col, const char *path, const char *attr, char *buf, size_t size)
+{
+    struct timespec t0, t1;
+    int timed = ss->o->debug_columns;
+    if (timed) clock_gettime(CLOCK_MONOTONIC, &t0);
+    ssize_t n = lgetxattr(path, attr, buf, size);
+    int saved = errno;
+    if (timed)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        __atomic_add_fetch(&ss->meta_calls[col], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ss->meta_ns[col], (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec),
+                           __ATOMIC_RELAXED);
+    }
+    errno = saved;
+    return n;
+}
+
+static void *meta_worker(void *arg)
+{
+    struct meta_job *j = arg;
+    struct ls_session *ss = j->ss;
+    const struct ls_options *o = ss->o;
+    dev_t last_dev = 0;
+    int have_dev = 0, dev_off = 0;
+    int i;
+
+    while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->count)
+    {
+        struct ls_entry *e = &j->ents[i];
+        if (e->flags & LS_ENTRY_TIMEOUT)
+            continue;
+        if (!have_dev || e->st.st_dev != last_dev)
+        {
+            last_dev = e->st.st_dev;
+            have_dev = 1;
+            dev_off = xattr_off(ss, last_dev);
+        }
+        if (dev_off)
+        {
+            __atomic_add_fetch(&ss->meta_skipped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        __atomic_add_fetch(&ss->meta_entries, 1, __ATOMIC_RELAXED);
+
+        /* No getxattrat(): reach the entry through its directory's descriptor. */
+        char path[PATH_MAX];
+        if (j->dfd == AT_FDCWD || e->name[0] == '/')
+            snprintf(path, sizeof(path), "%s", e->name);
+        else
+            snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", j->dfd, e->name);
+
+        ssize_t n = 0;
+        if (o->show_acl)
+        {
+            n = meta_get(ss, 0, path, "system.posix_acl_access", NULL, 0);
+            if (n <= 0 && errno != ENOTSUP && S_ISDIR(e->st.st_mode))
+                n = meta_get(ss, 0, path, "system.posix_acl_default", NULL, 0);
+            if (n > 0)
+                e->flags |= LS_ENTRY_ACL;
+        }
+        if (o->show_context && !(n == -1 && errno == ENOTSUP && !S_ISLNK(e->st.st_mode)))
+        {
+            char buf[CONTEXT_MAX + 1];
+            n = meta_get(ss, 1, path, "security.selinux", buf, CONTEXT_MAX);
+            if (n > 0)
+            {
+                buf[n] = '\0';
+                pthread_mutex_lock(&j->ctx_lock);
+                j->ctx_off[i] = arena_add(j->ctx, buf, strlen(buf));
+                pthread_mutex_unlock(&j->ctx_lock);
+            }
+        }
+        /* Symbolic links answer ENOTSUP for ACLs on filesystems that have them. */
+        if (n == -1 && errno == ENOTSUP && !S_ISLNK(e->st.st_mode))
+        {
+            xattr_mark_off(ss, last_dev);
+            dev_off = 1;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The ACL marker and context of ents (names relative to dfd), as the
+ * options ask; contexts are copied into *ctx, which must outlive ents.
+ * On a filesystem whose profile stats with threads, so does this.
+ */
+static void meta_fetch(struct ls_session *ss, int dfd, struct ls_entry *ents, int count, struct name_arena *ctx)
+{
+    const struct ls_options *o = ss->o;
+    if ((!o->show_acl && !o->show_context) || count == 0)
+        return;
+
+    struct meta_job j = { ss, dfd, ents, count, malloc(count * sizeof(size_t)), ctx,
+                          PTHREAD_MUTEX_INITIALIZER, 0 };
+    if (!j.ctx_off) { perror("malloc"); exit(EXIT_FAILURE); }
+    for (int i = 0; i < count; i++)
+        j.ctx_off[i] = SIZE_MAX;
+
+    int nthreads = ss->fs && ss->fs->engine == STAT_THREADED && count >= STAT_THREADED_MIN ? ss->fs->parallelism : 1;
+    pthread_t tids[nthreads];
+    int started = 0;
+    for (int t = 1; t < nthreads; t++)
+        if (pthread_create(&tids[started], NULL, meta_worker, &j) == 0)
+            started++;
+    meta_worker(&j);
+    for (int t = 0; t < started; t++)
+        pthread_join(tids[t], NULL);
+
+    for (int i = 0; i < count; i++)
+        if (j.ctx_off[i] != SIZE_MAX)
+            ents[i].context = ctx->buf + j.ctx_off[i];
+    free(j.ctx_off);
+    pthread_mutex_destroy(&j.ctx_lock);
+}
+
+/* Stats a batch with the engine of the current filesystem's profile. */
+static void stat_batch(const struct ls_session *ss, int dfd, const char *dir,
+                       const struct pending *pend, int npend, const char *names, struct stat *sts)
+{
+    if (ss->fs->engine == STAT_THREADED && npend >= STAT_THREADED_MIN)
+        stat_pending_threaded(ss, dfd, dir, pend, npend, names, sts, ss->fs->parallelism);
+    else
+        stat_pending(ss, dfd, dir, pend, npend, names, sts);
+}
+
+/* Back in readdir order: apply the predicates and split listed from walk-only entries. */
+static void split_pending(const struct ls_session *ss, const struct pending *pend, int npend, const char *names,
+                          const struct stat *sts, const unsigned int *flags,
+                          struct ls_entry **ents, int *count, int *capacity,
+                          struct ls_entry **walk, int *walk_count, int *walk_capacity)
+{
+    const struct ls_options *o = ss->o;
+    const struct ls_compiled *c = ss->c;
+
+    for (int i = 0; i < npend; i++)
+    {
+        const char *name = names + pend[i].name_off;
+        int walk_only = pend[i].walk_only;
+
+        /* A placeholder is listed as it is and never walked: its type is unknown. */
+        if (flags[i] & LS_ENTRY_TIMEOUT)
+        {
+            if (!walk_only)
+                append_entry(ents, count, capacity, name, &sts[i], flags[i]);
+            continue;
+        }
+
+        if (!walk_only && c->pred_len > 0 && !pred_eval(c, &sts[i]))
+        {
+            if (!o->recursive)
+                continue;
+            walk_only = 1;
+        }
+
+        if (walk_only)
+        {
+            if (S_ISDIR(sts[i].st_mode))
+                append_entry(walk, walk_count, walk_capacity, name, &sts[i], 0);
+            continue;
+        }
+
+        append_entry(ents, count, capacity, name, &sts[i], 0);
+    }
+}
+
+/* ────────────── Parallel sort of one large directory ────────────── */
+/*
+ * Above o->parallel_sort_min entries a directory is sorted on several
+ * threads: the (name, index) keys are cut into one chunk per thread and
+ * each chunk is qsort()ed; then splitters sampled from the sorted chunks
+ * cut every chunk into one range per thread, and each thread k-way merges
+ * its ranges into its own slice of the output. Finally the entry records
+ * are permuted in place to the merged order. Keys are 16 bytes, so the
+ * threads move far less memory than sorting the records themselves would.
+ * The order is cmpstring()'s.
+ */
+struct sort_key
+{
+    const char *name;
+    size_t idx;                 /* position in the unsorted records */
+};
+
+static int cmp_sort_key(const void *a, const void *b)
+{
+    return strcmp(((const struct sort_key *)a)->name, ((const struct sort_key *)b)->name);
+}
+
+struct psort
+{
+    struct sort_key *keys, *out;
+    int nparts;                 /* chunks, threads and output slices */
+    size_t *chunk;              /* chunk c is keys[chunk[c] .. chunk[c + 1]) */
+    size_t *cut;                /* slice p of chunk c starts at cut[p * nparts + c] */
+};
+
+struct psort_task
+{
+    struct psort *ps;
+    int part;
+};
+
+static void *psort_chunk(void *arg)
+{
+    struct psort_task *t = arg;
+    struct psort *ps = t->ps;
+    size_t lo = ps->chunk[t->part], hi = ps->chunk[t->part + 1];
+    qsort(ps->keys + lo, hi - lo, sizeof(struct sort_key), cmp_sort_key);
+    return NULL;
+}
+
+/* Merges slice p of every chunk with a binary heap of chunk heads. */
+static void *psort_merge(void *arg)
+{
+    struct psort_task *t = arg;
+    struct psort *ps = t->ps;
+    int k = ps->nparts, p = t->part;
+    size_t pos[k], end[k];
+    int heap[k], nheap = 0;
+
+    size_t o = 0;
+    for (int c = 0; c < k; c++)
+        o += ps->cut[p * k + c] - ps->chunk[c];
+
+    for (int c = 0; c < k; c++)
+    {
+        pos[c] = ps->cut[p * k + c];
+        end[c] = ps->cut[(p + 1) * k + c];
+        if (pos[c] == end[c])
+            continue;
+        /* sift up */
+        int i = nheap++;
+        heap[i] = c;
+        while (i > 0 && strcmp(ps->keys[pos[heap[(i - 1) / 2]]].name, ps->keys[pos[heap[i]]].name) > 0)
+        {
+            int tmp = heap[i]; heap[i] = heap[(i - 1) / 2]; heap[(i - 1) / 2] = tmp;
+            i = (i - 1) / 2;
+        }
+    }
+
+    while (nheap > 0)
+    {
+        int c = heap[0];
+        ps->out[o++] = ps->keys[pos[c]++];
+        if (pos[c] == end[c])
+            heap[0] = heap[--nheap];
+        /* sift down */
+        for (int i = 0;;)
+        {
+            int l = 2 * i + 1, r = l + 1, m = i;
+            if (l < nheap && strcmp(ps->keys[pos[heap[l]]].name, ps->keys[pos[heap[m]]].name) < 0) m = l;
+            if (r < nheap && strcmp(ps->keys[pos[heap[r]]].name, ps->keys[pos[heap[m]]].name) < 0) m = r;
+            if (m == i) break;
+            int tmp = heap[i]; heap[i] = heap[m]; heap[m] = tmp;
+            i = m;
+        }
+    }
+    return NULL;
+}
+
+/* First position in keys[lo, hi) whose name is not below name. */
+static size_t sort_key_lower_bound(const struct sort_key *keys, size_t lo, size_t hi, const char *name)
+{
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(keys[mid].name, name) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Runs fn on nparts threads (the caller being one of them). */
+static void psort_run(struct psort *ps, void *(*fn)(void *))
+{
+    int k = ps->nparts;
+    struct psort_task tasks[k];
+    pthread_t tids[k];
+    int started[k];
+    for (int p = 0; p < k; p++)
+        tasks[p] = (struct psort_task){ ps, p };
+    for (int p = 1; p < k; p++)
+        started[p] = pthread_create(&tids[p], NULL, fn, &tasks[p]) == 0;
+    fn(&tasks[0]);
+    for (int p = 1; p < k; p++)
+    {
+        if (started[p])
+            pthread_join(tids[p], NULL);
+        else
+            fn(&tasks[p]);
+    }
+}
+
+static void parallel_sort(struct ls_entry *ents, size_t n, int nthreads)
+{
+    struct psort ps;
+    int k = nthreads;
+    ps.nparts = k;
+    ps.keys = malloc(n * sizeof(struct sort_key));
+    ps.out = malloc(n * sizeof(struct sort_key));
+    ps.chunk = malloc((k + 1) * sizeof(size_t));
+    ps.cut = malloc((k + 1) * k * sizeof(size_t));
+    if (!ps.keys || !ps.out || !ps.chunk || !ps.cut) { perror("malloc"); exit(EXIT_FAILURE); }
+
+    for (size_t i = 0; i < n; i++)
+        ps.keys[i] = (struct sort_key){ ents[i].name, i };
+    for (int c = 0; c <= k; c++)
+        ps.chunk[c] = n * c / k;
+    psort_run(&ps, psort_chunk);
+
+    /* Splitters: k * 8 evenly spaced samples per chunk, sorted, every (8k)th one kept. */
+    int per = 8 * k, nsamples = 0;
+    struct sort_key *samples = malloc((size_t)per * k * sizeof(struct sort_key));
+    if (!samples) { perror("malloc"); exit(EXIT_FAILURE); }
+    for (int c = 0; c < k; c++)
+    {
+        size_t len = ps.chunk[c + 1] - ps.chunk[c];
+        for (int s = 0; s < per && len > 0; s++)
+            samples[nsamples++] = ps.keys[ps.chunk[c] + len * s / per];
+    }
+    qsort(samples, nsamples, sizeof(struct sort_key), cmp_sort_key);
+
+    for (int c = 0; c < k; c++)
+    {
+        ps.cut[c] = ps.chunk[c];
+        ps.cut[k * k + c] = ps.chunk[c + 1];
+    }
+    for (int p = 1; p < k; p++)
+    {
+        const char *splitter = samples[(size_t)nsamples * p / k].name;
+        for (int c = 0; c < k; c++)
+            ps.cut[p * k + c] = sort_key_lower_bound(ps.keys, ps.chunk[c], ps.chunk[c + 1], splitter);
+    }
+    free(samples);
+    psort_run(&ps, psort_merge);
+
+    /* Position i takes the record at out[i].idx; follow each cycle once. */
+    for (size_t i = 0; i < n; i++)
+    {
+        if (ps.out[i].idx == i)
+            continue;
+        struct ls_entry tmp = ents[i];
+        size_t j = i;
+        for (;;)
+        {
+            size_t from = ps.out[j].idx;
+            ps.out[j].idx = j;
+            if (from == i)
+            {
+                ents[j] = tmp;
+                break;
+            }
+            ents[j] = ents[from];
+            j = from;
+        }
+    }
+
+    free(ps.keys);
+    free(ps.out);
+    free(ps.chunk);
+    free(ps.cut);
+}
+
+static int sort_thread_count(const struct ls_options *o)
+{
+    if (o->sort_threads > 0)
+        return o->sort_threads;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return ncpu > 16 ? 16 : ncpu > 0 ? (int)ncpu : 1;
+}
+
+static void sort_entries(const struct ls_session *ss, struct ls_entry *ents, int count)
+{
+    const struct ls_options *o = ss->o;
+    int nthreads = o->parallel_sort_min > 0 && count >= o->parallel_sort_min ? sort_thread_count(o) : 1;
+    if (nthreads > 1)
+        parallel_sort(ents, count, nthreads);
+    else
+        qsort(ents, count, sizeof(struct ls_entry), cmpstring);
+}
+
+/* ────────────── Spilling: directories larger than max_memory ────────────── */
+/*
+ * Once the names and stats of a directory would take more than
+ * o->max_memory, the batch read so far is stat'ed, filtered, sorted and
+ * written to a temporary file as one run, and reading goes on into the
+ * emptied batch. A run is a sequence of records
+ *
+ *     struct spill_head (name and context lengths, flags, display width, stat),
+ *     name bytes, NUL and context bytes if the entry has a context (-Z)
+ *
+ * The runs are merged with a heap of their head records, smallest name on
+ * top (under -U every batch is appended to a single run that is played
+ * back as it is), and the merged entries go to the sink a bounded batch at a time
+ * (ls_sink.chunked). A finished run keeps only its descriptor, not a stdio
+ * buffer, and at most spill_fanin() runs are merged at once: beyond that
+ * the oldest are first merged into a longer run. Only the subdirectories
+ * queued for -R stay in memory whatever the size.
+ */
+#define SPILL_ENTRY_BYTES (sizeof(struct pending) + sizeof(struct stat) + sizeof(unsigned int) + \
+                           sizeof(struct ls_entry))
+#define SPILL_RUN_BUFFER  (64 * 1024)
+#define SPILL_FANIN_MAX   256
+
+struct spill_head
+{
+    uint32_t name_len;
+    uint32_t context_len;       /* UINT32_MAX: no context */
+    uint32_t flags;
+    int32_t width;
+    struct stat st;
+};
+
+struct spill
+{
+    int *runs;                  /* descriptors of the finished runs, oldest first */
+    int nruns, runs_capacity;
+    struct ls_entry *subdirs;   /* listed directories and walk-only ones, for -R */
+    int nsub, sub_capacity;
+    int nwalk;                  /* walk-only ones among them */
+    struct name_arena sub_names; /* their names; subdirs[].name holds offsets until delivery */
+};
+
+struct spill_src
+{
+    FILE *fp;
+    struct spill_head h;
+    char *name;
+    size_t cap;
+};
+
+static int spill_due(const struct ls_options *o, const struct scan *sc)
+{
+    return o->max_memory > 0 && sc->arena.len + sc->npend * SPILL_ENTRY_BYTES > o->max_memory;
+}
+
+static int spill_fanin(const struct ls_options *o)
+{
+    size_t n = o->max_memory / (2 * SPILL_RUN_BUFFER);
+    return n < 2 ? 2 : n > SPILL_FANIN_MAX ? SPILL_FANIN_MAX : (int)n;
+}
+
+/* A new run: an unlinked file in $TMPDIR (default /tmp), open for writing. */
+static FILE *spill_file(void)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    if (!tmpdir || !*tmpdir) tmpdir = "/tmp";
+
+    int fd = open(tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/lsdir-spill-XXXXXX", tmpdir);
+        fd = mkostemp(path, O_CLOEXEC);
+        if (fd != -1) unlink(path);
+    }
+    FILE *fp = fd == -1 ? NULL : fdopen(fd, "w+");
+    if (!fp) { perror(tmpdir); exit(EXIT_FAILURE); }
+    setvbuf(fp, NULL, _IOFBF, SPILL_RUN_BUFFER);
+    return fp;
+}
+
+static void spill_put(FILE *fp, const struct spill_head *h, const char *name)
+{
+    size_t len = h->name_len + (h->context_len == UINT32_MAX ? 0 : 1 + h->context_len);
+    if (fwrite(h, sizeof(*h), 1, fp) != 1 || fwrite(name, 1, len, fp) != len)
+    {
+        perror("spill write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Next record of src's run into src->h and src->name (the name, then its
+ * context after the NUL if it has one); 0 at the end of the run.
+ */
+static int spill_get(struct spill_src *src)
+{
+    if (fread(&src->h, sizeof(src->h), 1, src->fp) != 1)
+        return 0;
+    size_t len = src->h.name_len + (src->h.context_len == UINT32_MAX ? 0 : 1 + src->h.context_len);
+    if (len + 1 > src->cap)
+    {
+        src->cap = len + 1 > 2 * src->cap ? len + 1 : 2 * src->cap;
+        free(src->name);
+        if (!(src->name = malloc(src->cap))) { perror("malloc"); exit(EXIT_FAILURE); }
+    }
+    if (fread(src->name, 1, len, src->fp) != len)
+    {
+        fprintf(stderr, "spill read: short record\n");
+        exit(EXIT_FAILURE);
+    }
+    src->name[len] = '\0';
+    return 1;
+}
+
+/* Keeps a written run as a bare descriptor, dropping its stdio buffer. */
+static void spill_add_run(struct spill *sp, FILE *fp)
+{
+    if (sp->nruns == sp->runs_capacity)
+    {
+        sp->runs_capacity = sp->runs_capacity == 0 ? 16 : sp->runs_capacity * 2;
+        int *tmp = realloc(sp->runs, sp->runs_capacity * sizeof(int));
+        if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+        sp->runs = tmp;
+    }
+    int fd = fflush(fp) == 0 ? dup(fileno(fp)) : -1;
+    if (fd == -1) { perror("spill write"); exit(EXIT_FAILURE); }
+    fclose(fp);
+    sp->runs[sp->nruns++] = fd;
+}
+
+static void spill_merge(int *runs, int n, int (*emit)(void *arg, const struct spill_head *h, const char *name),
+                        void *arg);
+
+static int spill_to_run(void *arg, const struct spill_head *h, const char *name)
+{
+    spill_put(arg, h, name);
+    return 1;
+}
+
+/* Merges the oldest runs into one while there are more than fanin. */
+static void spill_cascade(struct spill *sp, int fanin)
+{
+    while (sp->nruns > fanin)
+    {
+        FILE *merged = spill_file();
+        spill_merge(sp->runs, fanin, spill_to_run, merged);
+        memmove(sp->runs, sp->runs + fanin, (sp->nruns - fanin) * sizeof(int));
+        sp->nruns -= fanin;
+        spill_add_run(sp, merged);
+    }
+}
+
+/* The batch in sc becomes one sorted run; sc is emptied for the next batch. */
+static void spill_batch(struct ls_session *ss, struct spill *sp, int dfd, const char *dir, struct scan *sc)
+{
+    const struct ls_options *o = ss->o;
+    struct ls_sink *sink = ss->sink;
+    int npend = sc->npend;
+
+    if (sp->nruns == 0)
+        memset(&sink->totals, 0, sizeof(sink->totals));
+
+    struct stat *sts = malloc((npend > 0 ? npend : 1) * sizeof(struct stat));
+    unsigned int *flags = calloc(npend > 0 ? npend : 1, sizeof(unsigned int));
+    if (!sts || !flags) { perror("malloc"); exit(EXIT_FAILURE); }
+    stat_batch(ss, dfd, dir, sc->pend, npend, sc->arena.buf, sts);
+
+    struct ls_entry *ents = NULL, *walk = NULL;
+    int count = 0, capacity = 0, walk_count = 0, walk_capacity = 0;
+    split_pending(ss, sc->pend, npend, sc->arena.buf, sts, flags, &ents, &count, &capacity,
+                  &walk, &walk_count, &walk_capacity);
+    free(sts);
+    free(flags);
+    struct name_arena ctx = { NULL, 0, 0 };
+    meta_fetch(ss, dfd, ents, count, &ctx);
+
+    if (o->du)
+        du_add(ss, ents, count);
+    if (count > 0 && !o->unsorted)
+        sort_entries(ss, ents, count);
+    names_prepare(o, ents, count);
+    if (sink->measure)
+        sink->measure(sink, ents, count);
+
+    /* Unsorted batches simply follow each other, so they all go into one run. */
+    FILE *run;
+    if (o->unsorted && sp->nruns > 0)
+    {
+        int fd = dup(sp->runs[0]);
+        if (fd == -1 || !(run = fdopen(fd, "a"))) { perror("spill write"); exit(EXIT_FAILURE); }
+        setvbuf(run, NULL, _IOFBF, SPILL_RUN_BUFFER);
+    }
+    else
+        run = spill_file();
+    for (int i = 0; i < count; i++)
+    {
+        const struct ls_entry *e = &ents[i];
+        size_t len = strlen(e->name);
+        struct spill_head h = { len, e->context ? strlen(e->context) : UINT32_MAX, e->flags, e->width, e->st };
+        if (e->context)
+        {
+            /* Name and context are written as one record body. */
+            char body[len + 1 + h.context_len];
+            memcpy(body, e->name, len + 1);
+            memcpy(body + len + 1, e->context, h.context_len);
+            spill_put(run, &h, body);
+        }
+        else
+            spill_put(run, &h, e->name);
+    }
+    if (o->unsorted && sp->nruns > 0)
+    {
+        if (fclose(run) != 0) { perror("spill write"); exit(EXIT_FAILURE); }
+    }
+    else
+        spill_add_run(sp, run);
+    spill_cascade(sp, SPILL_FANIN_MAX);
+
+    /* Subdirectories outlive the batch's arena: their names are copied. */
+    if (o->recursive)
+        for (int i = 0; i < count + walk_count; i++)
+        {
+            const struct ls_entry *e = i < count ? &ents[i] : &walk[i - count];
+            if (!S_ISDIR(e->st.st_mode))
+                continue;
+            append_entry(&sp->subdirs, &sp->nsub, &sp->sub_capacity, NULL, &e->st, 0);
+            sp->subdirs[sp->nsub - 1].name = (const char *)arena_add(&sp->sub_names, e->name, strlen(e->name));
+        }
+
+    sp->nwalk += walk_count;
+    free(ents);
+    free(walk);
+    free(ctx.buf);
+    sc->npend = 0;
+    sc->arena.len = 0;
+}
+
+static int spill_src_less(const struct spill_src *srcs, int a, int b)
+{
+    return strcmp(srcs[a].name, srcs[b].name) < 0;
+}
+
+static void spill_sift_down(const struct spill_src *srcs, int *heap, int n, int i)
+{
+    for (;;)
+    {
+        int l = 2 * i + 1, m = i;
+        if (l < n && spill_src_less(srcs, heap[l], heap[m])) m = l;
+        if (l + 1 < n && spill_src_less(srcs, heap[l + 1], heap[m])) m = l + 1;
+        if (m == i) return;
+        int t = heap[i]; heap[i] = heap[m]; heap[m] = t;
+        i = m;
+    }
+}
+
+/*
+ * Merges runs[0..n) in name order, handing each record to emit(); stops
+ * early if emit returns 0. The runs are closed.
+ */
+static void spill_merge(int *runs, int n, int (*emit)(void *arg, const struct spill_head *h, const char *name),
+                        void *arg)
+{
+    struct spill_src *srcs = calloc(n, sizeof(struct spill_src));
+    int *heap = malloc(n * sizeof(int));
+    if (!srcs || !heap) { perror("malloc"); exit(EXIT_FAILURE); }
+
+    int live = 0;
+    for (int i = 0; i < n; i++)
+    {
+        lseek(runs[i], 0, SEEK_SET);
+        if (!(srcs[i].fp = fdopen(runs[i], "r"))) { perror("fdopen"); exit(EXIT_FAILURE); }
+        setvbuf(srcs[i].fp, NULL, _IOFBF, SPILL_RUN_BUFFER);
+        if (spill_get(&srcs[i]))
+            heap[live++] = i;
+    }
+
+    for (int i = live / 2 - 1; i >= 0; i--)
+        spill_sift_down(srcs, heap, live, i);
+    while (live > 0)
+    {
+        struct spill_src *top = &srcs[heap[0]];
+        if (!emit(arg, &top->h, top->name))
+            break;
+        if (!spill_get(top))
+            heap[0] = heap[--live];
+        spill_sift_down(srcs, heap, live, 0);
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        fclose(srcs[i].fp);
+        free(srcs[i].name);
+    }
+    free(srcs);
+    free(heap);
+}
+
+/* Entries merged so far, handed to the sink whenever they fill half the budget. */
+struct spill_out
+{
+    struct ls_session *ss;
+    const char *dir;
+    struct ls_entry *ents;
+    int count, capacity;
+    struct name_arena names;
+    size_t offs_capacity;
+    size_t *offs;
+};
+
+static void spill_flush(struct spill_out *out)
+{
+    struct ls_sink *sink = out->ss->sink;
+    for (int i = 0; i < out->count; i++)
+    {
+        out->ents[i].name = out->names.buf + out->offs[i];
+        if (out->ents[i].context)
+            out->ents[i].context = out->ents[i].name + (size_t)out->ents[i].context;
+    }
+    if (out->count > 0 && sink->ops->dir_entries)
+        sink->ops->dir_entries(sink, out->dir, out->ents, out->count);
+    out->count = 0;
+    out->names.len = 0;
+}
+
+static int spill_to_sink(void *arg, const struct spill_head *h, const char *name)
+{
+    struct spill_out *out = arg;
+    append_entry(&out->ents, &out->count, &out->capacity, NULL, &h->st, h->flags);
+    out->ents[out->count - 1].width = h->width;
+    if ((size_t)out->count > out->offs_capacity)
+    {
+        out->offs_capacity = out->capacity;
+        size_t *tmp = realloc(out->offs, out->offs_capacity * sizeof(size_t));
+        if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+        out->offs = tmp;
+    }
+    /* The context follows the name in the arena; context holds its offset from the name until the flush. */
+    if (h->context_len == UINT32_MAX)
+        out->offs[out->count - 1] = arena_add(&out->names, name, h->name_len);
+    else
+    {
+        out->offs[out->count - 1] = arena_add(&out->names, name, h->name_len + 1 + h->context_len);
+        out->ents[out->count - 1].context = (const char *)(size_t)(h->name_len + 1);
+    }
+
+    if (out->names.len + out->count * sizeof(struct ls_entry) > out->ss->o->max_memory / 2)
+        spill_flush(out);
+    return !out->ss->sink->stop;
+}
+
+/* Merges the runs into the sink, then queues the subdirectories. */
+static void spill_deliver(struct ls_session *ss, struct spill *sp, const char *dir, int depth)
+{
+    const struct ls_options *o = ss->o;
+    struct ls_sink *sink = ss->sink;
+
+    /* Too many runs to read at once within the budget: merge the oldest into longer ones. */
+    spill_cascade(sp, spill_fanin(o));
+
+    if (sink->ops->dir_begin)
+        sink->ops->dir_begin(sink, dir, depth);
+    sink->chunked = 1;
+    struct spill_out out = { ss, dir, NULL, 0, 0, { NULL, 0, 0 }, 0, NULL };
+    spill_merge(sp->runs, sp->nruns, spill_to_sink, &out);
+    sp->nruns = 0;
+    spill_flush(&out);
+    if (sink->ops->dir_end)
+        sink->ops->dir_end(sink, dir, depth);
+    sink->chunked = 0;
+    free(out.ents);
+    free(out.offs);
+    free(out.names.buf);
+
+    if (o->recursive && !sink->stop)
+    {
+        for (int i = 0; i < sp->nsub; i++)
+            sp->subdirs[i].name = sp->sub_names.buf + (size_t)sp->subdirs[i].name;
+        queue_subdirs(ss, dir, depth, sp->subdirs, sp->nsub, NULL, 0, !o->unsorted || sp->nwalk > 0);
+    }
+}
+
+static void spill_free(struct spill *sp)
+{
+    for (int i = 0; i < sp->nruns; i++)
+        close(sp->runs[i]);
+    free(sp->runs);
+    free(sp->subdirs);
+    free(sp->sub_names.buf);
+}
+
+/* ────────────── The -R pipeline: reader, walker and printer ────────────── */
+/*
+ * Serially, each directory is read, stat'ed, sorted and printed before the
+ * next one is opened, so the disk waits on the formatting and the CPU on
+ * the disk. With o->prefetch > 0 a -R walk runs as three stages instead:
+ *
+ *   reader   opens and reads the names of the next o->prefetch directories
+ *            on the frame stack (the ones walk_frames() pops next, in that
+ *            order), ahead of the walk; only those it is sure to list, so a
+ *            pruned, already-listed or off-limits directory is never opened
+ *   walker   the walk itself: stats, filters, sorts, queues subdirectories
+ *            (it takes a directory's names from the reader if it asked)
+ *   printer  the calling thread: measures names and calls the sink
+ *
+ * connected by bounded single-producer/single-consumer rings. Listings
+ * reach the printer in the order the walker finishes them, which is the
+ * serial walk order, so the output is the same. Only the printer touches
+ * the sink; a stop it sees is passed back to the walker. Features that
+ * need the sink or the output position in step with the walk (enter(),
+ * checkpoints), pace it (throttling, deadlines), or stream a directory to
+ * the sink (max_memory) keep the serial walk, as does a session with a
+ * directory cache, whose hits need no reading, and a single CPU.
+ */
+struct spsc_ring
+{
+    void **slots;
+    int size;
+    int head, tail;             /* the consumer's and the producer's next slot */
+    sem_t items, space;
+};
+
+static void ring_init(struct spsc_ring *r, int size)
+{
+    if (!(r->slots = malloc(size * sizeof(void *)))) { perror("malloc"); exit(EXIT_FAILURE); }
+    r->size = size;
+    r->head = r->tail = 0;
+    sem_init(&r->items, 0, 0);
+    sem_init(&r->space, 0, size);
+}
+
+static void ring_destroy(struct spsc_ring *r)
+{
+    sem_destroy(&r->items);
+    sem_destroy(&r->space);
+    free(r->slots);
+}
+
+/* Blocks while the ring is full; the semaphores order the slot accesses. */
+static void ring_put(struct spsc_ring *r, void *p)
+{
+    while (sem_wait(&r->space) == -1)
+        ;
+    r->slots[r->tail] = p;
+    r->tail = (r->tail + 1) % r->size;
+    sem_post(&r->items);
+}
+
+static void *ring_get(struct spsc_ring *r)
+{
+    while (sem_wait(&r->items) == -1)
+        ;
+    void *p = r->slots[r->head];
+    r->head = (r->head + 1) % r->size;
+    sem_post(&r->space);
+    return p;
+}
+
+/* A directory read ahead: open, with its names, or NULL names if that failed. */
+struct prefetch
+{
+    char *path;
+    int fd;
+    struct dir_snapshot *names;
+};
+
+/* A finished directory on its way to the printer; it owns the memory the entries point into. */
+struct listing
+{
+    char *dir;
+    int depth;
+    struct ls_entry *ents;
+    int count;
+    char *names, *contexts;
+};
+
+struct walk_pipe
+{
+    struct ls_session *ss;
+    const char *dir;            /* the operand and its depth, for the walker */
+    int depth;
+    int lookahead;
+    struct spsc_ring requests;  /* walker -> reader: paths; NULL to finish */
+    struct spsc_ring reads;     /* reader -> walker: struct prefetch; NULL when finished */
+    struct spsc_ring listings;  /* walker -> printer: struct listing; NULL at the end */
+    struct prefetch **ready;    /* read but not taken yet (walker only) */
+    int nready;
+    char **dropped;             /* requested, then skipped by the walker: freed when they arrive */
+    int ndropped;
+    int outstanding;            /* requested and not taken yet: at most lookahead */
+    int stop;                   /* the printer saw sink->stop */
+};
+
+static int walk_stopped(const struct ls_session *ss)
+{
+    return ss->pipe ? __atomic_load_n(&ss->pipe->stop, __ATOMIC_RELAXED) : ss->sink->stop;
+}
+
+static void prefetch_free(struct prefetch *p)
+{
+    if (!p) return;
+    if (p->fd != -1) close(p->fd);
+    if (p->names) snapshot_free(p->names);
+    free(p->path);
+    free(p);
+}
+
+static void *pipe_reader(void *arg)
+{
+    struct walk_pipe *wp = arg;
+    char *path;
+    while ((path = ring_get(&wp->requests)) != NULL)
+    {
+        struct prefetch *p = malloc(sizeof(struct prefetch));
+        if (!p) { perror("malloc"); exit(EXIT_FAILURE); }
+        p->path = path;
+        p->names = read_names(wp->ss->base_fd, path, &p->fd);
+        ring_put(&wp->reads, p);
+    }
+    ring_put(&wp->reads, NULL);
+    return NULL;
+}
+
+/* The checks walk_frames() makes on a popped frame that depend on nothing but the frame. */
+static int frame_excluded(const struct ls_session *ss, const struct walk_frame *f)
+{
+    return strcmp(f->name, ".") == 0 || strcmp(f->name, "..") == 0 || name_pruned(ss->c, f->name) ||
+           (ss->o->one_file_system && f->st.st_dev != ss->root_dev);
+}
+
+/*
+ * Whether frame i is sure to be listed when it is popped. A directory
+ * already in the visited set, or also behind a frame popped before it,
+ * is not; nor is one on a mount that may be a pseudo filesystem under
+ * skip_pseudo. (The sink's enter() would be asked too, but such sinks
+ * keep the serial walk.)
+ */
+static int frame_listable(struct ls_session *ss, int i)
+{
+    const struct ls_options *o = ss->o;
+    const struct walk_frame *f = &ss->frames[i];
+    if (!f->have_st || frame_excluded(ss, f))
+        return 0;
+    if (o->follow_links || o->same_dir_once)
+    {
+        if (visited_contains(ss, f->st.st_dev, f->st.st_ino))
+            return 0;
+        for (int j = i + 1; j < ss->nframes; j++)
+        {
+            const struct walk_frame *g = &ss->frames[j];
+            if (g->have_st && g->st.st_dev == f->st.st_dev && g->st.st_ino == f->st.st_ino &&
+                !frame_excluded(ss, g))
+                return 0;
+        }
+    }
+    if (o->skip_pseudo && f->st.st_dev != ss->root_dev)
+    {
+        const struct fs_type *t = fs_profile_find(ss, f->st.st_dev);
+        if (!t || t->pseudo)
+            return 0;
+    }
+    return 1;
+}
+
+/* Asks the reader for the directories on top of the frame stack it has not been asked for. */
+static void prefetch_ahead(struct ls_session *ss, int base)
+{
+    struct walk_pipe *wp = ss->pipe;
+    for (int i = ss->nframes - 1; i >= base && i >= ss->nframes - wp->lookahead; i--)
+    {
+        struct walk_frame *f = &ss->frames[i];
+        if (f->prefetched || !frame_listable(ss, i))
+            continue;
+        if (wp->outstanding == wp->lookahead)
+            break;
+        char *path = strdup(f->path);
+        if (!path) { perror("strdup"); exit(EXIT_FAILURE); }
+        ring_put(&wp->requests, path);
+        f->prefetched = 1;
+        wp->outstanding++;
+    }
+}
+
+/* Removes path's read from the ready ones, if it has arrived. */
+static struct prefetch *prefetch_ready(struct walk_pipe *wp, const char *path)
+{
+    for (int i = 0; i < wp->nready; i++)
+        if (strcmp(wp->ready[i]->path, path) == 0)
+        {
+            struct prefetch *p = wp->ready[i];
+            memmove(wp->ready + i, wp->ready + i + 1, (wp->nready - i - 1) * sizeof(struct prefetch *));
+            wp->nready--;
+            wp->outstanding--;
+            return p;
+        }
+    return NULL;
+}
+
+/* Waits for the reader's next read; one the walker has dropped is freed on arrival. */
+static void prefetch_receive(struct walk_pipe *wp)
+{
+    struct prefetch *p = ring_get(&wp->reads);
+    for (int i = 0; i < wp->ndropped; i++)
+        if (strcmp(wp->dropped[i], p->path) == 0)
+        {
+            free(wp->dropped[i]);
+            wp->dropped[i] = wp->dropped[--wp->ndropped];
+            wp->outstanding--;
+            prefetch_free(p);
+            return;
+        }
+    wp->ready[wp->nready++] = p;
+}
+
+/* The read of path, which was requested; waits for the reader if it is not done yet. */
+static struct prefetch *prefetch_take(struct walk_pipe *wp, const char *path)
+{
+    struct prefetch *p;
+    while (!(p = prefetch_ready(wp, path)))
+        prefetch_receive(wp);
+    return p;
+}
+
+/* The walker skipped a requested directory after all: nothing waits for its read. */
+static void prefetch_drop(struct walk_pipe *wp, const char *path)
+{
+    struct prefetch *p = prefetch_ready(wp, path);
+    if (p)
+        prefetch_free(p);
+    else if (!(wp->dropped[wp->ndropped++] = strdup(path)))
+    {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Hands a listing to the printer, which frees ents, names and contexts. */
+static void pipe_deliver(struct walk_pipe *wp, const char *dir, int depth, struct ls_entry *ents, int count,
+                         char *names, char *contexts)
+{
+    struct listing *l = malloc(sizeof(struct listing));
+    if (!l || !(l->dir = strdup(dir))) { perror("malloc"); exit(EXIT_FAILURE); }
+    l->depth = depth;
+    l->ents = ents;
+    l->count = count;
+    l->names = names;
+    l->contexts = contexts;
+    ring_put(&wp->listings, l);
+}
+
+/* ────────────── list_dir: one directory, its subdirectories queued for -R ────────────── */
+static void mark_partial(struct ls_session *ss, const char *dir)
+{
+    if (ss->npartial == ss->partial_capacity)
+    {
+        ss->partial_capacity = ss->partial_capacity == 0 ? 16 : ss->partial_capacity * 2;
+        char **tmp = realloc(ss->partial, ss->partial_capacity * sizeof(char *));
+        if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+        ss->partial = tmp;
+    }
+    if (!(ss->partial[ss->npartial++] = strdup(dir))) { perror("strdup"); exit(EXIT_FAILURE); }
+}
+
+static struct walk_frame *frame_new(struct ls_session *ss)
+{
+    if (ss->nframes == ss->frames_capacity)
+    {
+        ss->frames_capacity = ss->frames_capacity == 0 ? 64 : ss->frames_capacity * 2;
+        struct walk_frame *tmp = realloc(ss->frames, ss->frames_capacity * sizeof(struct walk_frame));
+        if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+        ss->frames = tmp;
+    }
+    struct walk_frame *f = &ss->frames[ss->nframes++];
+    memset(f, 0, sizeof(*f));
+    return f;
+}
+
+static void push_frame(struct ls_session *ss, const char *dir, const struct ls_entry *e, int depth,
+                       struct du_node *du_parent)
+{
+    struct walk_frame *f = frame_new(ss);
+    size_t dlen = strlen(dir), nlen = strlen(e->name);
+    if (!(f->path = malloc(dlen + nlen + 2))) { perror("malloc"); exit(EXIT_FAILURE); }
+    memcpy(f->path, dir, dlen);
+    f->path[dlen] = '/';
+    memcpy(f->path + dlen + 1, e->name, nlen + 1);
+    f->name = f->path + dlen + 1;
+    f->st = e->st;
+    f->have_st = 1;
+    f->depth = depth;
+    f->du_parent = du_parent;
+}
+
+/* Directories among ents, and all of walk, go on the frame stack to pop in name order. */
+static void queue_subdirs(struct ls_session *ss, const char *dir, int depth, const struct ls_entry *ents, int count,
+                          const struct ls_entry *walk, int walk_count, int sort)
+{
+    const struct ls_entry **subdirs = malloc((count + walk_count + 1) * sizeof(struct ls_entry *));
+    if (!subdirs) { perror("malloc"); exit(EXIT_FAILURE); }
+    int nsub = 0;
+    for (int i = 0; i < count; i++)
+        if (S_ISDIR(ents[i].st.st_mode)) subdirs[nsub++] = &ents[i];
+    for (int i = 0; i < walk_count; i++)
+        subdirs[nsub++] = &walk[i];
+    if (sort)
+        qsort(subdirs, nsub, sizeof(struct ls_entry *), cmp_entry_ptr);
+
+    for (int i = nsub - 1; i >= 0; i--)
+        push_frame(ss, dir, subdirs[i], depth + 1, ss->du_current);
+    free(subdirs);
+}
+
+/* dst is the directory's own stat if the caller has it (from the parent's listing). */
+static void list_dir(struct ls_session *ss, const char *dir, int depth, const struct stat *dst)
+{
+    const struct ls_options *o = ss->o;
+    struct ls_sink *sink = ss->sink;
+    struct dirent *entry;
+    struct ls_entry *ents = NULL;
+    int count = 0, capacity = 0;
+    struct ls_entry *walk = NULL;   /* filtered-out directories that -R still enters */
+    int walk_count = 0, walk_capacity = 0;
+    struct scan sc = { NULL, 0, 0, { NULL, 0, 0 } };
+    struct spill sp = { 0 };
+
+    /* Under a deadline the names are read on a helper thread (see read_dir_timed()). */
+    int timed = o->timeout_dir_ms > 0 || o->timeout_stat_ms > 0;
+    struct timespec deadline;
+    struct dir_snapshot *read = NULL;
+    DIR *dp = NULL;
+    int dfd;
+    if (timed)
+    {
+        deadline = deadline_after(o->timeout_dir_ms);
+        dfd = read_dir_timed(ss, dir, &deadline, &read);
+        if (dfd == -1)
+        {
+            if (errno == ETIMEDOUT)
+            {
+                fprintf(err_out(o), "%s: timed out reading directory\n", dir);
+                ss->dir_timeouts++;
+                mark_partial(ss, dir);
+            }
+            else
+                report_errno(o, "opendir");
+            return;
+        }
+    }
+    else if (ss->prefetched && ss->prefetched->names)
+    {
+        /* Read ahead by the pipeline's reader: names in hand, directory open for the stats. */
+        dfd = ss->prefetched->fd;
+        read = ss->prefetched->names;
+        ss->prefetched->fd = -1;
+        ss->prefetched->names = NULL;
+    }
+    else
+    {
+        dfd = open_dir(ss, dir);
+        dp = dfd == -1 ? NULL : fdopendir(dfd);
+        if (!dp)
+        {
+            report_errno(o, "opendir");
+            if (dfd != -1) close(dfd);
+            return;
+        }
+    }
+
+    /* The profile of the directory's filesystem decides how it is read and stat'ed. */
+    struct stat own;
+    dev_t dev = dst ? dst->st_dev : fstat(dfd, &own) == 0 ? own.st_dev : 0;
+    if (depth == 0)
+        ss->root_dev = dev;
+    ss->fs = fs_profile_get(ss, dfd, dev);
+    if (o->skip_pseudo && ss->fs->pseudo && dev != ss->root_dev)
+    {
+        fprintf(err_out(o), "%s: not entering %s filesystem\n", dir, ss->fs->name);
+        if (dp) closedir(dp);
+        else close(dfd);
+        if (read) snapshot_free(read);
+        return;
+    }
+
+    /* Every directory gets a node, even an empty one, so it shows up in the summary. */
+    struct du_node *du_parent = ss->du_current;
+    if (o->du)
+    {
+        if (ss->du_count == ss->du_capacity)
+        {
+            ss->du_capacity = ss->du_capacity == 0 ? 32 : ss->du_capacity * 2;
+            struct du_node **tmp = realloc(ss->du_nodes, ss->du_capacity * sizeof(struct du_node *));
+            if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+            ss->du_nodes = tmp;
+        }
+        struct du_node *node = calloc(1, sizeof(struct du_node));
+        if (!node || !(node->path = strdup(dir))) { perror("calloc"); exit(EXIT_FAILURE); }
+        node->parent = du_parent;
+        ss->du_nodes[ss->du_count++] = node;
+        ss->du_current = node;
+    }
+
+    /* Names come from a still-valid cached snapshot or from readdir(). */
+    struct dir_snapshot *snap = NULL, *fresh = NULL;
+    struct stat cst;
+    if (o->dir_cache && !timed && fstat(dfd, &cst) == 0)
+    {
+        snap = dir_cache_get(o->dir_cache, &cst);
+        if (!snap)
+            fresh = snapshot_new(&cst);
+    }
+
+    if (snap || read)
+    {
+        const struct dir_snapshot *names = snap ? snap : read;
+        for (int i = 0; i < names->nrecs; i++)
+        {
+            const char *name = names->names + names->recs[i].name_off;
+            scan_name(ss, &sc, name, strlen(name), names->recs[i].ino, names->recs[i].type);
+            if (!timed && spill_due(o, &sc))
+                spill_batch(ss, &sp, dfd, dir, &sc);
+        }
+        if (snap)
+            snapshot_release(o->dir_cache, snap);
+        else
+            snapshot_free(read);
+    }
+    else
+    {
+        while ((entry = readdir(dp)) != NULL)
+        {
+            if (entry->d_name[0] == '.')
+                continue;
+
+            size_t name_len = strlen(entry->d_name);
+            if (fresh)
+                snapshot_add(fresh, entry->d_name, name_len, entry->d_ino, entry->d_type);
+            scan_name(ss, &sc, entry->d_name, name_len, entry->d_ino, entry->d_type);
+            if (spill_due(o, &sc))
+            {
+                /* A directory this large is not worth a cache snapshot of every name. */
+                if (fresh) { snapshot_free(fresh); fresh = NULL; }
+                spill_batch(ss, &sp, dfd, dir, &sc);
+            }
+        }
+        if (fresh)
+            dir_cache_put(o->dir_cache, fresh);
+    }
+
+    if (sp.nruns > 0)
+    {
+        if (sc.npend > 0)
+            spill_batch(ss, &sp, dfd, dir, &sc);
+        if (dp) closedir(dp);
+        else close(dfd);
+        free(sc.pend);
+        free(sc.arena.buf);
+        spill_deliver(ss, &sp, dir, depth);
+        spill_free(&sp);
+        ss->du_current = du_parent;
+        return;
+    }
+
+    struct pending *pend = sc.pend;
+    int npend = sc.npend;
+    struct name_arena arena = sc.arena;
+
+    struct stat *sts = malloc((npend > 0 ? npend : 1) * sizeof(struct stat));
+    unsigned int *flags = calloc(npend > 0 ? npend : 1, sizeof(unsigned int));
+    if (!sts || !flags) { perror("malloc"); exit(EXIT_FAILURE); }
+    if (!timed)
+        stat_batch(ss, dfd, dir, pend, npend, arena.buf, sts);
+    else
+    {
+        int timeouts = stat_pending_timed(ss, dfd, dir, pend, npend, &arena, sts, flags, &deadline);
+        if (timeouts > 0)
+        {
+            fprintf(err_out(o), "%s: %d entr%s timed out\n", dir, timeouts, timeouts == 1 ? "y" : "ies");
+            ss->stat_timeouts += timeouts;
+            mark_partial(ss, dir);
+        }
+        close(dfd);
+    }
+
+    split_pending(ss, pend, npend, arena.buf, sts, flags, &ents, &count, &capacity,
+                  &walk, &walk_count, &walk_capacity);
+    free(sts);
+    free(flags);
+    free(pend);
+
+    /* ACL marker and context (never under a deadline: getxattr() has none). */
+    struct name_arena ctx = { NULL, 0, 0 };
+    if (!timed)
+    {
+        meta_fetch(ss, dfd, ents, count, &ctx);
+        if (dp) closedir(dp);
+        else close(dfd);
+    }
+
+    if (o->du)
+        du_add(ss, ents, count);
+
+    /* Sort entries alphabetically; each name carries its own stat along. */
+    if (count > 0 && !o->unsorted)
+        sort_entries(ss, ents, count);
+
+    if (ss->pipe)
+    {
+        /* Subdirectories are queued first: from here on the printer owns the entries. */
+        if (o->recursive && !walk_stopped(ss))
+            queue_subdirs(ss, dir, depth, ents, count, walk, walk_count, walk_count > 0);
+        pipe_deliver(ss->pipe, dir, depth, ents, count, arena.buf, ctx.buf);
+        ents = NULL;
+        arena.buf = ctx.buf = NULL;
+    }
+    else
+    {
+        names_prepare(o, ents, count);
+        if (sink->ops->dir_begin)
+            sink->ops->dir_begin(sink, dir, depth);
+        if (sink->ops->dir_entries)
+            sink->ops->dir_entries(sink, dir, ents, count);
+        if (sink->ops->dir_end)
+            sink->ops->dir_end(sink, dir, depth);
+
+        /* Step 7: Queue subdirectories, listed or filtered out, so they pop in name order */
+        if (o->recursive && !sink->stop)
+            queue_subdirs(ss, dir, depth, ents, count, walk, walk_count, walk_count > 0);
+    }
+
+    /* Step 8: Free memory */
+    free(ents);
+    free(walk);
+    free(arena.buf);
+    free(ctx.buf);
+    ss->du_current = du_parent;
+}
+
+/*
+ * The -R walk keeps its frontier in ss->frames instead of the C stack, so
+ * it can be written to a checkpoint between any two directories. Each
+ * frame is checked (prune, visited set, the sink's enter()) when it is
+ * popped, i.e. at the same point the recursive walk used to check it.
+ * The pipeline reads a frame ahead only if frame_listable() says these
+ * checks will pass, and otherwise leaves it to list_dir() to open.
+ */
+static void walk_frames(struct ls_session *ss, int base)
+{
+    const struct ls_options *o = ss->o;
+    struct ls_sink *sink = ss->sink;
+
+    while (ss->nframes > base && !walk_stopped(ss))
+    {
+        if (ss->pipe)
+            prefetch_ahead(ss, base);
+        struct walk_frame f = ss->frames[--ss->nframes];
+
+        if (!f.have_st && fstatat(ss->base_fd, f.path, &f.st, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+            report_errno(o, f.path);
+            free(f.path);
+            continue;
+        }
+
+        int skip = strcmp(f.name, ".") == 0 || strcmp(f.name, "..") == 0 || name_pruned(ss->c, f.name);
+        if (!skip && (o->follow_links || o->same_dir_once) && !visited_insert(ss, f.st.st_dev, f.st.st_ino))
+        {
+            fprintf(err_out(o), "%s: not listing already-listed directory\n", f.path);
+            skip = 1;
+        }
+        if (!skip && o->one_file_system && f.st.st_dev != ss->root_dev)
+            skip = 1;
+        if (!skip && sink->ops->enter && !sink->ops->enter(sink, f.path, &f.st))
+            skip = 1;
+
+        if (!skip)
+        {
+            struct prefetch *pf = f.prefetched ? prefetch_take(ss->pipe, f.path) : NULL;
+            ss->du_current = f.du_parent;
+            ss->prefetched = pf;
+            list_dir(ss, f.path, f.depth, &f.st);
+            ss->prefetched = NULL;
+            prefetch_free(pf);
+            ss->dirs_done++;
+            if (ss->checkpoint_path)
+                checkpoint_maybe(ss);
+        }
+        else if (f.prefetched)
+            prefetch_drop(ss->pipe, f.path);
+        free(f.path);
+    }
+
+    /* Stopped early: drop what is left. */
+    while (ss->nframes > base)
+        free(ss->frames[--ss->nframes].path);
+}
+
+/* ────────────── Checkpoints of the -R frontier ────────────── */
+/*
+ * A checkpoint is written between two directories, when the output of
+ * every directory listed so far has been flushed:
+ *
+ *     #lsdir-checkpoint 1
+ *     operand <path>
+ *     headers <0|1> framing <0|1>
+ *     offset <output bytes>
+ *     dirs <directories listed>
+ *     visited <n>, then n lines "<dev> <ino>"
+ *     frames <n>, then n lines "<depth>\t<path>", bottom of the stack first
+ *
+ * It goes to FILE.tmp, is fsync()ed and renamed over FILE, so a crash
+ * leaves either the old or the new checkpoint.
+ */
+#define CHECKPOINT_MAGIC "#lsdir-checkpoint 1"
+
+void ls_session_set_checkpoint(struct ls_session *ss, const char *path, double interval)
+{
+    ss->checkpoint_path = path;
+    ss->checkpoint_interval = interval;
+    clock_gettime(CLOCK_MONOTONIC, &ss->checkpoint_last);
+}
+
+static void set_operand(struct ls_session *ss, const char *path)
+{
+    free(ss->operand);
+    ss->operand = path ? strdup(path) : NULL;
+    if (path && !ss->operand) { perror("strdup"); exit(EXIT_FAILURE); }
+}
+
+static int checkpoint_write(struct ls_session *ss)
+{
+    struct ls_sink *sink = ss->sink;
+    long long offset = -1;
+    if (sink->fp)
+    {
+        fflush(sink->fp);
+        offset = lseek(fileno(sink->fp), 0, SEEK_CUR);
+    }
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", ss->checkpoint_path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) { report_errno(ss->o, tmp); return -1; }
+
+    fprintf(fp, "%s\noperand\t", CHECKPOINT_MAGIC);
+    snap_escape(fp, ss->operand ? ss->operand : ".");
+    fprintf(fp, "\nheaders %d framing %d\noffset %lld\ndirs %lld\n",
+            sink->headers, sink->framing, offset, ss->dirs_done);
+
+    fprintf(fp, "visited %zu\n", ss->visited_count);
+    for (size_t i = 0; i < ss->visited_cap; i++)
+        if (ss->visited[i].used)
+            fprintf(fp, "%llu %llu\n", (unsigned long long)ss->visited[i].dev,
+                    (unsigned long long)ss->visited[i].ino);
+
+    fprintf(fp, "frames %d\n", ss->nframes);
+    for (int i = 0; i < ss->nframes; i++)
+    {
+        fprintf(fp, "%d\t", ss->frames[i].depth);
+        snap_escape(fp, ss->frames[i].path);
+        fputc('\n', fp);
+    }
+
+    int rc = 0;
+    if (fflush(fp) == EOF || fsync(fileno(fp)) == -1)
+        rc = -1;
+    if (fclose(fp) == EOF)
+        rc = -1;
+    if (rc == 0 && rename(tmp, ss->checkpoint_path) == -1)
+        rc = -1;
+    if (rc == -1)
+    {
+        report_errno(ss->o, ss->checkpoint_path);
+        unlink(tmp);
+    }
+    return rc;
+}
+
+/* Called after every directory; a clock read unless the interval is up. */
+static void checkpoint_maybe(struct ls_session *ss)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - ss->checkpoint_last.tv_sec) +
+                     (now.tv_nsec - ss->checkpoint_last.tv_nsec) / 1e9;
+    if (elapsed < ss->checkpoint_interval)
+        return;
+    checkpoint_write(ss);
+    ss->checkpoint_last = now;
+}
+
+int ls_session_resume(struct ls_session *ss, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) { report_errno(ss->o, path); return -1; }
+
+    struct ls_sink *sink = ss->sink;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    int rc = -1;
+    long long offset = -1;
+    int headers = 0, framing = 0, nframes = 0;
+    size_t nvisited = 0;
+
+#define NEXT_LINE() ((n = getline(&line, &cap, fp)) > 0 && (line[n - 1] == '\n' ? (line[--n] = '\0', 1) : 1))
+    if (!NEXT_LINE() || strcmp(line, CHECKPOINT_MAGIC) != 0)
+        goto bad;
+    if (!NEXT_LINE() || strncmp(line, "operand\t", 8) != 0)
+        goto bad;
+    snap_unescape(line + 8);
+    set_operand(ss, line + 8);
+    struct stat rst;
+    if (fstatat(ss->base_fd, ss->operand, &rst, 0) == 0)
+        ss->root_dev = rst.st_dev;
+    if (!NEXT_LINE() || sscanf(line, "headers %d framing %d", &headers, &framing) != 2)
+        goto bad;
+    if (!NEXT_LINE() || sscanf(line, "offset %lld", &offset) != 1)
+        goto bad;
+    if (!NEXT_LINE() || sscanf(line, "dirs %lld", &ss->dirs_done) != 1)
+        goto bad;
+    if (!NEXT_LINE() || sscanf(line, "visited %zu", &nvisited) != 1)
+        goto bad;
+    for (size_t i = 0; i < nvisited; i++)
+    {
+        unsigned long long dev, ino;
+        if (!NEXT_LINE() || sscanf(line, "%llu %llu", &dev, &ino) != 2)
+            goto bad;
+        visited_insert(ss, (dev_t)dev, (ino_t)ino);
+    }
+    if (!NEXT_LINE() || sscanf(line, "frames %d", &nframes) != 1)
+        goto bad;
+    for (int i = 0; i < nframes; i++)
+    {
+        char *tab;
+        if (!NEXT_LINE() || !(tab = strchr(line, '\t')))
+            goto bad;
+        snap_unescape(tab + 1);
+        struct walk_frame *f = frame_new(ss);
+        if (!(f->path = strdup(tab + 1))) { perror("strdup"); exit(EXIT_FAILURE); }
+        char *slash = strrchr(f->path, '/');
+        f->name = slash ? slash + 1 : f->path;
+        f->have_st = 0;
+        f->depth = atoi(line);
+        f->du_parent = NULL;
+    }
+#undef NEXT_LINE
+
+    /* Drop whatever was written after the checkpoint, so nothing is listed twice. */
+    if (sink->fp && offset >= 0)
+    {
+        struct stat ost;
+        fflush(sink->fp);
+        if (fstat(fileno(sink->fp), &ost) == 0 && ost.st_size < offset)
+        {
+            fprintf(err_out(ss->o), "resume: output is shorter than at the checkpoint (opened with > instead of >>?)\n");
+            goto out;
+        }
+        if (ftruncate(fileno(sink->fp), offset) == -1 || lseek(fileno(sink->fp), offset, SEEK_SET) == -1)
+        {
+            report_errno(ss->o, "resume: output");
+            goto out;
+        }
+    }
+
+    sink->headers = headers;
+    sink->framing = framing;
+    sink->stop = 0;
+    walk_frames(ss, 0);
+    if (sink->ops->operand_end)
+        sink->ops->operand_end(sink, ss->operand);
+    sink->headers = 0;
+    sink->framing = 0;
+    ss->walk_finished = 1;
+    rc = 0;
+    goto out;
+
+bad:
+    fprintf(err_out(ss->o), "%s: not a usable checkpoint\n", path);
+out:
+    free(line);
+    fclose(fp);
+    return rc;
+}
+
+/* ────────────── do_ls ────────────── */
+/* On one CPU the stages only take turns, and the hand-overs cost more than they hide. */
+static int pipe_wanted(const struct ls_session *ss)
+{
+    const struct ls_options *o = ss->o;
+    return o->recursive && o->prefetch > 0 && !ss->checkpoint_path && !ss->throttle && !o->dir_cache &&
+           o->max_memory == 0 && o->timeout_dir_ms <= 0 && o->timeout_stat_ms <= 0 && !ss->sink->ops->enter &&
+           sysconf(_SC_NPROCESSORS_ONLN) > 1;
+}
+
+static void *pipe_walker(void *arg)
+{
+    struct walk_pipe *wp = arg;
+    struct ls_session *ss = wp->ss;
+
+    int base = ss->nframes;
+    list_dir(ss, wp->dir, wp->depth, NULL);
+    ss->dirs_done++;
+    walk_frames(ss, base);
+
+    /* Reads of frames dropped by a stop are collected before the reader goes. */
+    ring_put(&wp->requests, NULL);
+    struct prefetch *p;
+    while ((p = ring_get(&wp->reads)) != NULL)
+        prefetch_free(p);
+    for (int i = 0; i < wp->nready; i++)
+        prefetch_free(wp->ready[i]);
+    for (int i = 0; i < wp->ndropped; i++)
+        free(wp->dropped[i]);
+    ring_put(&wp->listings, NULL);
+    return NULL;
+}
+
+/* The -R walk of dir on the reader, walker and printer stages; the calling thread prints. */
+static int pipe_run(struct ls_session *ss, const char *dir, int depth)
+{
+    struct ls_sink *sink = ss->sink;
+    struct walk_pipe wp = { 0 };
+    wp.ss = ss;
+    wp.dir = dir;
+    wp.depth = depth;
+    wp.lookahead = ss->o->prefetch;
+    /* One more slot than can be outstanding, for the end marker. */
+    ring_init(&wp.requests, wp.lookahead + 1);
+    ring_init(&wp.reads, wp.lookahead + 1);
+    ring_init(&wp.listings, wp.lookahead + 1);
+    wp.ready = malloc(wp.lookahead * sizeof(struct prefetch *));
+    wp.dropped = malloc(wp.lookahead * sizeof(char *));
+    if (!wp.ready || !wp.dropped) { perror("malloc"); exit(EXIT_FAILURE); }
+
+    pthread_t reader, walker;
+    int rc = pthread_create(&reader, NULL, pipe_reader, &wp);
+    if (rc == 0)
+    {
+        ss->pipe = &wp;
+        if ((rc = pthread_create(&walker, NULL, pipe_walker, &wp)) != 0)
+        {
+            ss->pipe = NULL;
+            ring_put(&wp.requests, NULL);
+            pthread_join(reader, NULL);
+        }
+    }
+    if (rc != 0)
+    {
+        ring_destroy(&wp.requests);
+        ring_destroy(&wp.reads);
+        ring_destroy(&wp.listings);
+        free(wp.ready);
+        free(wp.dropped);
+        return -1;
+    }
+
+    struct listing *l;
+    while ((l = ring_get(&wp.listings)) != NULL)
+    {
+        if (!sink->stop)
+        {
+            names_prepare(ss->o, l->ents, l->count);
+            if (sink->ops->dir_begin)
+                sink->ops->dir_begin(sink, l->dir, l->depth);
+            if (sink->ops->dir_entries)
+                sink->ops->dir_entries(sink, l->dir, l->ents, l->count);
+            if (sink->ops->dir_end)
+                sink->ops->dir_end(sink, l->dir, l->depth);
+            if (sink->stop)
+                __atomic_store_n(&wp.stop, 1, __ATOMIC_RELAXED);
+        }
+        free(l->dir);
+        free(l->ents);
+        free(l->names);
+        free(l->contexts);
+        free(l);
+    }
+
+    pthread_join(walker, NULL);
+    pthread_join(reader, NULL);
+    ss->pipe = NULL;
+    ring_destroy(&wp.requests);
+    ring_destroy(&wp.reads);
+    ring_destroy(&wp.listings);
+    free(wp.ready);
+    free(wp.dropped);
+    return 0;
+}
+
+/* Returns -1 if a page could not be listed at all; other errors are reported as they come. */
+static int do_ls(struct ls_session *ss, const char *dir, int depth)
+{
+    const struct ls_options *o = ss->o;
+
+    if (depth == 0 && o->count)
+    {
+        do_count(ss, dir);
+        return 0;
+    }
+    if (depth == 0 && (o->offset > 0 || o->limit > 0 || o->cursor))
+        return do_ls_page(ss, dir);
+
+    if (pipe_wanted(ss) && pipe_run(ss, dir, depth) == 0)
+        return 0;
+
+    int base = ss->nframes;
+    list_dir(ss, dir, depth, NULL);
+    ss->dirs_done++;
+    if (ss->checkpoint_path)
+        checkpoint_maybe(ss);
+    walk_frames(ss, base);
+    return 0;
+}
+
+/* ────────────── Paging: --offset/--limit/--cursor ────────────── */
+static void emit_page(struct ls_session *ss, const char *dir, struct ls_entry *ents, int count)
+{
+    struct ls_sink *sink = ss->sink;
+    names_prepare(ss->o, ents, count);
+    if (sink->ops->dir_begin)
+        sink->ops->dir_begin(sink, dir, 0);
+    if (sink->ops->dir_entries)
+        sink->ops->dir_entries(sink, dir, ents, count);
+    if (sink->ops->dir_end)
+        sink->ops->dir_end(sink, dir, 0);
+}
+
+static void set_next_cursor(struct ls_session *ss, const char *text)
+{
+    free(ss->next_cursor);
+    ss->next_cursor = text ? cursor_encode(text) : NULL;
+}
+
+/* The text of a cursor for dir (dst) is "<kind>:<dev>:<ino>:" and then rest. */
+static void set_dir_cursor(struct ls_session *ss, int kind, const struct stat *dst, const char *rest)
+{
+    char *text = malloc(strlen(rest) + 48);
+    if (!text) { perror("malloc"); exit(EXIT_FAILURE); }
+    sprintf(text, "%c:%llu:%llu:%s", kind, (unsigned long long)dst->st_dev, (unsigned long long)dst->st_ino, rest);
+    set_next_cursor(ss, text);
+    free(text);
+}
+
+/*
+ * -U: entries stream in readdir order and a cursor resumes with seekdir(),
+ * so earlier pages are never read again. Only entries that survive the
+ * filters count towards --offset; they are stat'ed only if a predicate
+ * needs it. A page that fills up looks for one more matching entry, and
+ * the cursor points at it, so it never leads to an empty page.
+ */
+static void page_unsorted(struct ls_session *ss, const char *dir, DIR *dp, const struct stat *dst)
+{
+    const struct ls_options *o = ss->o;
+    const struct ls_compiled *c = ss->c;
+    struct ls_entry *ents = NULL;
+    int count = 0, capacity = 0;
+    long skip = o->offset;
+    int cut = 0;
+
+    if (c->cursor_kind == 'U')
+    {
+        seekdir(dp, c->cursor_pos);
+        skip = 0;
+    }
+
+    struct dirent *entry;
+    for (;;)
+    {
+        long pos = telldir(dp);
+        if (!(entry = readdir(dp)))
+            break;
+        const char *name = entry->d_name;
+        if (name[0] == '.' || name_excluded(c, name, strlen(name)) != 0)
+            continue;
+
+        struct stat st;
+        int have_st = 0;
+        if (c->pred_len > 0)
+        {
+            if (stat_entry(ss, dirfd(dp), name, &st) == -1) { report_errno(ss->o, "lstat"); continue; }
+            have_st = 1;
+            if (!pred_eval(c, &st))
+                continue;
+        }
+        if (skip > 0)
+        {
+            skip--;
+            continue;
+        }
+        if (o->limit > 0 && count == o->limit)
+        {
+            char rest[32];
+            snprintf(rest, sizeof(rest), "%ld", pos);
+            set_dir_cursor(ss, 'U', dst, rest);
+            cut = 1;
+            break;
+        }
+        if (!have_st && stat_entry(ss, dirfd(dp), name, &st) == -1) { report_errno(ss->o, "lstat"); continue; }
+
+        char *copy = strdup(name);
+        if (!copy) { perror("strdup"); exit(EXIT_FAILURE); }
+        append_entry(&ents, &count, &capacity, copy, &st, 0);
+    }
+    if (!cut)
+        set_next_cursor(ss, NULL);
+
+    struct name_arena ctx = { NULL, 0, 0 };
+    meta_fetch(ss, dirfd(dp), ents, count, &ctx);
+    emit_page(ss, dir, ents, count);
+    for (int i = 0; i < count; i++)
+        free((char *)ents[i].name);
+    free(ents);
+    free(ctx.buf);
+}
+
+/* Max-heap on name: the root is the entry a smaller name would evict. */
+struct page_slot
+{
+    char *name;
+    struct stat st;
+    int have_st;
+};
+
+static void heap_sift_up(struct page_slot *h, int i)
+{
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (strcmp(h[parent].name, h[i].name) >= 0) break;
+        struct page_slot t = h[parent]; h[parent] = h[i]; h[i] = t;
+        i = parent;
+    }
+}
+
+static void heap_sift_down(struct page_slot *h, int n, int i)
+{
+    for (;;)
+    {
+        int l = 2 * i + 1, r = l + 1, big = i;
+        if (l < n && strcmp(h[l].name, h[big].name) > 0) big = l;
+        if (r < n && strcmp(h[r].name, h[big].name) > 0) big = r;
+        if (big == i) break;
+        struct page_slot t = h[big]; h[big] = h[i]; h[i] = t;
+        i = big;
+    }
+}
+
+static int cmp_page_slot(const void *a, const void *b)
+{
+    return strcmp(((const struct page_slot *)a)->name, ((const struct page_slot *)b)->name);
+}
+
+/*
+ * Sorted paging keeps only the first offset + limit names (limit with a
+ * cursor) in a bounded heap, so a page of a 10M-entry directory costs
+ * O(K) memory and O(N log K) comparisons. Names that cannot make the page
+ * are rejected before any stat, except as far as it takes to find one that
+ * matches the predicates: only then is there a next page.
+ */
+static void page_sorted(struct ls_session *ss, const char *dir, DIR *dp, const struct stat *dst)
+{
+    const struct ls_options *o = ss->o;
+    const struct ls_compiled *c = ss->c;
+    long skip = c->cursor_kind == 'S' ? 0 : o->offset;
+    long k = o->limit > 0 ? skip + o->limit : 0;    /* 0: unbounded */
+    struct page_slot *heap = NULL;
+    long n = 0, capacity = 0;
+    int more = 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL)
+    {
+        const char *name = entry->d_name;
+        if (name[0] == '.' || name_excluded(c, name, strlen(name)) != 0)
+            continue;
+        if (c->cursor_kind == 'S' && strcmp(name, c->cursor_name) <= 0)
+            continue;
+
+        int full = k > 0 && n == k;
+        if (full && strcmp(name, heap[0].name) >= 0)
+        {
+            struct stat st;
+            if (!more && (c->pred_len == 0 || (stat_entry(ss, dirfd(dp), name, &st) == 0 && pred_eval(c, &st))))
+                more = 1;
+            continue;
+        }
+
+        struct page_slot slot = { NULL, { 0 }, 0 };
+        if (c->pred_len > 0)
+        {
+            if (stat_entry(ss, dirfd(dp), name, &slot.st) == -1) { report_errno(ss->o, "lstat"); continue; }
+            if (!pred_eval(c, &slot.st))
+                continue;
+            slot.have_st = 1;
+        }
+        if (!(slot.name = strdup(name))) { perror("strdup"); exit(EXIT_FAILURE); }
+
+        if (full)
+        {
+            free(heap[0].name);
+            heap[0] = slot;
+            heap_sift_down(heap, n, 0);
+            more = 1;
+            continue;
+        }
+        if (n == capacity)
+        {
+            capacity = capacity == 0 ? (k > 0 && k < 1024 ? k : 1024) : capacity * 2;
+            if (k > 0 && capacity > k) capacity = k;
+            struct page_slot *tmp = realloc(heap, capacity * sizeof(struct page_slot));
+            if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+            heap = tmp;
+        }
+        heap[n] = slot;
+        heap_sift_up(heap, n++);
+    }
+
+    qsort(heap, n, sizeof(struct page_slot), cmp_page_slot);
+
+    long first = skip < n ? skip : n;
+    struct ls_entry *ents = malloc((n - first > 0 ? n - first : 1) * sizeof(struct ls_entry));
+    if (!ents) { perror("malloc"); exit(EXIT_FAILURE); }
+    int count = 0;
+    for (long i = first; i < n; i++)
+    {
+        if (!heap[i].have_st && stat_entry(ss, dirfd(dp), heap[i].name, &heap[i].st) == -1)
+        {
+            report_errno(ss->o, "lstat");
+            continue;
+        }
+        ents[count].name = heap[i].name;
+        ents[count].st = heap[i].st;
+        ents[count].flags = 0;
+        ents[count].context = NULL;
+        count++;
+    }
+
+    if (more && n > first)
+        set_dir_cursor(ss, 'S', dst, heap[n - 1].name);
+    else
+        set_next_cursor(ss, NULL);
+
+    struct name_arena ctx = { NULL, 0, 0 };
+    meta_fetch(ss, dirfd(dp), ents, count, &ctx);
+    emit_page(ss, dir, ents, count);
+    for (long i = 0; i < n; i++)
+        free(heap[i].name);
+    free(heap);
+    free(ents);
+    free(ctx.buf);
+}
+
+static int do_ls_page(struct ls_session *ss, const char *dir)
+{
+    int dfd = open_dir(ss, dir);
+    DIR *dp = dfd == -1 ? NULL : fdopendir(dfd);
+    if (!dp)
+    {
+        report_errno(ss->o, "opendir");
+        if (dfd != -1) close(dfd);
+        return -1;
+    }
+
+    /* A cursor is only good for the directory it was handed out for. */
+    const struct ls_compiled *c = ss->c;
+    struct stat dst;
+    int rc = -1;
+    if (fstat(dfd, &dst) == -1)
+        report_errno(ss->o, "fstat");
+    else if (c->cursor_kind && (c->cursor_dev != (unsigned long long)dst.st_dev ||
+                                c->cursor_ino != (unsigned long long)dst.st_ino))
+        fprintf(err_out(ss->o), "%s: cursor belongs to another directory\n", dir);
+    else
+    {
+        if (ss->o->unsorted)
+            page_unsorted(ss, dir, dp, &dst);
+        else
+            page_sorted(ss, dir, dp, &dst);
+        rc = 0;
+    }
+    closedir(dp);
+    return rc;
+}
+
+const char *ls_session_next_cursor(const struct ls_session *ss)
+{
+    return ss->next_cursor;
+}
+
+/* ────────────── --count: getdents64() without names, stats or sorting ────────────── */
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct count_queue
+{
+    struct ls_session *ss;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char **dirs;                /* stack of directories still to read */
+    int ndirs, capacity;
+    int busy;                   /* workers reading a directory right now */
+};
+
+static void count_push(struct count_queue *q, char *path)
+{
+    if (q->ndirs == q->capacity)
+    {
+        q->capacity = q->capacity == 0 ? 64 : q->capacity * 2;
+        char **tmp = realloc(q->dirs, q->capacity * sizeof(char *));
+        if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+        q->dirs = tmp;
+    }
+    q->dirs[q->ndirs++] = path;
+}
+
+static void count_record(struct ls_session *ss, const char *path, long entries)
+{
+    pthread_mutex_lock(&ss->count_lock);
+    if (ss->ncounts == ss->counts_capacity)
+    {
+        ss->counts_capacity = ss->counts_capacity == 0 ? 64 : ss->counts_capacity * 2;
+        struct ls_count *tmp = realloc(ss->counts, ss->counts_capacity * sizeof(struct ls_count));
+        if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+        ss->counts = tmp;
+    }
+    char *copy = strdup(path);
+    if (!copy) { perror("strdup"); exit(EXIT_FAILURE); }
+    ss->counts[ss->ncounts++] = (struct ls_count){ copy, entries };
+    pthread_mutex_unlock(&ss->count_lock);
+}
+
+/*
+ * Counts the entries of one directory that the listing would show. With q
+ * set, subdirectories (minus pruned ones) are queued for the workers.
+ */
+static void count_dir(struct ls_session *ss, struct count_queue *q, const char *dir)
+{
+    const struct ls_compiled *c = ss->c;
+    int fd = open_dir(ss, dir);
+    if (fd == -1)
+    {
+        report_errno(ss->o, dir);
+        return;
+    }
+
+    /* Below the operand, stay on its filesystem (--one-file-system) or off pseudo ones (skip_pseudo). */
+    struct stat dst;
+    const struct fs_type *fs = NULL;
+    if (fstat(fd, &dst) == 0)
+    {
+        fs = fs_profile_get(ss, fd, dst.st_dev);
+        if (dst.st_dev != ss->root_dev && ss->o->one_file_system)
+        {
+            close(fd);
+            return;
+        }
+        if (dst.st_dev != ss->root_dev && ss->o->skip_pseudo && fs->pseudo)
+        {
+            fprintf(err_out(ss->o), "%s: not entering %s filesystem\n", dir, fs->name);
+            close(fd);
+            return;
+        }
+    }
+
+    char buf[65536] __attribute__((aligned(8)));
+    long entries = 0;
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+    {
+        for (long off = 0; off < n; )
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+            if (d->d_name[0] == '.')
+                continue;
+
+            size_t len = strlen(d->d_name);
+            int verdict = name_excluded(c, d->d_name, len);
+            if (verdict > 0)
+                continue;
+            if (verdict == 0)
+                entries++;
+
+            if (!q)
+                continue;
+            unsigned char type = fs && !fs->trust_dtype ? DT_UNKNOWN : d->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                struct stat st;
+                if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+                    type = DT_DIR;
+            }
+            if (type != DT_DIR || name_pruned(c, d->d_name))
+                continue;
+
+            size_t dlen = strlen(dir);
+            char *path = malloc(dlen + len + 2);
+            if (!path) { perror("malloc"); exit(EXIT_FAILURE); }
+            memcpy(path, dir, dlen);
+            path[dlen] = '/';
+            memcpy(path + dlen + 1, d->d_name, len + 1);
+
+            pthread_mutex_lock(&q->lock);
+            count_push(q, path);
+            pthread_cond_signal(&q->cond);
+            pthread_mutex_unlock(&q->lock);
+        }
+    }
+    if (n == -1)
+        report_errno(ss->o, dir);
+    close(fd);
+
+    count_record(ss, dir, entries);
+}
+
+static void *count_worker(void *arg)
+{
+    struct count_queue *q = arg;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;)
+    {
+        while (q->ndirs == 0 && q->busy > 0)
+            pthread_cond_wait(&q->cond, &q->lock);
+        if (q->ndirs == 0)
+            break;
+
+        char *dir = q->dirs[--q->ndirs];
+        q->busy++;
+        pthread_mutex_unlock(&q->lock);
+
+        count_dir(q->ss, q, dir);
+        free(dir);
+
+        pthread_mutex_lock(&q->lock);
+        /* The last busy worker finding nothing queued ends the walk for everyone. */
+        if (--q->busy == 0 && q->ndirs == 0)
+            pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+static void do_count(struct ls_session *ss, const char *dir)
+{
+    struct stat st;
+    if (fstatat(ss->base_fd, dir, &st, 0) == 0)
+        ss->root_dev = st.st_dev;
+
+    if (!ss->o->recursive)
+    {
+        count_dir(ss, NULL, dir);
+        return;
+    }
+
+    struct count_queue q = { .ss = ss };
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+    char *root = strdup(dir);
+    if (!root) { perror("strdup"); exit(EXIT_FAILURE); }
+    count_push(&q, root);
+
+    int nthreads = ss->o->threads > 0 ? ss->o->threads : 1;
+    pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+    if (!tids) { perror("malloc"); exit(EXIT_FAILURE); }
+    int started = 0;
+    for (int i = 1; i < nthreads; i++)
+        if (pthread_create(&tids[started], NULL, count_worker, &q) == 0)
+            started++;
+    count_worker(&q);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    free(tids);
+    free(q.dirs);
+    pthread_cond_destroy(&q.cond);
+    pthread_mutex_destroy(&q.lock);
+}
+
+static int cmp_count_path(const void *a, const void *b)
+{
+    return cmp_walk_path(((const struct ls_count *)a)->path, ((const struct ls_count *)b)->path);
+}
+
+/* ────────────── Sessions ────────────── */
+struct ls_session *ls_session_new(const struct ls_options *o, struct ls_sink *sink)
+{
+    if (!o->compiled || !o->compiled->prepared)
+    {
+        fprintf(err_out(o), "ls_session_new: options not prepared\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct ls_session *ss = calloc(1, sizeof(struct ls_session));
+    if (!ss) { perror("calloc"); return NULL; }
+    ss->o = o;
+    ss->c = o->compiled;
+    ss->sink = sink;
+    ss->base_fd = AT_FDCWD;
+    if (o->max_ops > 0 || o->max_latency_ms > 0)
+        ss->throttle = throttle_new(o);
+    pthread_mutex_init(&ss->count_lock, NULL);
+    pthread_mutex_init(&ss->fs_lock, NULL);
+    sink->opts = o;
+    sink->base_fd = AT_FDCWD;
+    return ss;
+}
+
+void ls_session_set_base(struct ls_session *ss, int dirfd)
+{
+    ss->base_fd = dirfd;
+    ss->sink->base_fd = dirfd;
+}
+
+void ls_session_set_headers(struct ls_session *ss, int always)
+{
+    ss->always_headers = always;
+}
+
+int ls_session_list(struct ls_session *ss, const char *path)
+{
+    /* Seed the visited set with the operand so links back to it are skipped. */
+    struct stat st;
+    if (ss->o->recursive && (ss->o->follow_links || ss->o->same_dir_once) && fstatat(ss->base_fd, path, &st, 0) == 0)
+        visited_insert(ss, st.st_dev, st.st_ino);
+
+    ss->sink->stop = 0;
+    set_operand(ss, path);
+    int rc = do_ls(ss, path, 0);
+    ss->walk_finished = 1;
+    return rc;
+}
+
+static int cmp_du_size(const void *a, const void *b)
+{
+    const struct du_node *na = *(const struct du_node **)a;
+    const struct du_node *nb = *(const struct du_node **)b;
+    if (na->blocks != nb->blocks) return na->blocks < nb->blocks ? 1 : -1;
+    if (na->bytes != nb->bytes) return na->bytes < nb->bytes ? 1 : -1;
+    return strcmp(na->path, nb->path);
+}
+
+void ls_session_finish(struct ls_session *ss)
+{
+    if (!ss) return;
+
+    if (ss->du_count > 0 && ss->sink->ops->du_totals)
+    {
+        qsort(ss->du_nodes, ss->du_count, sizeof(struct du_node *), cmp_du_size);
+
+        struct ls_du_total *totals = malloc(ss->du_count * sizeof(struct ls_du_total));
+        if (!totals) { perror("malloc"); exit(EXIT_FAILURE); }
+        for (int i = 0; i < ss->du_count; i++)
+        {
+            struct du_node *n = ss->du_nodes[i];
+            totals[i] = (struct ls_du_total){ n->path, n->blocks, n->bytes, n->files, n->dirs };
+        }
+        ss->sink->ops->du_totals(ss->sink, totals, ss->du_count);
+        free(totals);
+    }
+
+    if (ss->ncounts > 0 && ss->sink->ops->counts)
+    {
+        qsort(ss->counts, ss->ncounts, sizeof(struct ls_count), cmp_count_path);
+        ss->sink->ops->counts(ss->sink, ss->counts, ss->ncounts);
+    }
+    for (int i = 0; i < ss->ncounts; i++)
+        free((char *)ss->counts[i].path);
+    free(ss->counts);
+    pthread_mutex_destroy(&ss->count_lock);
+
+    if (ss->npartial > 0)
+    {
+        fprintf(err_out(ss->o), "timeouts: %ld stat%s, %d director%s unread; %d director%s incomplete:\n",
+                ss->stat_timeouts, ss->stat_timeouts == 1 ? "" : "s",
+                ss->dir_timeouts, ss->dir_timeouts == 1 ? "y" : "ies",
+                ss->npartial, ss->npartial == 1 ? "y" : "ies");
+        for (int i = 0; i < ss->npartial; i++)
+            fprintf(err_out(ss->o), "  %s\n", ss->partial[i]);
+    }
+    for (int i = 0; i < ss->npartial; i++)
+        free(ss->partial[i]);
+    free(ss->partial);
+
+    if (ss->o->debug_columns)
+    {
+        const struct ls_options *o = ss->o;
+        if (o->show_inode || o->show_blocks)
+            fprintf(err_out(ss->o), "columns: %s%s%s: no extra calls (part of the stat)\n", o->show_inode ? "inode" : "",
+                    o->show_inode && o->show_blocks ? ", " : "", o->show_blocks ? "blocks" : "");
+        static const char *const names[2] = { "acl", "context" };
+        const int shown[2] = { o->show_acl, o->show_context };
+        for (int k = 0; k < 2; k++)
+            if (shown[k])
+                fprintf(err_out(ss->o), "columns: %s: %ld getxattr() for %ld entries, %.3f ms (%.0f ns per entry)\n",
+                        names[k], ss->meta_calls[k], ss->meta_entries, ss->meta_ns[k] / 1e6,
+                        ss->meta_entries > 0 ? (double)ss->meta_ns[k] / ss->meta_entries : 0.0);
+        if (ss->meta_skipped > 0)
+            fprintf(err_out(ss->o), "columns: %ld entries skipped on %d filesystem%s without extended attributes\n",
+                    ss->meta_skipped, ss->nno_xattr, ss->nno_xattr == 1 ? "" : "s");
+    }
+    free(ss->no_xattr);
+    free(ss->profiles);
+    pthread_mutex_destroy(&ss->fs_lock);
+
+    for (int i = 0; i < ss->du_count; i++)
+    {
+        free(ss->du_nodes[i]->path);
+        free(ss->du_nodes[i]);
+    }
+    free(ss->du_nodes);
+    free(ss->visited);
+    free(ss->next_cursor);
+    free(ss->frames);
+    free(ss->operand);
+    throttle_free(ss->throttle);
+    /* The walk is complete: a checkpoint would only resume into nothing. */
+    if (ss->checkpoint_path && ss->walk_finished)
+        unlink(ss->checkpoint_path);
+    free(ss);
+}
+
+/* ────────────── Operands: files first, then directories ────────────── */
+struct operand
+{
+    const char *path;
+    struct stat st;
+};
+
+static int cmp_operand(const void *a, const void *b)
+{
+    return strcmp(((const struct operand *)a)->path, ((const struct operand *)b)->path);
+}
+
+/*
+ * As in GNU ls, a symlink operand naming a directory is listed as that
+ * directory unless -l asks for the link itself.
+ */
+static int stat_operand(const struct ls_session *ss, const char *path, struct stat *st)
+{
+    if (stat_entry(ss, ss->base_fd, path, st) == -1)
+        return -1;
+
+    struct stat target;
+    if (S_ISLNK(st->st_mode) && ss->o->display != LS_DISPLAY_LONG &&
+        fstatat(ss->base_fd, path, &target, 0) == 0 && S_ISDIR(target.st_mode))
+        *st = target;
+    return 0;
+}
+
+int ls_session_list_operands(struct ls_session *ss, char *const *paths, int n)
+{
+    struct operand *ops = malloc((n > 0 ? n : 1) * sizeof(struct operand));
+    if (!ops) { perror("malloc"); return -1; }
+
+    /* One stat per operand, all before any output. */
+    int rc = 0, nops = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (stat_operand(ss, paths[i], &ops[nops].st) == -1)
+        {
+            fprintf(err_out(ss->o), "cannot access '%s': %s\n", paths[i], strerror(errno));
+            rc = -1;
+            continue;
+        }
+        ops[nops++].path = paths[i];
+    }
+    qsort(ops, nops, sizeof(struct operand), cmp_operand);
+
+    /* Non-directories form one block with one width computation. */
+    struct ls_sink *sink = ss->sink;
+    struct ls_entry *files = malloc((nops > 0 ? nops : 1) * sizeof(struct ls_entry));
+    if (!files) { perror("malloc"); free(ops); return -1; }
+    int nfiles = 0;
+    for (int i = 0; i < nops; i++)
+        if (!S_ISDIR(ops[i].st.st_mode))
+        {
+            files[nfiles].name = ops[i].path;
+            files[nfiles].st = ops[i].st;
+            files[nfiles].flags = 0;
+            files[nfiles].context = NULL;
+            nfiles++;
+        }
+
+    sink->headers = ss->always_headers || ss->o->recursive || n > 1;
+    sink->framing = 1;
+    sink->stop = 0;
+    struct name_arena ctx = { NULL, 0, 0 };
+    if (nfiles > 0)
+    {
+        meta_fetch(ss, ss->base_fd, files, nfiles, &ctx);
+        names_prepare(ss->o, files, nfiles);
+        if (sink->ops->dir_begin)
+            sink->ops->dir_begin(sink, NULL, 0);
+        if (sink->ops->dir_entries)
+            sink->ops->dir_entries(sink, NULL, files, nfiles);
+        if (sink->ops->dir_end)
+            sink->ops->dir_end(sink, NULL, 0);
+        if (sink->ops->operand_end)
+            sink->ops->operand_end(sink, NULL);
+    }
+    free(files);
+    free(ctx.buf);
+
+    for (int i = 0; i < nops && !sink->stop; i++)
+    {
+        if (!S_ISDIR(ops[i].st.st_mode))
+            continue;
+        if (ss->o->recursive && (ss->o->follow_links || ss->o->same_dir_once))
+            visited_insert(ss, ops[i].st.st_dev, ops[i].st.st_ino);
+        set_operand(ss, ops[i].path);
+        if (do_ls(ss, ops[i].path, 0) == -1)
+            rc = -1;
+        if (sink->ops->operand_end)
+            sink->ops->operand_end(sink, ops[i].path);
+    }
+
+    sink->headers = 0;
+    sink->framing = 0;
+    ss->walk_finished = 1;
+    free(ops);
+    return rc;
+}
+
+int ls_list(const struct ls_options *o, const char *path, struct ls_sink *sink)
+{
+    struct ls_session *ss = ls_session_new(o, sink);
+    if (!ss) return -1;
+    int rc = ls_session_list(ss, path);
+    ls_session_finish(ss);
+    return rc;
+}
+
+/* ────────────── Name filter matching ────────────── */
+static int pattern_match(const struct name_pattern *np, const char *name, size_t len)
+{
+    switch (np->kind)
+    {
+        case PAT_EXACT:
+            return len == np->litlen && memcmp(name, np->lit, len) == 0;
+        case PAT_PREFIX:
+            return len >= np->litlen && memcmp(name, np->lit, np->litlen) == 0;
+        case PAT_SUFFIX:
+            return len >= np->litlen && memcmp(name + len - np->litlen, np->lit, np->litlen) == 0;
+        case PAT_REGEX:
+            return regexec(&np->re, name, 0, NULL, 0) == 0;
+        case PAT_GLOB:
+        default:
+            return fnmatch(np->text, name, 0) == 0;
+    }
+}
+
+static int list_match(const struct ls_compiled *c, int list, const char *name, size_t len)
+{
+    const struct pattern_list *pl = &c->filters[list];
+    for (int i = 0; i < pl->count; i++)
+        if (pattern_match(&pl->pats[i], name, len))
+            return 1;
+    return 0;
+}
+
+/*
+ * Returns 0 to keep the name, 1 if --exclude drops it, and -1 if it only
+ * failed --include (the caller may still keep directories).
+ */
+static int name_excluded(const struct ls_compiled *c, const char *name, size_t len)
+{
+    if (list_match(c, LS_EXCLUDE, name, len))
+        return 1;
+    if (c->filters[LS_INCLUDE].count > 0 && !list_match(c, LS_INCLUDE, name, len))
+        return -1;
+    return 0;
+}
+
+/* --prune: the directory is listed but -R does not descend into it. */
+static int name_pruned(const struct ls_compiled *c, const char *name)
+{
+    return c->filters[LS_PRUNE].count > 0 && list_match(c, LS_PRUNE, name, strlen(name));
+}
+
+/* ────────────── Predicate evaluation ────────────── */
+static int pred_test(const struct pred_insn *in, const struct stat *st)
+{
+    switch (in->op)
+    {
+        case LS_PRED_SIZE:
+        {
+            /* Rounded up to whole units, as find(1) does. */
+            long long units = (st->st_size + in->unit - 1) / in->unit;
+            return in->cmp > 0 ? units > in->num : in->cmp < 0 ? units < in->num : units == in->num;
+        }
+        case LS_PRED_NEWER:
+            return st->st_mtim.tv_sec > in->ts.tv_sec ||
+                   (st->st_mtim.tv_sec == in->ts.tv_sec && st->st_mtim.tv_nsec > in->ts.tv_nsec);
+        case LS_PRED_TYPE:
+            return (st->st_mode & S_IFMT) == in->mode;
+        case LS_PRED_PERM:
+        {
+            mode_t bits = st->st_mode & 07777;
+            if (in->cmp == '-') return (bits & in->mode) == in->mode;
+            if (in->cmp == '/') return in->mode == 0 || (bits & in->mode) != 0;
+            return bits == in->mode;
+        }
+        default:
+            return 0;
+    }
+}
+
+/* Run the postfix program against one stat result. */
+static int pred_eval(const struct ls_compiled *c, const struct stat *st)
+{
+    unsigned char stack[64];
+    unsigned char *heap = NULL;
+    unsigned char *sp = stack;
+    if (c->pred_len > (int)sizeof(stack))
+    {
+        heap = malloc(c->pred_len);
+        if (!heap) { perror("malloc"); exit(EXIT_FAILURE); }
+        sp = heap;
+    }
+
+    int top = 0;
+    for (int i = 0; i < c->pred_len; i++)
+    {
+        const struct pred_insn *in = &c->pred_prog[i];
+        switch (in->op)
+        {
+            case LS_PRED_AND: top--; sp[top - 1] = sp[top - 1] && sp[top]; break;
+            case LS_PRED_OR:  top--; sp[top - 1] = sp[top - 1] || sp[top]; break;
+            case LS_PRED_NOT: sp[top - 1] = !sp[top - 1]; break;
+            default:          sp[top++] = (unsigned char)pred_test(in, st); break;
+        }
+    }
+
+    int result = sp[0];
+    free(heap);
+    return result;
+}
+
+/* ────────────── du_add: charge a directory's entries to it and its ancestors ────────────── */
+static void du_add(struct ls_session *ss, const struct ls_entry *ents, int count)
+{
+    long long blocks = 0, bytes = 0;
+    long files = 0, dirs = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        blocks += ents[i].st.st_blocks;
+        bytes += ents[i].st.st_size;
+        if (S_ISDIR(ents[i].st.st_mode)) dirs++;
+        else files++;
+    }
+
+    for (struct du_node *n = ss->du_current; n; n = n->parent)
+    {
+        n->blocks += blocks;
+        n->bytes += bytes;
+        n->files += files;
+        n->dirs += dirs;
+    }
+}
+
+/* ────────────── Sink plumbing ────────────── */
+struct ls_sink *ls_sink_new(const struct ls_sink_ops *ops, void *arg)
+{
+    struct ls_sink *s = calloc(1, sizeof(struct ls_sink));
+    if (!s) { perror("calloc"); return NULL; }
+    s->ops = ops;
+    s->arg = arg;
+    return s;
+}
+
+void *ls_sink_arg(const struct ls_sink *s)
+{
+    return s->arg;
+}
+
+const struct ls_options *ls_sink_options(const struct ls_sink *s)
+{
+    return s->opts;
+}
+
+void ls_sink_free(struct ls_sink *s)
+{
+    if (!s) return;
+    if (s->ops->destroy)
+        s->ops->destroy(s);
+    if (s->own_fp && s->fp)
+        fclose(s->fp);
+    free(s);
+}
+
+/* ────────────── Text sink: column, across, long and one-per-line layouts ────────────── */
+static void text_dir_begin(struct ls_sink *s, const char *path, int depth)
+{
+    if (depth > 0)
+        fprintf(s->fp, "\n%s:\n", path);
+    else if (path && s->headers)
+        fprintf(s->fp, "%s:\n", path);
+}
+
+/* A spilled directory under -x may end in the middle of a line. */
+static void text_dir_end(struct ls_sink *s, const char *path, int depth)
+{
+    (void)path;
+    (void)depth;
+    if (s->chunked && s->totals.x != 0)
+        fputc('\n', s->fp);
+}
+
+static void text_operand_end(struct ls_sink *s, const char *path)
+{
+    (void)path;
+    if (s->framing)
+        fputc('\n', s->fp);
+}
+
+static void text_dir_entries(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count)
+{
+    if (count == 0)
+        return;
+
+    if (s->print_opts != s->opts)
+        text_printer_pick(s);
+    s->print(s, dir, ents, count);
+}
+
+static void text_du_totals(struct ls_sink *s, const struct ls_du_total *t, int count)
+{
+    FILE *fp = s->fp;
+    int w_blocks = 5, w_bytes = 5, w_files = 5, w_dirs = 4;
+    for (int i = 0; i < count; i++)
+    {
+        char buf[64];
+        int n = snprintf(buf, sizeof(buf), "%lld", t[i].blocks / 2);
+        if (n > w_blocks) w_blocks = n;
+        n = snprintf(buf, sizeof(buf), "%lld", t[i].bytes);
+        if (n > w_bytes) w_bytes = n;
+        n = snprintf(buf, sizeof(buf), "%ld", t[i].files);
+        if (n > w_files) w_files = n;
+        n = snprintf(buf, sizeof(buf), "%ld", t[i].dirs);
+        if (n > w_dirs) w_dirs = n;
+    }
+
+    fprintf(fp, "subtree totals:\n");
+    fprintf(fp, "%*s %*s %*s %*s %s\n", w_blocks, "total", w_bytes, "bytes",
+            w_files, "files", w_dirs, "dirs", "directory");
+    for (int i = 0; i < count; i++)
+        fprintf(fp, "%*lld %*lld %*ld %*ld %s\n", w_blocks, t[i].blocks / 2, w_bytes, t[i].bytes,
+                w_files, t[i].files, w_dirs, t[i].dirs, t[i].path);
+}
+
+static void text_counts(struct ls_sink *s, const struct ls_count *counts, int n)
+{
+    long total = 0;
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(s->fp, "%ld %s\n", counts[i].entries, counts[i].path);
+        total += counts[i].entries;
+    }
+    if (n > 1)
+        fprintf(s->fp, "%ld total\n", total);
+}
+
+static const struct ls_sink_ops text_ops = {
+    .dir_begin = text_dir_begin,
+    .dir_entries = text_dir_entries,
+    .dir_end = text_dir_end,
+    .operand_end = text_operand_end,
+    .du_totals = text_du_totals,
+    .counts = text_counts,
+};
+
+struct ls_sink *ls_sink_text(FILE *fp)
+{
+    struct ls_sink *s = ls_sink_new(&text_ops, NULL);
+    if (!s) return NULL;
+    s->fp = fp;
+    s->measure = text_measure;
+    return s;
+}
+
+/* ────────────── Buffer sink: text layout into caller memory ────────────── */
+struct ls_sink *ls_sink_buffer(char *buf, size_t size)
+{
+    if (!buf || size == 0) { errno = EINVAL; return NULL; }
+
+    buf[0] = '\0';
+    FILE *fp = fmemopen(buf, size, "w");
+    if (!fp) { perror("fmemopen"); return NULL; }
+
+    struct ls_sink *s = ls_sink_new(&text_ops, NULL);
+    if (!s) { fclose(fp); return NULL; }
+    s->fp = fp;
+    s->own_fp = 1;
+    s->measure = text_measure;
+    return s;
+}
+
+size_t ls_sink_buffer_length(struct ls_sink *s)
+{
+    if (!s->fp) return 0;
+    fflush(s->fp);
+    long pos = ftell(s->fp);
+    return pos < 0 ? 0 : (size_t)pos;
+}
+
+/* ────────────── NDJSON sink: one object per entry ────────────── */
+/* Length of the well-formed UTF-8 sequence at p (RFC 3629: no overlongs, surrogates or > U+10FFFF), 0 if none. */
+static int utf8_seq(const unsigned char *p)
+{
+    if (p[0] < 0x80) return 1;
+    if (p[0] < 0xc2 || p[0] > 0xf4) return 0;
+    int n = p[0] < 0xe0 ? 2 : p[0] < 0xf0 ? 3 : 4;
+    unsigned char lo = 0x80, hi = 0xbf;
+    if (p[0] == 0xe0) lo = 0xa0;
+    else if (p[0] == 0xed) hi = 0x9f;
+    else if (p[0] == 0xf0) lo = 0x90;
+    else if (p[0] == 0xf4) hi = 0x8f;
+    if (p[1] < lo || p[1] > hi) return 0;
+    for (int i = 2; i < n; i++)
+        if ((p[i] & 0xc0) != 0x80) return 0;
+    return n;
+}
+
+/*
+ * Names are bytes, JSON strings are UTF-8: a byte that is not part of a
+ * well-formed sequence is written as U+FFFD. Returns 1 if that happened.
+ */
+static int json_string(FILE *fp, const char *str)
+{
+    int lossy = 0;
+    fputc('"', fp);
+    for (const unsigned char *p = (const unsigned char *)str; *p; )
+    {
+        int n = utf8_seq(p);
+        if (n == 0) { fputs("\\ufffd", fp); lossy = 1; p++; continue; }
+        if (*p == '"' || *p == '\\') fprintf(fp, "\\%c", *p);
+        else if (*p < 0x20) fprintf(fp, "\\u%04x", *p);
+        else fwrite(p, 1, n, fp);
+        p += n;
+    }
+    fputc('"', fp);
+    return lossy;
+}
+
+/* "key":"str", plus "key_bytes":"<hex>" with the exact bytes when str is not valid UTF-8. */
+static void json_field(FILE *fp, const char *key, const char *str)
+{
+    fprintf(fp, "\"%s\":", key);
+    if (!json_string(fp, str))
+        return;
+    fprintf(fp, ",\"%s_bytes\":\"", key);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++)
+        fprintf(fp, "%02x", *p);
+    fputc('"', fp);
+}
+
+static const char *type_name(mode_t mode)
+{
+    return S_ISDIR(mode)  ? "dir" :
+           S_ISLNK(mode)  ? "link" :
+           S_ISREG(mode)  ? "file" :
+           S_ISCHR(mode)  ? "char" :
+           S_ISBLK(mode)  ? "block" :
+           S_ISFIFO(mode) ? "fifo" :
+           S_ISSOCK(mode) ? "socket" : "unknown";
+}
+
+static void json_dir_entries(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count)
+{
+    FILE *fp = s->fp;
+    for (int i = 0; i < count; i++)
+    {
+        const struct stat *st = &ents[i].st;
+        fputc('{', fp);
+        if (dir) json_field(fp, "dir", dir);
+        else fputs("\"dir\":null", fp);
+        fputc(',', fp);
+        json_field(fp, "name", ents[i].name);
+        if (ents[i].flags & LS_ENTRY_TIMEOUT)
+        {
+            fputs(",\"error\":\"timeout\"}\n", fp);
+            continue;
+        }
+        fprintf(fp, ",\"type\":\"%s\",\"mode\":\"%04o\",\"nlink\":%lu,\"uid\":%u,\"gid\":%u,"
+                    "\"size\":%lld,\"blocks\":%lld,\"ino\":%llu,\"mtime\":%lld.%09ld",
+                type_name(st->st_mode), (unsigned)(st->st_mode & 07777), (unsigned long)st->st_nlink,
+                (unsigned)st->st_uid, (unsigned)st->st_gid, (long long)st->st_size,
+                (long long)st->st_blocks, (unsigned long long)st->st_ino,
+                (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+        if (ents[i].flags & LS_ENTRY_ACL)
+            fputs(",\"acl\":true", fp);
+        if (ents[i].context)
+        {
+            fputc(',', fp);
+            json_field(fp, "context", ents[i].context);
+        }
+        fputs("}\n", fp);
+    }
+}
+
+static void json_du_totals(struct ls_sink *s, const struct ls_du_total *t, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        fputc('{', s->fp);
+        json_field(s->fp, "du", t[i].path);
+        fprintf(s->fp, ",\"blocks\":%lld,\"bytes\":%lld,\"files\":%ld,\"dirs\":%ld}\n",
+                t[i].blocks, t[i].bytes, t[i].files, t[i].dirs);
+    }
+}
+
+static void json_counts(struct ls_sink *s, const struct ls_count *counts, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        fputc('{', s->fp);
+        json_field(s->fp, "count", counts[i].path);
+        fprintf(s->fp, ",\"entries\":%ld}\n", counts[i].entries);
+    }
+}
+
+static const struct ls_sink_ops json_ops = {
+    .dir_entries = json_dir_entries,
+    .du_totals = json_du_totals,
+    .counts = json_counts,
+};
+
+struct ls_sink *ls_sink_ndjson(FILE *fp)
+{
+    struct ls_sink *s = ls_sink_new(&json_ops, NULL);
+    if (s) s->fp = fp;
+    return s;
+}
+
+/* ────────────── Snapshot manifests and diff ────────────── */
+/*
+ * Manifest format, one record per line, fields separated by tabs:
+ *
+ *     #lsdir-snapshot 1
+ *     D  path  dir-ino  dir-ctime  hash
+ *     mode  size  mtime  ino  name        (one line per entry of that directory)
+ *
+ * Times are sec.nsec, mode is octal, hash is the FNV-1a of the directory's
+ * entry records. Tabs, newlines and backslashes in names are escaped.
+ */
+#define SNAPSHOT_MAGIC "#lsdir-snapshot 1"
+
+struct snap_entry
+{
+    char *name;
+    mode_t mode;
+    long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    unsigned long long ino;
+};
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t dir_hash(const struct ls_entry *ents, int count)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < count; i++)
+    {
+        const struct stat *st = &ents[i].st;
+        long long rec[6] = { st->st_mode, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+                             (long long)st->st_ino, 0 };
+        h = fnv1a(h, ents[i].name, strlen(ents[i].name) + 1);
+        h = fnv1a(h, rec, sizeof(rec));
+    }
+    return h;
+}
+
+static void snap_escape(FILE *fp, const char *s)
+{
+    for (; *s; s++)
+    {
+        if (*s == '\\') fputs("\\\\", fp);
+        else if (*s == '\t') fputs("\\t", fp);
+        else if (*s == '\n') fputs("\\n", fp);
+        else fputc(*s, fp);
+    }
+}
+
+static void snap_unescape(char *s)
+{
+    char *w = s;
+    for (; *s; s++)
+    {
+        if (*s == '\\' && s[1])
+        {
+            s++;
+            *w++ = *s == 't' ? '\t' : *s == 'n' ? '\n' : *s;
+        }
+        else
+            *w++ = *s;
+    }
+    *w = '\0';
+}
+
+/* Walk order: a directory, then its subtree, siblings by name ('/' sorts first). */
+static int cmp_walk_path(const char *a, const char *b)
+{
+    const unsigned char *pa = (const unsigned char *)a, *pb = (const unsigned char *)b;
+    while (*pa && *pa == *pb) { pa++; pb++; }
+    int ca = *pa == '/' ? 1 : *pa ? *pa + 1 : 0;
+    int cb = *pb == '/' ? 1 : *pb ? *pb + 1 : 0;
+    return ca - cb;
+}
+
+static int path_within(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+    return strncmp(path, dir, len) == 0 && (path[len] == '/' || path[len] == '\0');
+}
+
+struct snap_state
+{
+    FILE *out;
+    struct stat dir_st;         /* the directory being listed, from enter() */
+    int have_dir_st;
+
+    /* diff only: the old manifest, read one line ahead */
+    FILE *old;
+    char *line;
+    size_t cap;
+    int have_line;
+    int prune;
+    char *old_dir;              /* path of the old directory under the cursor */
+    unsigned long long old_ino;
+    long long old_ctime_sec;
+    long old_ctime_nsec;
+    uint64_t old_hash;
+};
+
+/* The directory's own stat: enter() saw it for subdirectories; operands are stat'ed here. */
+static void snap_dir_begin(struct ls_sink *s, const char *path, int depth)
+{
+    struct snap_state *st = s->arg;
+    if (depth == 0 || !st->have_dir_st)
+    {
+        if (!path || fstatat(s->base_fd, path, &st->dir_st, 0) == -1)
+            memset(&st->dir_st, 0, sizeof(st->dir_st));
+    }
+    st->have_dir_st = 0;
+}
+
+static int snap_enter(struct ls_sink *s, const char *path, const struct stat *dst)
+{
+    (void)path;
+    struct snap_state *st = s->arg;
+    st->dir_st = *dst;
+    st->have_dir_st = 1;
+    return 1;
+}
+
+static void snap_dir_entries(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count)
+{
+    struct snap_state *st = s->arg;
+    if (!dir)
+        return;
+
+    fputs("D\t", st->out);
+    snap_escape(st->out, dir);
+    fprintf(st->out, "\t%llu\t%lld.%09ld\t%016llx\n", (unsigned long long)st->dir_st.st_ino,
+            (long long)st->dir_st.st_ctim.tv_sec, st->dir_st.st_ctim.tv_nsec,
+            (unsigned long long)dir_hash(ents, count));
+    for (int i = 0; i < count; i++)
+    {
+        const struct stat *e = &ents[i].st;
+        fprintf(st->out, "%o\t%lld\t%lld.%09ld\t%llu\t", (unsigned)e->st_mode, (long long)e->st_size,
+                (long long)e->st_mtim.tv_sec, e->st_mtim.tv_nsec, (unsigned long long)e->st_ino);
+        snap_escape(st->out, ents[i].name);
+        fputc('\n', st->out);
+    }
+}
+
+static void snap_destroy(struct ls_sink *s)
+{
+    struct snap_state *st = s->arg;
+    free(st->line);
+    free(st->old_dir);
+    free(st);
+}
+
+static const struct ls_sink_ops snapshot_ops = {
+    .dir_begin = snap_dir_begin,
+    .dir_entries = snap_dir_entries,
+    .enter = snap_enter,
+    .destroy = snap_destroy,
+};
+
+struct ls_sink *ls_sink_snapshot(FILE *fp)
+{
+    struct snap_state *st = calloc(1, sizeof(struct snap_state));
+    if (!st) { perror("calloc"); return NULL; }
+    st->out = fp;
+    struct ls_sink *s = ls_sink_new(&snapshot_ops, st);
+    if (!s) { free(st); return NULL; }
+    fprintf(fp, "%s\n", SNAPSHOT_MAGIC);
+    return s;
+}
+
+/* Makes the next line of the old manifest current; 0 at its end. */
+static int old_peek(struct snap_state *st)
+{
+    if (st->have_line)
+        return 1;
+    ssize_t n = getline(&st->line, &st->cap, st->old);
+    if (n <= 0)
+        return 0;
+    if (st->line[n - 1] == '\n')
+        st->line[n - 1] = '\0';
+    st->have_line = 1;
+    return 1;
+}
+
+/* Reads the next entry line of the current old directory; 0 at the next "D" line or the end. */
+static int old_entry(struct snap_state *st, struct snap_entry *e)
+{
+    while (old_peek(st))
+    {
+        if (st->line[0] == 'D' && st->line[1] == '\t')
+            return 0;
+        st->have_line = 0;
+
+        unsigned int mode;
+        int off = 0;
+        if (sscanf(st->line, "%o\t%lld\t%lld.%ld\t%llu\t%n", &mode, &e->size, &e->mtime_sec,
+                   &e->mtime_nsec, &e->ino, &off) < 5 || off == 0)
+            continue;
+        e->mode = mode;
+        e->name = st->line + off;
+        snap_unescape(e->name);
+        return 1;
+    }
+    return 0;
+}
+
+/* Moves to the next "D" line of the old manifest, skipping entries; 0 at its end. */
+static int old_next_dir(struct snap_state *st)
+{
+    struct snap_entry e;
+    free(st->old_dir);
+    st->old_dir = NULL;
+    while (old_entry(st, &e))
+        ;
+    if (!old_peek(st))
+        return 0;
+    st->have_line = 0;
+
+    char *path = st->line + 2;
+    char *tab = strchr(path, '\t');
+    if (!tab)
+        return old_next_dir(st);
+    *tab = '\0';
+    unsigned long long hash = 0;
+    sscanf(tab + 1, "%llu\t%lld.%ld\t%llx", &st->old_ino, &st->old_ctime_sec, &st->old_ctime_nsec, &hash);
+    st->old_hash = hash;
+    snap_unescape(path);
+    st->old_dir = strdup(path);
+    if (!st->old_dir) { perror("strdup"); exit(EXIT_FAILURE); }
+    return 1;
+}
+
+static void diff_line(struct snap_state *st, char what, const char *dir, const char *name)
+{
+    fprintf(st->out, "%c %s/%s\n", what, dir, name);
+}
+
+/* Everything left in the current old directory is gone. */
+static void old_dir_removed(struct snap_state *st)
+{
+    struct snap_entry e;
+    while (old_entry(st, &e))
+        diff_line(st, '-', st->old_dir, e.name);
+}
+
+/* Reports old directories that sort before path, i.e. no longer exist; stops at path. */
+static void old_catch_up(struct snap_state *st, const char *path)
+{
+    while (st->old_dir && cmp_walk_path(st->old_dir, path) < 0)
+    {
+        old_dir_removed(st);
+        old_next_dir(st);
+    }
+}
+
+static int entry_changed(const struct snap_entry *o, const struct stat *st)
+{
+    if (o->mode != st->st_mode || o->ino != (unsigned long long)st->st_ino)
+        return 1;
+    /* A directory's size and mtime follow its contents, which are compared on their own. */
+    if (S_ISDIR(st->st_mode))
+        return 0;
+    return o->size != (long long)st->st_size || o->mtime_sec != (long long)st->st_mtim.tv_sec ||
+           o->mtime_nsec != st->st_mtim.tv_nsec;
+}
+
+static void diff_dir_entries(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count)
+{
+    struct snap_state *st = s->arg;
+    if (!dir)
+        return;
+
+    old_catch_up(st, dir);
+    if (!st->old_dir || strcmp(st->old_dir, dir) != 0)
+    {
+        /* A new directory: everything in it is new. */
+        for (int i = 0; i < count; i++)
+            diff_line(st, '+', dir, ents[i].name);
+        return;
+    }
+
+    /* Same entry records as last time: nothing to compare. */
+    if (dir_hash(ents, count) == st->old_hash)
+    {
+        old_next_dir(st);
+        return;
+    }
+
+    /* Both lists are sorted by name: merge them. */
+    struct snap_entry e;
+    int have = old_entry(st, &e);
+    int i = 0;
+    while (have || i < count)
+    {
+        int c = !have ? 1 : i == count ? -1 : strcmp(e.name, ents[i].name);
+        if (c < 0)
+            diff_line(st, '-', dir, e.name);
+        else if (c > 0)
+            diff_line(st, '+', dir, ents[i].name);
+        else if (entry_changed(&e, &ents[i].st))
+            diff_line(st, 'M', dir, ents[i].name);
+        if (c <= 0) have = old_entry(st, &e);
+        if (c >= 0) i++;
+    }
+    old_next_dir(st);
+}
+
+/*
+ * --diff-prune: a directory whose inode and ctime match the manifest is
+ * taken as unchanged together with its whole subtree and is not read.
+ */
+static int diff_enter(struct ls_sink *s, const char *path, const struct stat *dst)
+{
+    struct snap_state *st = s->arg;
+    if (!st->prune)
+        return 1;
+
+    old_catch_up(st, path);
+    if (!st->old_dir || strcmp(st->old_dir, path) != 0 ||
+        st->old_ino != (unsigned long long)dst->st_ino || st->old_ctime_sec != (long long)dst->st_ctim.tv_sec ||
+        st->old_ctime_nsec != dst->st_ctim.tv_nsec)
+        return 1;
+
+    while (old_next_dir(st) && path_within(st->old_dir, path))
+        ;
+    return 0;
+}
+
+static void diff_destroy(struct ls_sink *s)
+{
+    struct snap_state *st = s->arg;
+    while (st->old_dir)
+    {
+        old_dir_removed(st);
+        old_next_dir(st);
+    }
+    snap_destroy(s);
+}
+
+static const struct ls_sink_ops diff_ops = {
+    .dir_entries = diff_dir_entries,
+    .enter = diff_enter,
+    .destroy = diff_destroy,
+};
+
+struct ls_sink *ls_sink_diff(FILE *old, FILE *out, int prune)
+{
+    struct snap_state *st = calloc(1, sizeof(struct snap_state));
+    if (!st) { perror("calloc"); return NULL; }
+    st->out = out;
+    st->old = old;
+    st->prune = prune;
+
+    if (!old_peek(st) || strcmp(st->line, SNAPSHOT_MAGIC) != 0)
+    {
+        fprintf(stderr, "not an lsdir snapshot\n");
+        free(st->line);
+        free(st);
+        return NULL;
+    }
+    st->have_line = 0;
+    old_next_dir(st);
+
+    struct ls_sink *s = ls_sink_new(&diff_ops, st);
+    if (!s) { free(st->line); free(st->old_dir); free(st); return NULL; }
+    return s;
+}
+
+/* ────────────── Callback sink: hand each record to the caller ────────────── */
+static void cb_dir_entries(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count)
+{
+    for (int i = 0; i < count && !s->stop; i++)
+        if (s->cb(dir, &ents[i], s->arg) != 0)
+            s->stop = 1;
+}
+
+static const struct ls_sink_ops cb_ops = {
+    .dir_entries = cb_dir_entries,
+};
+
+struct ls_sink *ls_sink_callback(ls_entry_cb cb, void *arg)
+{
+    struct ls_sink *s = ls_sink_new(&cb_ops, arg);
+    if (s) s->cb = cb;
+    return s;
+}
+
+/* ────────────── Text printers: one specialization per layout and color ────────────── */
+/*
+ * Layout and color are fixed for a whole listing, so rather than testing
+ * them for every name the layouts below are written once as always-inline
+ * bodies taking a constant color argument, and TEXT_LAYOUTS stamps out a
+ * plain and a colored printer for each. text_printer_pick() chooses one per
+ * session; the inner loops are then straight-line code the compiler can
+ * unroll. Whether the output is a terminal, and how wide, is the caller's
+ * business (ls_options.color and .width).
+ */
+#define TEXT_INLINE static inline __attribute__((always_inline))
+
+static const char *name_color(const struct ls_entry *e)
+{
+    mode_t mode = e->st.st_mode;
+
+    if (S_ISDIR(mode)) return COLOR_BLUE;
+    if (S_ISLNK(mode)) return COLOR_PINK;
+    if ((mode & S_IXUSR) || (mode & S_IXGRP) || (mode & S_IXOTH)) return COLOR_GREEN;
+    if (strstr(e->name, ".tar") || strstr(e->name, ".gz") || strstr(e->name, ".zip")) return COLOR_RED;
+    if (S_ISCHR(mode) || S_ISBLK(mode) || S_ISFIFO(mode) || S_ISSOCK(mode)) return COLOR_REVERSE;
+    return COLOR_RESET;
+}
+
+TEXT_INLINE void name_cell(FILE *fp, const struct ls_entry *e, enum ls_quoting q, const int color)
+{
+    if (color) fputs(name_color(e), fp);
+    name_print(fp, e->name, e->flags, q);
+    if (color) fputs(COLOR_RESET, fp);
+}
+
+static void pad(FILE *fp, int n)
+{
+    static const char spaces[] = "                                                                ";
+    while (n > (int)sizeof(spaces) - 1)
+    {
+        fwrite(spaces, 1, sizeof(spaces) - 1, fp);
+        n -= sizeof(spaces) - 1;
+    }
+    fwrite(spaces, 1, n, fp);
+}
+
+static int max_width(const struct ls_entry *ents, int count)
+{
+    int maxlen = 0;
+    for (int i = 0; i < count; i++)
+        if (ents[i].width > maxlen) maxlen = ents[i].width;
+    return maxlen;
+}
+
+static int dec_digits(unsigned long long v);
+static void dec_put(char *p, unsigned long long v, int n);
+
+/* -s counts KiB, rounding up as du does. */
+static unsigned long long kib_blocks(const struct stat *st)
+{
+    return ((unsigned long long)st->st_blocks + 1) / 2;
+}
+
+/*
+ * Widens p to the optional columns of ents (-i, -s, -Z and the ACL
+ * marker); returns their 512-byte blocks for the "total" line of -s.
+ */
+static long long prefix_measure(const struct ls_options *o, const struct ls_entry *ents, int count,
+                                struct text_prefix *p)
+{
+    if (!o->show_inode && !o->show_blocks && !o->show_context && !o->show_acl)
+        return 0;
+
+    long long blocks = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const struct ls_entry *e = &ents[i];
+        int unknown = e->flags & LS_ENTRY_TIMEOUT, n;
+        if (o->show_inode && (n = unknown ? 1 : dec_digits(e->st.st_ino)) > p->ino)
+            p->ino = n;
+        if (o->show_blocks && (n = unknown ? 1 : dec_digits(kib_blocks(&e->st))) > p->blocks)
+            p->blocks = n;
+        if (o->show_context && (n = e->context ? (int)strlen(e->context) : 1) > p->context)
+            p->context = n;
+        if (e->flags & LS_ENTRY_ACL)
+            p->acl = 1;
+        if (!unknown)
+            blocks += e->st.st_blocks;
+    }
+    return blocks;
+}
+
+/* Prefix widths for one call: its own entries', or the whole directory's when it comes in chunks. */
+static long long prefix_get(struct ls_sink *s, const struct ls_entry *ents, int count, struct text_prefix *p)
+{
+    if (s->chunked)
+    {
+        *p = s->totals.prefix;
+        return s->totals.blocks;
+    }
+    memset(p, 0, sizeof(*p));
+    return prefix_measure(s->opts, ents, count, p);
+}
+
+/* Columns the short layouts put before each name. */
+static int prefix_width(const struct text_prefix *p)
+{
+    return (p->ino ? p->ino + 1 : 0) + (p->blocks ? p->blocks + 1 : 0) + (p->context ? p->context + 1 : 0);
+}
+
+/* v right-aligned in width columns and a space, "?" without metadata; returns the end. */
+static char *num_field(char *p, unsigned long long v, int width, int unknown)
+{
+    memset(p, ' ', width + 1);
+    if (unknown)
+        p[width - 1] = '?';
+    else
+    {
+        int n = dec_digits(v);
+        dec_put(p + width - n, v, n);
+    }
+    return p + width + 1;
+}
+
+/* Inode and block columns at row, and the context right-aligned if with_context; returns the length. */
+static int prefix_put(char *row, const struct ls_entry *e, const struct text_prefix *p, int with_context)
+{
+    int unknown = e->flags & LS_ENTRY_TIMEOUT;
+    char *q = row;
+    if (p->ino)
+        q = num_field(q, e->st.st_ino, p->ino, unknown);
+    if (p->blocks)
+        q = num_field(q, kib_blocks(&e->st), p->blocks, unknown);
+    if (with_context && p->context)
+    {
+        const char *ctx = e->context ? e->context : "?";
+        int n = strlen(ctx);
+        memset(q, ' ', p->context - n);
+        memcpy(q + p->context - n, ctx, n);
+        q += p->context;
+        *q++ = ' ';
+    }
+    return q - row;
+}
+
+TEXT_INLINE void prefix_cell(FILE *fp, const struct ls_entry *e, const struct text_prefix *p)
+{
+    char buf[2 * 22 + CONTEXT_MAX + 1];
+    fwrite(buf, 1, prefix_put(buf, e, p, 1), fp);
+}
+
+/* "total" in KiB heads a directory's long or -s listing once; operand files get none. */
+static void print_total(struct ls_sink *s, const char *dir, long long blocks)
+{
+    if (dir && !(s->chunked && s->totals.started))
+        fprintf(s->fp, "total %lld\n", blocks / 2);
+    s->totals.started = 1;
+}
+
+/* ────────────── Long rows: permission table, decimal formatting, row assembly ────────────── */
+/*
+ * A long row is assembled in a stack buffer: the columns before the name
+ * have fixed offsets for the whole directory, so each field is copied to
+ * its place instead of going through printf. Permission strings come from
+ * a table over the twelve mode bits (setuid, setgid and sticky included)
+ * and numbers are written two digits at a time.
+ */
+static char perm_table[4096][9];
+static pthread_once_t perm_once = PTHREAD_ONCE_INIT;
+
+/* File type letter, indexed by (mode & S_IFMT) >> 12. */
+static const char type_chars[] = "-pc-d-b---l-s---";
+
+static void perm_table_build(void)
+{
+    for (unsigned int m = 0; m < 4096; m++)
+    {
+        char *p = perm_table[m];
+        p[0] = (m & S_IRUSR) ? 'r' : '-';
+        p[1] = (m & S_IWUSR) ? 'w' : '-';
+        p[2] = (m & S_ISUID) ? ((m & S_IXUSR) ? 's' : 'S') : ((m & S_IXUSR) ? 'x' : '-');
+        p[3] = (m & S_IRGRP) ? 'r' : '-';
+        p[4] = (m & S_IWGRP) ? 'w' : '-';
+        p[5] = (m & S_ISGID) ? ((m & S_IXGRP) ? 's' : 'S') : ((m & S_IXGRP) ? 'x' : '-');
+        p[6] = (m & S_IROTH) ? 'r' : '-';
+        p[7] = (m & S_IWOTH) ? 'w' : '-';
+        p[8] = (m & S_ISVTX) ? ((m & S_IXOTH) ? 't' : 'T') : ((m & S_IXOTH) ? 'x' : '-');
+    }
+}
+
+void ls_mode_to_string(mode_t mode, char *str)
+{
+    pthread_once(&perm_once, perm_table_build);
+    str[0] = type_chars[(mode & S_IFMT) >> 12];
+    memcpy(str + 1, perm_table[mode & 07777], 9);
+    str[10] = '\0';
+}
+
+static const unsigned long long pow10_table[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+/* Decimal digits of v: log10 estimated from the bit length, then corrected. */
+static int dec_digits(unsigned long long v)
+{
+    v |= 1;
+    int t = (64 - __builtin_clzll(v)) * 1233 >> 12;
+    return t + (v >= pow10_table[t]);
+}
+
+/* Writes v as exactly n (= dec_digits(v)) digits at p. */
+static void dec_put(char *p, unsigned long long v, int n)
+{
+    p += n;
+    while (v >= 100)
+    {
+        unsigned int r = v % 100;
+        v /= 100;
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * r, 2);
+    }
+    if (v >= 10) memcpy(p - 2, digit_pairs + 2 * v, 2);
+    else p[-1] = '0' + v;
+}
+
+/* Last user or group name looked up; most rows of a directory share one. */
+struct id_text
+{
+    int valid;
+    unsigned int id;
+    int len;
+    char text[64];
+};
+
+/* Name for id, or the number when it has none. */
+static int id_text_get(struct id_text *c, int is_group, unsigned int id)
+{
+    if (!c->valid || c->id != id)
+    {
+        if (!id_lookup(is_group, id, c->text))
+            snprintf(c->text, sizeof(c->text), "%u", id);
+        c->len = strlen(c->text);
+        c->id = id;
+        c->valid = 1;
+    }
+    return c->len;
+}
+
+/* mtime as "%b %e %H:%M", reused while rows fall in the same minute. */
+struct time_text
+{
+    time_t minute;
+    int len;
+    char text[64];
+};
+
+static int time_text_get(struct time_text *c, time_t t)
+{
+    time_t minute = t / 60 - (t % 60 < 0);
+    if (c->len == 0 || c->minute != minute)
+    {
+        struct tm tmbuf;
+        struct tm *tm = localtime_r(&t, &tmbuf);
+        c->len = tm ? (int)strftime(c->text, sizeof(c->text), "%b %e %H:%M", tm) : 0;
+        if (c->len == 0)
+            c->len = snprintf(c->text, sizeof(c->text), "%12s", "?");
+        c->minute = minute;
+    }
+    return c->len;
+}
+
+/* Column widths of one directory's long listing and where each field starts. */
+struct long_cols
+{
+    struct text_prefix prefix;
+    int links, user, group, size, time;
+    int at_mode, at_links, at_user, at_group, at_context, at_size, at_time;
+    char blank[512];            /* at_time spaces: the row before its fields */
+    struct id_text owner, grp;
+    struct time_text mtime;
+};
+
+/* Digit counts from the width pass, so the row pass does not count again. */
+struct long_row
+{
+    unsigned char links, size;
+};
+
+TEXT_INLINE void print_long(FILE *fp, int base_fd, const char *dir, const struct ls_entry *e, enum ls_quoting q,
+                            const int color, struct long_cols *c, const struct long_row *r)
+{
+    const struct stat *st = &e->st;
+    const char *name = e->name;
+
+    char row[sizeof(c->blank) + sizeof(c->mtime.text) + 1];
+    memcpy(row, c->blank, c->at_time);
+    if (c->at_mode > 0)
+        prefix_put(row, e, &c->prefix, 0);
+
+    /* No metadata: a "?" in every column, as ls prints for an unreadable entry. */
+    if (e->flags & LS_ENTRY_TIMEOUT)
+    {
+        memset(row + c->at_mode, '?', 10);
+        row[c->at_links + c->links - 1] = '?';
+        row[c->at_user] = '?';
+        row[c->at_group] = '?';
+        if (c->prefix.context)
+            row[c->at_context] = '?';
+        row[c->at_size + c->size - 1] = '?';
+        memset(row + c->at_time, ' ', c->time - 1);
+        row[c->at_time + c->time - 1] = '?';
+        row[c->at_time + c->time] = ' ';
+        fwrite(row, 1, c->at_time + c->time + 1, fp);
+        name_cell(fp, e, q, color);
+        fputc('\n', fp);
+        return;
+    }
+
+    row[c->at_mode] = type_chars[(st->st_mode & S_IFMT) >> 12];
+    memcpy(row + c->at_mode + 1, perm_table[st->st_mode & 07777], 9);
+    if (e->flags & LS_ENTRY_ACL)
+        row[c->at_mode + 10] = '+';
+    dec_put(row + c->at_links + c->links - r->links, st->st_nlink, r->links);
+    memcpy(row + c->at_user, c->owner.text, id_text_get(&c->owner, 0, st->st_uid));
+    memcpy(row + c->at_group, c->grp.text, id_text_get(&c->grp, 1, st->st_gid));
+    if (c->prefix.context)
+    {
+        const char *ctx = e->context ? e->context : "?";
+        memcpy(row + c->at_context, ctx, strlen(ctx));
+    }
+    dec_put(row + c->at_size + c->size - r->size, (unsigned long long)st->st_size, r->size);
+    int tlen = time_text_get(&c->mtime, st->st_mtime);
+    memcpy(row + c->at_time, c->mtime.text, tlen);
+    row[c->at_time + tlen] = ' ';
+    fwrite(row, 1, c->at_time + tlen + 1, fp);
+    name_cell(fp, e, q, color);
+
+    /* Link targets are quoted like names. */
+    if (S_ISLNK(st->st_mode))
+    {
+        char path[PATH_MAX];
+        if (dir) snprintf(path, sizeof(path), "%s/%s", dir, name);
+        else snprintf(path, sizeof(path), "%s", name);
+
+        char target[PATH_MAX];
+        ssize_t n = readlinkat(base_fd, path, target, sizeof(target) - 1);
+        fputs(" -> ", fp);
+        if (n != -1) { target[n] = '\0'; name_print(fp, target, 0, q); }
+        else fputs("(unreadable)", fp);
+    }
+    fputc('\n', fp);
+}
+
+/*
+ * -x: across then down. A spilled directory comes in several calls: the
+ * column width is then the whole directory's and the line carries over.
+ */
+TEXT_INLINE void layout_across(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count, const int color)
+{
+    FILE *fp = s->fp;
+    enum ls_quoting q = s->opts->quoting;
+    struct text_prefix p;
+    long long blocks = prefix_get(s, ents, count, &p);
+    int pw = prefix_width(&p);
+    int col_width = (s->chunked ? s->totals.name_width : max_width(ents, count)) + pw + 2;
+    int x = s->chunked ? s->totals.x : 0;
+
+    if (p.blocks)
+        print_total(s, dir, blocks);
+    for (int i = 0; i < count; i++)
+    {
+        if (x + col_width > s->term_width) { fputc('\n', fp); x = 0; }
+
+        if (pw) prefix_cell(fp, &ents[i], &p);
+        name_cell(fp, &ents[i], q, color);
+        pad(fp, col_width - pw - ents[i].width);
+        x += col_width;
+    }
+    if (s->chunked) s->totals.x = x;
+    else if (x != 0) fputc('\n', fp);
+}
+
+/*
+ * Down then across, as many columns as the terminal holds. That needs the
+ * whole directory at once, so a spilled one is laid out across instead.
+ */
+TEXT_INLINE void layout_columns(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count, const int color)
+{
+    if (s->chunked)
+    {
+        layout_across(s, dir, ents, count, color);
+        return;
+    }
+
+    FILE *fp = s->fp;
+    enum ls_quoting q = s->opts->quoting;
+    struct text_prefix p;
+    long long blocks = prefix_get(s, ents, count, &p);
+    int pw = prefix_width(&p);
+    int col_width = max_width(ents, count) + pw + 2;
+    int ncols = s->term_width / col_width;
+    if (ncols < 1) ncols = 1;
+
+    int nrows = (count + ncols - 1) / ncols;
+
+    if (p.blocks)
+        print_total(s, dir, blocks);
+    for (int r = 0; r < nrows; r++)
+    {
+        for (int index = r; index < count; index += nrows)
+        {
+            if (pw) prefix_cell(fp, &ents[index], &p);
+            name_cell(fp, &ents[index], q, color);
+            pad(fp, col_width - pw - ents[index].width);
+        }
+        fputc('\n', fp);
+    }
+}
+
+TEXT_INLINE void layout_long(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count, const int color)
+{
+    FILE *fp = s->fp;
+    long long total_blocks = 0;
+    struct long_cols c;
+    prefix_get(s, ents, count, &c.prefix);
+    c.links = c.user = c.group = c.size = c.time = 0;
+    c.owner.valid = c.grp.valid = 0;
+    c.mtime.len = 0;
+
+    struct long_row *rows = malloc(count * sizeof(struct long_row));
+    if (!rows) { perror("malloc"); exit(EXIT_FAILURE); }
+    pthread_once(&perm_once, perm_table_build);
+
+    for (int i = 0; i < count; i++)
+    {
+        const struct stat *st = &ents[i].st;
+        if (ents[i].flags & LS_ENTRY_TIMEOUT)
+        {
+            /* Room for its "?" in each column; the time as wide as the others print. */
+            if (c.links == 0) c.links = 1;
+            if (c.user == 0) c.user = 1;
+            if (c.group == 0) c.group = 1;
+            if (c.size == 0) c.size = 1;
+            if (c.time == 0) c.time = time_text_get(&c.mtime, time(NULL));
+            continue;
+        }
+
+        total_blocks += st->st_blocks;
+
+        rows[i].links = dec_digits(st->st_nlink);
+        if (rows[i].links > c.links) c.links = rows[i].links;
+
+        rows[i].size = dec_digits((unsigned long long)st->st_size);
+        if (rows[i].size > c.size) c.size = rows[i].size;
+
+        int n = id_text_get(&c.owner, 0, st->st_uid);
+        if (n > c.user) c.user = n;
+
+        n = id_text_get(&c.grp, 1, st->st_gid);
+        if (n > c.group) c.group = n;
+    }
+
+    /* A spilled directory: the widths and total were measured over all of it. */
+    if (s->chunked)
+    {
+        const struct text_totals *t = &s->totals;
+        if (t->links > c.links) c.links = t->links;
+        if (t->user > c.user) c.user = t->user;
+        if (t->group > c.group) c.group = t->group;
+        if (t->size > c.size) c.size = t->size;
+        total_blocks = t->blocks;
+    }
+
+    /* Inode and blocks come first, the context after the group (as GNU ls lays them out). */
+    c.at_mode = (c.prefix.ino ? c.prefix.ino + 1 : 0) + (c.prefix.blocks ? c.prefix.blocks + 1 : 0);
+    c.at_links = c.at_mode + 11 + c.prefix.acl;
+    c.at_user = c.at_links + c.links + 1;
+    c.at_group = c.at_user + c.user + 1;
+    c.at_context = c.at_group + c.group + 1;
+    c.at_size = c.at_context + (c.prefix.context ? c.prefix.context + 1 : 0);
+    c.at_time = c.at_size + c.size + 1;
+    memset(c.blank, ' ', c.at_time);
+
+    print_total(s, dir, total_blocks);
+
+    for (int i = 0; i < count; i++)
+        print_long(fp, s->base_fd, dir, &ents[i], s->opts->quoting, color, &c, &rows[i]);
+    free(rows);
+}
+
+static void text_measure(struct ls_sink *s, const struct ls_entry *ents, int count)
+{
+    struct text_totals *t = &s->totals;
+    struct id_text owner, grp;
+    owner.valid = grp.valid = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        const struct stat *st = &ents[i].st;
+        if (ents[i].width > t->name_width) t->name_width = ents[i].width;
+        if (ents[i].flags & LS_ENTRY_TIMEOUT)
+            continue;
+
+        t->blocks += st->st_blocks;
+        int n = dec_digits(st->st_nlink);
+        if (n > t->links) t->links = n;
+        n = dec_digits((unsigned long long)st->st_size);
+        if (n > t->size) t->size = n;
+        n = id_text_get(&owner, 0, st->st_uid);
+        if (n > t->user) t->user = n;
+        n = id_text_get(&grp, 1, st->st_gid);
+        if (n > t->group) t->group = n;
+    }
+    prefix_measure(s->opts, ents, count, &t->prefix);
+}
+
+/* -1: one name per line. */
+TEXT_INLINE void layout_one(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count, const int color)
+{
+    FILE *fp = s->fp;
+    enum ls_quoting q = s->opts->quoting;
+    struct text_prefix p;
+    long long blocks = prefix_get(s, ents, count, &p);
+    int pw = prefix_width(&p);
+
+    if (p.blocks)
+        print_total(s, dir, blocks);
+    for (int i = 0; i < count; i++)
+    {
+        if (pw) prefix_cell(fp, &ents[i], &p);
+        name_cell(fp, &ents[i], q, color);
+        fputc('\n', fp);
+    }
+}
+
+#define TEXT_LAYOUTS(X) \
+    X(LS_DISPLAY_COLUMNS, columns) \
+    X(LS_DISPLAY_LONG, long) \
+    X(LS_DISPLAY_ACROSS, across) \
+    X(LS_DISPLAY_ONE, one)
+
+#define TEXT_PRINTERS(display, layout) \
+    static void print_##layout##_plain(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count) \
+    { layout_##layout(s, dir, ents, count, 0); } \
+    static void print_##layout##_color(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count) \
+    { layout_##layout(s, dir, ents, count, 1); }
+TEXT_LAYOUTS(TEXT_PRINTERS)
+
+typedef void (*text_printer)(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count);
+
+#define TEXT_PRINTER_ROW(display, layout) [display] = { print_##layout##_plain, print_##layout##_color },
+static const text_printer text_printers[][2] = { TEXT_LAYOUTS(TEXT_PRINTER_ROW) };
+
+static void text_printer_pick(struct ls_sink *s)
+{
+    s->term_width = s->opts->width > 0 ? s->opts->width : 80;
+    s->print = text_printers[s->opts->display][s->opts->color != 0];
+    s->print_opts = s->opts;
+}
@@ -0,0 +1,270 @@
+/*
+ * liblsdir: directory listing library behind lsv1.7.0.
+ *
+ * A listing is driven by an ls_options struct and delivered to a sink.
+ * The library ships three sinks (columns/long text, NDJSON, and text into a
+ * caller-provided buffer) plus a callback sink that hands every entry
+ * record to the caller; custom sinks can be built from ls_sink_ops.
+ *
+ * Typical use:
+ *
+ *     struct ls_options o;
+ *     ls_options_init(&o);
+ *     o.display = LS_DISPLAY_LONG;
+ *     if (ls_options_prepare(&o) == -1) ...;
+ *     struct ls_sink *sink = ls_sink_text(stdout);
+ *     ls_list(&o, "/etc", sink);
+ *     ls_sink_free(sink);
+ *     ls_options_free(&o);
+ *
+ * Errors on individual entries are reported on stderr (as ls itself does),
+ * or on o->errors, and the walk continues; functions returning int give -1
+ * on failure.
+ */
+
+#ifndef LSDIR_H
+#define LSDIR_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ────────────── Options ────────────── */
+enum ls_display { LS_DISPLAY_COLUMNS, LS_DISPLAY_LONG, LS_DISPLAY_ACROSS, LS_DISPLAY_ONE };
+
+/* How the text sink writes names with unprintable or special characters. */
+enum ls_quoting { LS_QUOTE_LITERAL,     /* -N: as they are */
+                  LS_QUOTE_QUESTION,    /* -q: '?' for each unprintable character */
+                  LS_QUOTE_ESCAPE,      /* -b: C escapes, \ooo for other bytes */
+                  LS_QUOTE_SHELL };     /* 'quoted' for the shell, $'\n' for unprintables */
+
+enum ls_pattern_list { LS_INCLUDE, LS_EXCLUDE, LS_PRUNE };
+
+enum ls_pred_op { LS_PRED_SIZE, LS_PRED_NEWER, LS_PRED_TYPE, LS_PRED_PERM,
+                  LS_PRED_AND, LS_PRED_OR, LS_PRED_NOT };
+
+struct ls_compiled;             /* filters and predicates, built by the ls_options_* calls */
+struct ls_dir_cache;            /* see ls_dir_cache_new() */
+
+struct ls_options
+{
+    enum ls_display display;
+    int recursive;              /* -R */
+    int follow_links;           /* -L */
+    int same_dir_once;          /* --same-dir-once */
+    int du;                     /* --du subtree totals */
+    int stat_inode_order;       /* stat in d_ino order (default 1) */
+    int regex;                  /* patterns are POSIX extended regexes */
+    int full_stat;              /* fetch every stat field, not just what the display needs */
+    struct ls_dir_cache *dir_cache; /* optional; may be shared by concurrent sessions */
+    int unsorted;               /* -U: readdir order */
+    enum ls_quoting quoting;    /* text sink; default LS_QUOTE_LITERAL */
+    int color;                  /* text sink: color names by file type */
+    int width;                  /* text sink: line width for columns and -x (0: 80) */
+    long parallel_sort_min;     /* sort on several threads from this many entries (default 500000; 0: never) */
+    int sort_threads;           /* threads for that (0: online CPUs, at most 16) */
+    size_t max_memory;          /* bytes a directory may hold before it is sorted through temporary files (0: no cap) */
+    int prefetch;               /* -R on two or more CPUs: directories read ahead of the walk (default 8; 0: serial) */
+
+    /* Paging of operand directories (not applied under -R). */
+    long offset;                /* entries to skip */
+    long limit;                 /* page size; 0 is unlimited */
+    const char *cursor;         /* from ls_session_next_cursor(); replaces offset */
+
+    int one_file_system;        /* -R stays on the operand's filesystem */
+    int skip_pseudo;            /* -R does not enter proc, sysfs, cgroup, ... mounted below the operand */
+    int debug_fs;               /* describe each filesystem's profile on stderr */
+
+    /*
+     * Optional columns. Inode and block count come with the stat; the ACL
+     * marker and the security context cost getxattr() calls per listed
+     * entry and are only fetched when asked for (never on filesystems that
+     * answer ENOTSUP, nor under a deadline).
+     */
+    int show_inode;             /* -i */
+    int show_blocks;            /* -s: allocated KiB */
+    int show_acl;               /* '+' after the permissions in long listings */
+    int show_context;           /* -Z: SELinux context */
+    int debug_columns;          /* report what the extra columns cost on stderr */
+
+    /*
+     * Where diagnostics go: option errors, entries that cannot be read,
+     * the timeout and column reports (NULL: stderr). Written from helper
+     * threads too, so it must be a stdio stream, not a raw buffer.
+     */
+    FILE *errors;
+
+    int count;                  /* --count: report entry counts instead of entries */
+    int threads;                /* --count -R worker threads (0 or 1: none) */
+
+    double max_ops;             /* stats and directory opens per second; 0 is unlimited */
+    double max_latency_ms;      /* back off while the average statx() takes longer; 0 is off */
+
+    /*
+     * Deadlines for filesystems that hang (a stale NFS handle). Directory
+     * reads and stats then run on helper threads; an entry whose stat does
+     * not answer in time is listed with LS_ENTRY_TIMEOUT set and the walk
+     * moves on. 0 is no deadline.
+     */
+    double timeout_dir_ms;      /* whole directory: open, read and stat */
+    double timeout_stat_ms;     /* one stat */
+
+    struct ls_compiled *compiled;
+};
+
+void ls_options_init(struct ls_options *o);
+/* pat must stay valid until ls_options_free(). */
+int ls_options_add_pattern(struct ls_options *o, enum ls_pattern_list list, const char *pat);
+/* arg is the predicate's argument (NULL for --and/--or/--not). */
+int ls_options_add_predicate(struct ls_options *o, enum ls_pred_op op, const char *arg);
+/* Compile patterns and predicates; call once after the fields are set. */
+int ls_options_prepare(struct ls_options *o);
+void ls_options_free(struct ls_options *o);
+
+/*
+ * Cache of recent readdir() results, validated by the directory's mtime and
+ * ctime. Entries are still stat'ed on every listing. Thread-safe.
+ */
+struct ls_dir_cache *ls_dir_cache_new(size_t max_bytes);
+void ls_dir_cache_stats(struct ls_dir_cache *dc, unsigned long *hits, unsigned long *misses);
+void ls_dir_cache_free(struct ls_dir_cache *dc);
+
+/* ────────────── Entry records ────────────── */
+#define LS_ENTRY_TIMEOUT    0x1  /* the stat did not answer in time; st is zeroed */
+#define LS_ENTRY_NAME_PLAIN 0x2  /* name is written as it is under the chosen quoting */
+#define LS_ENTRY_ACL        0x4  /* has an access or default ACL (show_acl) */
+
+struct ls_entry
+{
+    const char *name;
+    struct stat st;
+    unsigned int flags;         /* LS_ENTRY_* */
+    int width;                  /* terminal columns of the name as the text sink writes it */
+    const char *context;        /* show_context: security context, NULL if it has none */
+};
+
+/* Subtree totals of one directory (--du). */
+struct ls_du_total
+{
+    const char *path;
+    long long blocks;           /* 512-byte blocks, as in st_blocks */
+    long long bytes;            /* apparent size */
+    long files;
+    long dirs;
+};
+
+/* Entries of one directory (--count), after name filters. */
+struct ls_count
+{
+    const char *path;
+    long entries;
+};
+
+/* ────────────── Sinks ────────────── */
+struct ls_sink;
+
+/*
+ * depth is 0 for an operand and grows by one per -R level. entries are
+ * sorted and only valid for the duration of the call. dir (and path) is
+ * NULL for the block of non-directory operands, whose names are the
+ * operands as given. A directory that outgrows max_memory arrives in
+ * several dir_entries calls between its dir_begin and dir_end, each one
+ * continuing the order of the last; the snapshot and diff sinks need it
+ * in one piece.
+ */
+struct ls_sink_ops
+{
+    void (*dir_begin)(struct ls_sink *s, const char *path, int depth);
+    void (*dir_entries)(struct ls_sink *s, const char *dir, const struct ls_entry *ents, int count);
+    void (*dir_end)(struct ls_sink *s, const char *path, int depth);
+    /* After an operand and everything -R found below it (path NULL for the file block). */
+    void (*operand_end)(struct ls_sink *s, const char *path);
+    /* --du totals of every directory walked, largest first; called by ls_session_finish(). */
+    void (*du_totals)(struct ls_sink *s, const struct ls_du_total *totals, int count);
+    /* Called before -R descends into path (st is its stat); return 0 to skip the subtree. */
+    int (*enter)(struct ls_sink *s, const char *path, const struct stat *st);
+    /* --count results in walk order; called by ls_session_finish(). */
+    void (*counts)(struct ls_sink *s, const struct ls_count *counts, int n);
+    void (*destroy)(struct ls_sink *s);
+};
+
+struct ls_sink *ls_sink_new(const struct ls_sink_ops *ops, void *arg);
+void *ls_sink_arg(const struct ls_sink *s);
+const struct ls_options *ls_sink_options(const struct ls_sink *s);
+
+struct ls_sink *ls_sink_text(FILE *fp);
+struct ls_sink *ls_sink_ndjson(FILE *fp);
+/* Text output into buf (NUL-terminated, truncated at size - 1 bytes). */
+struct ls_sink *ls_sink_buffer(char *buf, size_t size);
+/* Bytes written so far by a buffer sink. */
+size_t ls_sink_buffer_length(struct ls_sink *s);
+
+/*
+ * Snapshot manifest of a -R walk (needs full_stat), and a sink that compares
+ * a walk against such a manifest, writing "+ path", "- path" and "M path".
+ * With prune, subtrees whose directory inode and ctime are unchanged are
+ * skipped unread: faster, but it misses in-place writes to files and
+ * changes in deeper directories, since neither touches the directory.
+ */
+struct ls_sink *ls_sink_snapshot(FILE *fp);
+struct ls_sink *ls_sink_diff(FILE *old, FILE *out, int prune);
+
+typedef int (*ls_entry_cb)(const char *dir, const struct ls_entry *e, void *arg);
+/* Calls cb for every listed entry; a non-zero return stops the walk. */
+struct ls_sink *ls_sink_callback(ls_entry_cb cb, void *arg);
+
+void ls_sink_free(struct ls_sink *s);
+
+/* ────────────── Listing ────────────── */
+struct ls_session;
+
+/* A session shares the visited set and --du totals across several paths. */
+struct ls_session *ls_session_new(const struct ls_options *o, struct ls_sink *sink);
+/* Relative paths given to ls_session_list() resolve against dirfd (default AT_FDCWD). */
+void ls_session_set_base(struct ls_session *ss, int dirfd);
+int ls_session_list(struct ls_session *ss, const char *path);
+/*
+ * GNU-style operand handling: every path is stat'ed once, non-directories
+ * are listed together first, then each directory in name order. Returns -1
+ * if any operand could not be accessed (the others are still listed).
+ */
+int ls_session_list_operands(struct ls_session *ss, char *const *paths, int n);
+/*
+ * Head every operand directory with "path:", even when it is the only
+ * one; for callers that feed operands one call at a time (--from-file).
+ */
+void ls_session_set_headers(struct ls_session *ss, int always);
+/*
+ * Persist the -R frontier to path every interval seconds (between two
+ * directories), so an interrupted walk of a single operand can be picked
+ * up by ls_session_resume(), which truncates the sink's output back to
+ * the checkpoint and continues. Not for --du. ls_session_finish() removes
+ * the checkpoint.
+ */
+void ls_session_set_checkpoint(struct ls_session *ss, const char *path, double interval);
+int ls_session_resume(struct ls_session *ss, const char *path);
+/* Token for the page after the last one listed, or NULL if it was the last page. */
+const char *ls_session_next_cursor(const struct ls_session *ss);
+/*
+ * Emits the --du totals, if any, reports the directories that hit a
+ * deadline (and, with debug_columns, the cost of the extra columns) on
+ * stderr and frees the session.
+ */
+void ls_session_finish(struct ls_session *ss);
+
+/* One-shot: session_new + session_list + session_finish. */
+int ls_list(const struct ls_options *o, const char *path, struct ls_sink *sink);
+
+/* ────────────── Formatting helpers ────────────── */
+/* "drwxr-xr-x" style, with s/S/t/T for the special bits; str must hold 11 bytes. */
+void ls_mode_to_string(mode_t mode, char *str);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LSDIR_H */
@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# check_serve.sh: starts bin/ls --serve on a scratch socket and checks that
+# --client hands back what a local run would: the listing on stdout, the
+# request's diagnostics on stderr and its exit status.
+#
+#     make check-serve
+
+LS=${LS:-bin/ls}
+
+case $LS in /*) ;; *) LS=$(pwd)/$LS ;; esac
+if [ ! -f "$LS" ]; then
+    echo "check_serve: $LS is missing (make ls-v1.7.0)" >&2
+    exit 2
+fi
+
+tmp=$(mktemp -d) || exit 2
+mkdir -p "$tmp/t/d"
+touch "$tmp/t/a" "$tmp/t/b" "$tmp/t/c"
+
+"$LS" --serve="$tmp/sock" 2> "$tmp/serve.err" &
+server=$!
+trap 'kill $server 2>/dev/null; rm -rf "$tmp"' EXIT
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$tmp/sock" ] && break
+    sleep 0.1
+done
+
+failures=0
+
+check()
+{
+    if eval "$2"; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1"
+        failures=$((failures + 1))
+    fi
+}
+
+# Runs the client from $tmp with the given arguments; stdout, stderr and
+# the exit status land in $tmp/out, err, rc.
+client()
+{
+    (cd "$tmp" && "$LS" --client="$tmp/sock" "$@") > "$tmp/out" 2> "$tmp/err"
+    echo $? > "$tmp/rc"
+}
+
+check "socket is mode 0600" '[ "$(stat -c %a "$tmp/sock")" = 600 ]'
+
+client -1 t
+check "listing on stdout" '[ "$(cat "$tmp/out")" = "$(printf "a\nb\nc\nd")" ]'
+check "success exits 0" '[ "$(cat "$tmp/rc")" = 0 ] && [ ! -s "$tmp/err" ]'
+
+client -1 t missing
+check "missing path: the rest is listed" 'grep -q "^t:$" "$tmp/out"'
+check "missing path: reported on the client's stderr" \
+    'grep -q "^cannot access '"'"'missing'"'"': No such file or directory$" "$tmp/err"'
+check "missing path: exits non-zero" '[ "$(cat "$tmp/rc")" != 0 ]'
+check "missing path: nothing in the daemon's log" '[ ! -s "$tmp/serve.err" ]'
+
+# Paging: the next cursor is part of the request's stderr, not the log's.
+mkdir "$tmp/u"
+client -1 --limit=2 t
+check "--limit: cursor on the client's stderr" 'grep -q "^next cursor: " "$tmp/err" && [ ! -s "$tmp/serve.err" ]'
+cursor=$(sed -n 's/^next cursor: //p' "$tmp/err")
+client -1 --limit=2 --cursor="$cursor" t
+check "--cursor: next page" '[ "$(cat "$tmp/out")" = "$(printf "c\nd")" ] && [ "$(cat "$tmp/rc")" = 0 ]'
+client -1 --limit=2 --cursor="$cursor" u
+check "--cursor for another directory: reported and non-zero" \
+    'grep -q "^u: cursor belongs to another directory$" "$tmp/err" && [ "$(cat "$tmp/rc")" != 0 ]'
+
+client --size=bogus t
+check "bad option value: reported and non-zero" \
+    'grep -q "^invalid size '"'"'bogus'"'"'$" "$tmp/err" && [ "$(cat "$tmp/rc")" != 0 ]'
+
+[ $failures -eq 0 ]
@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# check_timeouts.sh: runs bin/ls -lR with --timeout-stat and --timeout-dir
+# against a scratch tree made slow by tools/delay_shim.so, and checks that
+# the walk gives up in time, lists "?" placeholders for the entry whose
+# stat hung, leaves out the directory whose open hung, and reports both on
+# stderr when it finishes.
+#
+#     make check-timeouts
+#
+# Each case delays a path by DELAY_MS (2 s) against a deadline of a few
+# hundred milliseconds; a run that waits for the delay counts as a failure.
+
+LS=${LS:-bin/ls}
+SHIM=${SHIM:-tools/delay_shim.so}
+DELAY_MS=2000
+
+case $LS in /*) ;; *) LS=$(pwd)/$LS ;; esac
+case $SHIM in /*) ;; *) SHIM=$(pwd)/$SHIM ;; esac
+for f in "$LS" "$SHIM"; do
+    if [ ! -f "$f" ]; then
+        echo "check_timeouts: $f is missing (make ls-v1.7.0 delay-shim)" >&2
+        exit 2
+    fi
+done
+
+tmp=$(mktemp -d) || exit 2
+trap 'rm -rf "$tmp"' EXIT
+mkdir -p "$tmp/t/ok" "$tmp/t/slowdir"
+touch "$tmp/t/ok/a" "$tmp/t/plain" "$tmp/t/slowstat" "$tmp/t/slowdir/x"
+
+failures=0
+
+check()
+{
+    if eval "$2"; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1"
+        failures=$((failures + 1))
+    fi
+}
+
+# Runs ls under the shim with LSDIR_DELAY_MATCH=$1 and the rest as options;
+# stdout, stderr and the elapsed milliseconds land in $tmp/out, err, ms.
+run()
+{
+    match=$1
+    shift
+    start=$(date +%s%N)
+    (cd "$tmp" && LD_PRELOAD=$SHIM LSDIR_DELAY_MATCH=$match LSDIR_DELAY_MS=$DELAY_MS \
+        "$LS" "$@" t) > "$tmp/out" 2> "$tmp/err"
+    echo $((($(date +%s%N) - start) / 1000000)) > "$tmp/ms"
+}
+
+# A stat that hangs: the entry is listed with "?" fields, the rest as usual.
+run slowstat -lR --timeout-stat=200 --timeout-dir=1000
+check "--timeout-stat gives up before the delay" '[ "$(cat "$tmp/ms")" -lt $DELAY_MS ]'
+check "--timeout-stat lists a ? row" 'grep -q "^?????????? ? .* slowstat$" "$tmp/out"'
+check "--timeout-stat lists the other entries" 'grep -q " plain$" "$tmp/out" && grep -q "^t/ok:$" "$tmp/out"'
+check "--timeout-stat reports the entry" 'grep -q "^t: 1 entry timed out$" "$tmp/err"'
+check "--timeout-stat reports the directory" \
+    'grep -q "^timeouts: 1 stat, 0 directories unread; 1 directory incomplete:$" "$tmp/err" &&
+     grep -q "^  t$" "$tmp/err"'
+
+# An open that hangs (the path, not the bare name the parent stats): the
+# directory is skipped, its siblings are not.
+run /slowdir -lR --timeout-dir=300
+check "--timeout-dir gives up before the delay" '[ "$(cat "$tmp/ms")" -lt $DELAY_MS ]'
+check "--timeout-dir leaves the directory out" '! grep -q "^t/slowdir:$" "$tmp/out"'
+check "--timeout-dir lists the other directories" 'grep -q "^t/ok:$" "$tmp/out" && grep -q " slowstat$" "$tmp/out"'
+check "--timeout-dir reports the directory" \
+    'grep -q "^t/slowdir: timed out reading directory$" "$tmp/err" &&
+     grep -q "^timeouts: 0 stats, 1 directory unread; 1 directory incomplete:$" "$tmp/err" &&
+     grep -q "^  t/slowdir$" "$tmp/err"'
+
+# Without deadlines the same tree is complete and quiet.
+run nothing-matches -lR --timeout-stat=200 --timeout-dir=1000
+check "no delay, no report" '[ ! -s "$tmp/err" ] && grep -q "^t/slowdir:$" "$tmp/out"'
+
+[ $failures -eq 0 ]
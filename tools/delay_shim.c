@@ -0,0 +1,70 @@
+#define _GNU_SOURCE         /* RTLD_NEXT, statx() */
+
+/*
+ * delay_shim: an LD_PRELOAD library that makes a local tree behave like a
+ * slow or hung mount, for trying out --timeout-dir and --timeout-stat.
+ *
+ *     make delay-shim
+ *     LD_PRELOAD=tools/delay_shim.so LSDIR_DELAY_MATCH=stale LSDIR_DELAY_MS=5000 \
+ *         bin/ls -lR --timeout-stat=200 --timeout-dir=1000 tree
+ *
+ * Every statx(), fstatat() and openat() whose path argument contains
+ * LSDIR_DELAY_MATCH sleeps LSDIR_DELAY_MS milliseconds (default 1000)
+ * before it is passed on. Note that the path is the one handed to the
+ * call: a bare entry name for the stats of a directory's entries, the
+ * directory's path for its open.
+ */
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+static void maybe_delay(const char *path)
+{
+    const char *match = getenv("LSDIR_DELAY_MATCH");
+    if (!match || !*match || !path || !strstr(path, match))
+        return;
+
+    const char *ms_env = getenv("LSDIR_DELAY_MS");
+    long ms = ms_env ? atol(ms_env) : 1000;
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) == -1)
+        ;
+}
+
+int statx(int dirfd, const char *path, int flags, unsigned int mask, struct statx *buf)
+{
+    static int (*real)(int, const char *, int, unsigned int, struct statx *);
+    if (!real) real = dlsym(RTLD_NEXT, "statx");
+    maybe_delay(path);
+    return real(dirfd, path, flags, mask, buf);
+}
+
+int fstatat(int dirfd, const char *path, struct stat *buf, int flags)
+{
+    static int (*real)(int, const char *, struct stat *, int);
+    if (!real) real = dlsym(RTLD_NEXT, "fstatat");
+    maybe_delay(path);
+    return real(dirfd, path, buf, flags);
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+    static int (*real)(int, const char *, int, ...);
+    if (!real) real = dlsym(RTLD_NEXT, "openat");
+
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE))
+    {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    maybe_delay(path);
+    return real(dirfd, path, flags, mode);
+}